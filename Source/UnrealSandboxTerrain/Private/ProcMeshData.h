@@ -56,6 +56,76 @@ struct FProcMeshVertex {
 	{}
 };
 
+/**
+*	Vertex of the terrain mesh as it is stored once the mesh is done.
+*	Terrain only needs a position, a normal and the material weight, so the position is quantized to 16 bits per axis
+*	inside the bounds of the zone, the normal direction is octahedral encoded to two 16 bit values and the weight is one byte.
+*	Only MeshData and the mesh and collision components hold packed vertices. The scene proxy expands them for the
+*	local vertex factory, which reads float positions, so GPU vertex buffers are as large as before.
+*/
+struct FProcMeshPackedVertex {
+	/** Position in quantization steps from the lower corner of the packed section bounds */
+	uint16 Position[3];
+
+	/** Octahedral coordinates of the normal direction */
+	int16 Normal[2];
+
+	/** Material weight, the red channel of the vertex color */
+	uint8 MaterialWeight;
+
+	uint8 Reserved;
+
+	FProcMeshPackedVertex()
+		: MaterialWeight(0)
+		, Reserved(0)
+	{
+		Position[0] = Position[1] = Position[2] = 0;
+		Normal[0] = Normal[1] = 0;
+	}
+
+	/** Encodes the direction of a normal. A zero normal is stored as up */
+	void SetNormal(const FVector& InNormal)
+	{
+		const float L1 = FMath::Abs(InNormal.X) + FMath::Abs(InNormal.Y) + FMath::Abs(InNormal.Z);
+		if (L1 <= 0.f) {
+			Normal[0] = Normal[1] = 0;
+			return;
+		}
+
+		float X = InNormal.X / L1;
+		float Y = InNormal.Y / L1;
+
+		// lower hemisphere is folded over the diagonals
+		if (InNormal.Z < 0.f) {
+			const float FoldX = (1.f - FMath::Abs(Y)) * (X >= 0.f ? 1.f : -1.f);
+			const float FoldY = (1.f - FMath::Abs(X)) * (Y >= 0.f ? 1.f : -1.f);
+			X = FoldX;
+			Y = FoldY;
+		}
+
+		Normal[0] = (int16)FMath::RoundToInt(FMath::Clamp(X, -1.f, 1.f) * MAX_int16);
+		Normal[1] = (int16)FMath::RoundToInt(FMath::Clamp(Y, -1.f, 1.f) * MAX_int16);
+	}
+
+	/** Unit normal */
+	FVector GetNormal() const
+	{
+		float X = Normal[0] / (float)MAX_int16;
+		float Y = Normal[1] / (float)MAX_int16;
+		const float Z = 1.f - FMath::Abs(X) - FMath::Abs(Y);
+
+		if (Z < 0.f) {
+			const float UnfoldX = (1.f - FMath::Abs(Y)) * (X >= 0.f ? 1.f : -1.f);
+			const float UnfoldY = (1.f - FMath::Abs(X)) * (Y >= 0.f ? 1.f : -1.f);
+			X = UnfoldX;
+			Y = UnfoldY;
+		}
+
+		const FVector Result(X, Y, Z);
+		return Result * FMath::InvSqrt(Result | Result);
+	}
+};
+
 /** One section of the procedural mesh. Each material has its own section. */
 struct FProcMeshSection {
 	/** Vertex buffer for this section */
@@ -88,4 +158,148 @@ struct FProcMeshSection {
 		bEnableCollision = false;
 		bSectionVisible = true;
 	}
-};
\ No newline at end of file
+};
+
+/** Index buffer of a packed section. Indices are 16 bit when the section has no more vertices than they can address */
+struct FProcMeshIndexArray {
+	FProcMeshIndexArray()
+		: b16Bit(true)
+	{}
+
+	FORCEINLINE int32 Num() const
+	{
+		return b16Bit ? Indices16.Num() : Indices32.Num();
+	}
+
+	FORCEINLINE int32 operator[](int32 Index) const
+	{
+		return b16Bit ? (int32)Indices16[Index] : Indices32[Index];
+	}
+
+	FORCEINLINE bool Is16Bit() const
+	{
+		return b16Bit;
+	}
+
+	/** Size of one index in bytes */
+	FORCEINLINE uint32 GetStride() const
+	{
+		return b16Bit ? sizeof(uint16) : sizeof(int32);
+	}
+
+	FORCEINLINE const void* GetData() const
+	{
+		return b16Bit ? (const void*)Indices16.GetData() : (const void*)Indices32.GetData();
+	}
+
+	uint32 GetAllocatedSize() const
+	{
+		return Indices16.GetAllocatedSize() + Indices32.GetAllocatedSize();
+	}
+
+	/** Replaces the indices with Src, which index NumVertices vertices */
+	void Set(const TArray<int32>& Src, int32 NumVertices)
+	{
+		b16Bit = NumVertices <= (int32)MAX_uint16 + 1;
+
+		if (b16Bit) {
+			Indices32.Empty();
+			Indices16.SetNumUninitialized(Src.Num());
+			for (int32 Idx = 0; Idx < Src.Num(); Idx++) {
+				Indices16[Idx] = (uint16)Src[Idx];
+			}
+		} else {
+			Indices16.Empty();
+			Indices32 = Src;
+		}
+	}
+
+	void Empty()
+	{
+		Indices16.Empty();
+		Indices32.Empty();
+		b16Bit = true;
+	}
+
+private:
+	TArray<uint16> Indices16;
+	TArray<int32> Indices32;
+	bool b16Bit;
+};
+
+/** Terrain mesh section with packed vertices. Sections of one zone share the quantization bounds so common vertices match */
+struct FProcMeshPackedSection {
+	/** Vertex buffer for this section */
+	TArray<FProcMeshPackedVertex> ProcVertexBuffer;
+
+	/** Index buffer for this section */
+	FProcMeshIndexArray ProcIndexBuffer;
+
+	/** Local bounding box of section */
+	FBox SectionLocalBox;
+
+	/** Local position of quantized position 0 */
+	FVector PositionOrigin;
+
+	/** Size of one quantization step on each axis */
+	FVector PositionStep;
+
+	/** Should we build collision data for triangles in this section */
+	bool bEnableCollision;
+
+	/** Should we display this section */
+	bool bSectionVisible;
+
+	FProcMeshPackedSection()
+		: SectionLocalBox(0)
+		, PositionOrigin(0.f, 0.f, 0.f)
+		, PositionStep(1.f, 1.f, 1.f)
+		, bEnableCollision(false)
+		, bSectionVisible(true)
+	{}
+
+	/** Local position of the vertex */
+	FORCEINLINE FVector GetPosition(int32 Index) const
+	{
+		const FProcMeshPackedVertex& Vertex = ProcVertexBuffer[Index];
+		return PositionOrigin + FVector(Vertex.Position[0] * PositionStep.X, Vertex.Position[1] * PositionStep.Y, Vertex.Position[2] * PositionStep.Z);
+	}
+
+	/** Replaces the content with the packed vertices and the indices of Src. Vertices must be inside Bounds */
+	void Pack(const FProcMeshSection& Src, const FBox& Bounds)
+	{
+		PositionOrigin = Bounds.Min;
+		PositionStep = (Bounds.Max - Bounds.Min) / (float)MAX_uint16;
+
+		const FVector Scale(PositionStep.X > 0.f ? 1.f / PositionStep.X : 0.f, PositionStep.Y > 0.f ? 1.f / PositionStep.Y : 0.f, PositionStep.Z > 0.f ? 1.f / PositionStep.Z : 0.f);
+
+		ProcVertexBuffer.SetNumUninitialized(Src.ProcVertexBuffer.Num());
+		for (int32 VertIdx = 0; VertIdx < Src.ProcVertexBuffer.Num(); VertIdx++) {
+			const FProcMeshVertex& SrcVertex = Src.ProcVertexBuffer[VertIdx];
+			FProcMeshPackedVertex& Vertex = ProcVertexBuffer[VertIdx];
+			const FVector Local = (SrcVertex.Position - PositionOrigin) * Scale;
+
+			Vertex.Position[0] = (uint16)FMath::Clamp(FMath::RoundToInt(Local.X), 0, (int32)MAX_uint16);
+			Vertex.Position[1] = (uint16)FMath::Clamp(FMath::RoundToInt(Local.Y), 0, (int32)MAX_uint16);
+			Vertex.Position[2] = (uint16)FMath::Clamp(FMath::RoundToInt(Local.Z), 0, (int32)MAX_uint16);
+			Vertex.SetNormal(SrcVertex.Normal);
+			Vertex.MaterialWeight = SrcVertex.Color.R;
+			Vertex.Reserved = 0;
+		}
+
+		ProcIndexBuffer.Set(Src.ProcIndexBuffer, Src.ProcVertexBuffer.Num());
+		SectionLocalBox = Src.SectionLocalBox;
+		bEnableCollision = Src.bEnableCollision;
+		bSectionVisible = Src.bSectionVisible;
+	}
+
+	/** Reset this section, clear all mesh info. */
+	void Reset()
+	{
+		ProcVertexBuffer.Empty();
+		ProcIndexBuffer.Empty();
+		SectionLocalBox.Init();
+		bEnableCollision = false;
+		bSectionVisible = true;
+	}
+};
@@ -0,0 +1,210 @@
+#include "UnrealSandboxTerrainPrivatePCH.h"
+#include "SandboxTerrainBenchmark.h"
+#include "SandboxVoxeldata.h"
+
+#include <vector>
+
+
+//====================================================================================
+// Voxel layout
+//====================================================================================
+
+template<class Layout>
+static FORCEINLINE int clcLayoutOffset(int brick_num, int x, int y, int z) {
+	const int brick = (x >> VOXEL_BRICK_SHIFT) * brick_num * brick_num + (y >> VOXEL_BRICK_SHIFT) * brick_num + (z >> VOXEL_BRICK_SHIFT);
+	return brick * VOXEL_BRICK_VOLUME + Layout::index(x & VOXEL_BRICK_MASK, y & VOXEL_BRICK_MASK, z & VOXEL_BRICK_MASK);
+}
+
+// dense copy of zone density with bricks ordered by Layout
+template<class Layout>
+static void fillLayoutBuffer(const VoxelData& vd, std::vector<unsigned char>& buffer) {
+	const int brick_num = (vd.num() + VOXEL_BRICK_SIZE - 1) / VOXEL_BRICK_SIZE;
+	buffer.assign(brick_num * brick_num * brick_num * VOXEL_BRICK_VOLUME, 0);
+
+	for (auto x = 0; x < vd.num(); x++) {
+		for (auto y = 0; y < vd.num(); y++) {
+			for (auto z = 0; z < vd.num(); z++) {
+				buffer[clcLayoutOffset<Layout>(brick_num, x, y, z)] = vd.getRawDensity(x, y, z);
+			}
+		}
+	}
+}
+
+// fetch 8 corners of every cell in the same order as VoxelMeshExtractor::generateCell
+template<class Layout>
+static double benchmarkCornerFetch(const std::vector<unsigned char>& buffer, int num, int lod, int iterations, uint32& checksum) {
+	const int brick_num = (num + VOXEL_BRICK_SIZE - 1) / VOXEL_BRICK_SIZE;
+	const int step = 1 << lod;
+	const unsigned char* data = buffer.data();
+
+	double start = FPlatformTime::Seconds();
+
+	for (auto i = 0; i < iterations; i++) {
+		uint32 sum = 0;
+		for (auto x = 0; x < num - step; x += step) {
+			for (auto y = 0; y < num - step; y += step) {
+				for (auto z = 0; z < num - step; z += step) {
+					sum += data[clcLayoutOffset<Layout>(brick_num, x, y + step, z)];
+					sum += data[clcLayoutOffset<Layout>(brick_num, x, y, z)];
+					sum += data[clcLayoutOffset<Layout>(brick_num, x + step, y + step, z)];
+					sum += data[clcLayoutOffset<Layout>(brick_num, x + step, y, z)];
+					sum += data[clcLayoutOffset<Layout>(brick_num, x, y + step, z + step)];
+					sum += data[clcLayoutOffset<Layout>(brick_num, x, y, z + step)];
+					sum += data[clcLayoutOffset<Layout>(brick_num, x + step, y + step, z + step)];
+					sum += data[clcLayoutOffset<Layout>(brick_num, x + step, y, z + step)];
+				}
+			}
+		}
+		checksum += sum;
+	}
+
+	double end = FPlatformTime::Seconds();
+	return (end - start) * 1000 / iterations;
+}
+
+void sandboxBenchmarkVoxelLayout(const VoxelData& vd, int iterations) {
+	std::vector<unsigned char> linear_buffer;
+	std::vector<unsigned char> morton_buffer;
+	fillLayoutBuffer<VoxelLayoutLinear>(vd, linear_buffer);
+	fillLayoutBuffer<VoxelLayoutMorton>(vd, morton_buffer);
+
+	uint32 checksum = 0;
+
+	for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+		VoxelDataParam vdp;
+		vdp.lod = lod;
+
+		double start = FPlatformTime::Seconds();
+		for (auto i = 0; i < iterations; i++) {
+			MeshDataPtr md_ptr = sandboxVoxelGenerateMesh(vd, vdp);
+		}
+		double end = FPlatformTime::Seconds();
+		double mesh_time = (end - start) * 1000 / iterations;
+
+		double linear_time = benchmarkCornerFetch<VoxelLayoutLinear>(linear_buffer, vd.num(), lod, iterations, checksum);
+		double morton_time = benchmarkCornerFetch<VoxelLayoutMorton>(morton_buffer, vd.num(), lod, iterations, checksum);
+
+		UE_LOG(LogTemp, Warning, TEXT("benchmark voxel layout (%s) -> LOD %d: mesh %f ms, corner fetch linear %f ms, morton %f ms"), VoxelDataLayout::name(), lod, mesh_time, linear_time, morton_time);
+	}
+
+	UE_LOG(LogTemp, Warning, TEXT("benchmark voxel layout -> checksum %u"), checksum);
+}
+
+
+//====================================================================================
+// Vertex reuse
+//====================================================================================
+
+static double benchmarkMeshing(const VoxelData& vd, const VoxelDataParam& vdp, int iterations, int& triangles, int& vertices) {
+	triangles = 0;
+	vertices = 0;
+
+	double start = FPlatformTime::Seconds();
+	for (auto i = 0; i < iterations; i++) {
+		MeshDataPtr md_ptr = sandboxVoxelGenerateMesh(vd, vdp);
+
+		if (i == 0) {
+			for (auto& lod : md_ptr->MeshSectionLodArray) {
+				triangles += lod.mainMesh.ProcIndexBuffer.Num() / 3;
+				vertices += lod.mainMesh.ProcVertexBuffer.Num();
+
+				for (auto& section : lod.transitionMeshArray) {
+					triangles += section.ProcIndexBuffer.Num() / 3;
+					vertices += section.ProcVertexBuffer.Num();
+				}
+			}
+		}
+	}
+	double end = FPlatformTime::Seconds();
+
+	return (end - start) / iterations;
+}
+
+void sandboxBenchmarkVertexReuse(const VoxelData& vd, int iterations) {
+	VoxelDataParam vdp;
+	vdp.bGenerateLOD = true;
+
+	int edge_triangles, edge_vertices;
+	int position_triangles, position_vertices;
+
+	vdp.bPositionVertexMap = false;
+	double edge_time = benchmarkMeshing(vd, vdp, iterations, edge_triangles, edge_vertices);
+
+	vdp.bPositionVertexMap = true;
+	double position_time = benchmarkMeshing(vd, vdp, iterations, position_triangles, position_vertices);
+
+	UE_LOG(LogTemp, Warning, TEXT("benchmark vertex reuse (%d) -> edge: %d triangles, %d vertices, %f ms, %f triangles/sec"), vd.num(), edge_triangles, edge_vertices, edge_time * 1000, edge_triangles / edge_time);
+	UE_LOG(LogTemp, Warning, TEXT("benchmark vertex reuse (%d) -> position: %d triangles, %d vertices, %f ms, %f triangles/sec"), vd.num(), position_triangles, position_vertices, position_time * 1000, position_triangles / position_time);
+}
+
+
+//====================================================================================
+// Surface nets
+//====================================================================================
+
+void sandboxBenchmarkSurfaceNets(const VoxelData& vd, int iterations) {
+	VoxelDataParam vdp;
+	vdp.bGenerateLOD = true;
+	vdp.collisionLOD = -1;
+
+	// no transition cells, both meshers make the same zone faces
+	for (auto face = 0; face < VOXEL_ZONE_FACES; face++) {
+		vdp.neighbour_lod[face] = LOD_ARRAY_SIZE;
+	}
+
+	for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+		vdp.lod_mask = 1 << lod;
+
+		int transvoxel_triangles, transvoxel_vertices;
+		int nets_triangles, nets_vertices;
+
+		vdp.bSurfaceNets = false;
+		double transvoxel_time = benchmarkMeshing(vd, vdp, iterations, transvoxel_triangles, transvoxel_vertices);
+
+		vdp.bSurfaceNets = true;
+		double nets_time = benchmarkMeshing(vd, vdp, iterations, nets_triangles, nets_vertices);
+
+		UE_LOG(LogTemp, Warning, TEXT("benchmark surface nets (%d) lod %d -> transvoxel: %d triangles, %d vertices, %f ms; surface nets: %d triangles, %d vertices, %f ms; speedup %fx"),
+			vd.num(), lod, transvoxel_triangles, transvoxel_vertices, transvoxel_time * 1000, nets_triangles, nets_vertices, nets_time * 1000, (nets_time > 0) ? transvoxel_time / nets_time : 0);
+	}
+}
+
+
+//====================================================================================
+// Vertex cache
+//====================================================================================
+
+static void logVertexCacheStats(const VoxelData& vd, int lod, int section_index, const FProcMeshPackedSection& section, const MeshSectionCacheStats& stats) {
+	if (section.ProcIndexBuffer.Num() == 0) {
+		return;
+	}
+
+	UE_LOG(LogTemp, Warning, TEXT("benchmark vertex cache (%d) lod %d section %d -> %d triangles, %d vertices, ACMR %f -> %f, fetch %f -> %f"),
+		vd.num(), lod, section_index, section.ProcIndexBuffer.Num() / 3, section.ProcVertexBuffer.Num(), stats.acmr_before, stats.acmr_after, stats.fetch_before, stats.fetch_after);
+}
+
+void sandboxBenchmarkVertexCache(const VoxelData& vd, int iterations) {
+	VoxelDataParam vdp;
+	vdp.bGenerateLOD = true;
+
+	int triangles, vertices;
+
+	vdp.bOptimizeVertexCache = false;
+	double plain_time = benchmarkMeshing(vd, vdp, iterations, triangles, vertices);
+
+	vdp.bOptimizeVertexCache = true;
+	double optimized_time = benchmarkMeshing(vd, vdp, iterations, triangles, vertices);
+
+	UE_LOG(LogTemp, Warning, TEXT("benchmark vertex cache (%d) -> %d triangles, %f ms, optimized %f ms"), vd.num(), triangles, plain_time * 1000, optimized_time * 1000);
+
+	// section 0 is the main mesh, 1 .. 6 the transition sections
+	MeshDataPtr md_ptr = sandboxVoxelGenerateMesh(vd, vdp);
+	for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+		const MeshLodSection& lod_section = md_ptr->MeshSectionLodArray[lod];
+		logVertexCacheStats(vd, lod, 0, lod_section.mainMesh, lod_section.mainCacheStats);
+
+		for (auto i = 0; i < 6; i++) {
+			logVertexCacheStats(vd, lod, i + 1, lod_section.transitionMeshArray[i], lod_section.transitionCacheStats[i]);
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "EngineMinimal.h"
+
+class VoxelData;
+
+// Meshing time of the zone at every LOD with the compiled voxel layout
+// and 8-corner fetch time of the linear and Morton layouts side by side.
+void sandboxBenchmarkVoxelLayout(const VoxelData& vd, int iterations);
+
+// Triangles per second of the zone meshed with all LODs, vertices reused
+// by voxel edge and deduplicated by position side by side.
+void sandboxBenchmarkVertexReuse(const VoxelData& vd, int iterations);
+
+// Triangles, vertices and meshing time of the zone at each LOD meshed
+// with Transvoxel and with surface nets side by side.
+void sandboxBenchmarkSurfaceNets(const VoxelData& vd, int iterations);
+
+// Meshing time of the zone with and without the vertex cache pass and
+// ACMR and vertex fetch of every section before and after it.
+void sandboxBenchmarkVertexCache(const VoxelData& vd, int iterations);
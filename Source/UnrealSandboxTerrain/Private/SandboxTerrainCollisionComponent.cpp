@@ -32,20 +32,17 @@ bool USandboxTerrainCollisionComponent::GetPhysicsTriMeshData(struct FTriMeshCol
 		CollisionData->UVs.AddZeroed(1); // only one UV channel
 	}
 
-	if (!this->mesh_data_ptr) return false;
+	if (!bHasCollisionSection) return false;
 
-	MeshData* mesh_data = mesh_data_ptr.get();
-
-	if (mesh_data->CollisionMeshPtr == NULL) return false;
-
-	FProcMeshSection* Section = mesh_data->CollisionMeshPtr;
-	// Copy vert data
+	const FProcMeshPackedSection* Section = &CollisionSection;
+	// Unpack vert data
+	CollisionData->Vertices.Reserve(CollisionData->Vertices.Num() + Section->ProcVertexBuffer.Num());
 	for (int32 VertIdx = 0; VertIdx < Section->ProcVertexBuffer.Num(); VertIdx++) {
-		CollisionData->Vertices.Add(Section->ProcVertexBuffer[VertIdx].Position);
+		CollisionData->Vertices.Add(Section->GetPosition(VertIdx));
 
-		// Copy UV if desired
+		// Terrain has no UVs, keep the channel in step with the vertices
 		if (bCopyUVs) {
-			CollisionData->UVs[0].Add(Section->ProcVertexBuffer[VertIdx].UV0);
+			CollisionData->UVs[0].Add(FVector2D(0.f, 0.f));
 		}
 	}
 
@@ -125,18 +122,11 @@ void USandboxTerrainCollisionComponent::SetCollisionConvexMeshes(const TArray< T
 void USandboxTerrainCollisionComponent::UpdateLocalBounds() {
 	FBox LocalBox(0);
 
-	if (!this->mesh_data_ptr) {
+	if (!bHasCollisionSection) {
 		return;
 	}
 
-	MeshData* mesh_data = mesh_data_ptr.get();
-
-	if (mesh_data->CollisionMeshPtr == NULL) {
-		return;
-	}
-
-	FProcMeshSection* Section = mesh_data->CollisionMeshPtr;
-	LocalBox += Section->SectionLocalBox;
+	LocalBox += CollisionSection.SectionLocalBox;
 
 	LocalBounds = LocalBox.IsValid ? FBoxSphereBounds(LocalBox) : FBoxSphereBounds(FVector(0, 0, 0), FVector(0, 0, 0), 0); // fallback to reset box sphere bounds
 
@@ -159,17 +149,7 @@ bool UZoneMeshCollisionData::ContainsPhysicsTriMeshData(bool InUseAllTriData) co
 }
 
 bool USandboxTerrainCollisionComponent::ContainsPhysicsTriMeshData(bool InUseAllTriData) const {
-	if (!this->mesh_data_ptr) {
-		return false;
-	}
-
-	MeshData* mesh_data = mesh_data_ptr.get();
-
-	if (mesh_data->CollisionMeshPtr == NULL) {
-		return false;
-	}
-
-	return true;
+	return bHasCollisionSection;
 }
 
 void USandboxTerrainCollisionComponent::CreateProcMeshBodySetup() {
@@ -227,7 +207,15 @@ UBodySetup* USandboxTerrainCollisionComponent::GetBodySetup() {
 }
 
 void USandboxTerrainCollisionComponent::SetMeshData(MeshDataPtr md_ptr) {
-	this->mesh_data_ptr = md_ptr;
+	// only the collision section is kept, the render LODs of the mesh data are released with it
+	MeshData* mesh_data = md_ptr.get();
+	bHasCollisionSection = mesh_data != NULL && mesh_data->CollisionMeshPtr != NULL;
+
+	if (bHasCollisionSection) {
+		CollisionSection = *mesh_data->CollisionMeshPtr;
+	} else {
+		CollisionSection.Reset();
+	}
 
 	UpdateLocalBounds();
 	UpdateCollision();
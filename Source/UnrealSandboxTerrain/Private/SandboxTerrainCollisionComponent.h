@@ -76,7 +76,9 @@ public:
 
 private:
 
-	std::shared_ptr<MeshData> mesh_data_ptr;
+	FProcMeshPackedSection CollisionSection;
+
+	bool bHasCollisionSection = false;
 
 	//~ Begin USceneComponent Interface.
 	virtual FBoxSphereBounds CalcBounds(const FTransform& LocalToWorld) const override;
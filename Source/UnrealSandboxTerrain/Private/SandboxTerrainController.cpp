@@ -9,6 +9,18 @@
 #include "Async.h"
 
 #include "SandboxTerrainMeshComponent.h"
+#include "SandboxTerrainBenchmark.h"
+#include "SandboxVoxelBufferPool.h"
+
+DECLARE_STATS_GROUP(TEXT("SandboxTerrain"), STATGROUP_SandboxTerrain, STATCAT_Advanced);
+DECLARE_MEMORY_STAT(TEXT("Resident zones"), STAT_SandboxTerrainResidentZones, STATGROUP_SandboxTerrain);
+DECLARE_MEMORY_STAT(TEXT("Zone memory budget"), STAT_SandboxTerrainZoneBudget, STATGROUP_SandboxTerrain);
+
+// seconds between zone memory budget checks
+#define ZONE_RESIDENCY_CHECK_INTERVAL 1.0
+
+// seconds between checks of the transition faces of the zone meshes
+#define ZONE_LOD_CHECK_INTERVAL 0.25
 
 
 class FLoadInitialZonesThread : public FRunnable {
@@ -80,8 +92,9 @@ public:
 					controller->invokeLazyZoneAsync(index);
 				} else {
 					zone->setVoxelData(new_vd);
+					uint64 mesh_version = new_vd->getChangeVersion();
 					std::shared_ptr<MeshData> md_ptr = zone->generateMesh();
-					zone->getVoxelData()->resetLastMeshRegenerationTime();
+					new_vd->resetLastMeshRegenerationTime(mesh_version);
 					controller->invokeZoneMeshAsync(zone, md_ptr);
 				}
 			}
@@ -89,6 +102,7 @@ public:
 			controller->OnLoadZoneProgress(i, zone_list.Num());
 		}
 
+		controller->RemeshApronZones();
 		controller->OnLoadZoneListFinished();
 
 		state = TH_STATE_FINISHED;
@@ -103,6 +117,19 @@ ASandboxTerrainController::ASandboxTerrainController(const FObjectInitializer& O
 	TerrainSize = 5;
 	ZoneGridDimension = EVoxelDimEnum::VS_64;
 	bEnableLOD = false;
+	bEnableDensityMips = false;
+	bEnableZoneApron = false;
+	bGradientNormals = false;
+	bSurfaceNets = false;
+	bOptimizeVertexCache = false;
+	bLogVertexCacheStats = false;
+	CollisionLOD = 0;
+	ActiveTerrainEditCount = 0;
+	ZoneRestoreTaskCount = 0;
+	bStopZoneRestore = false;
+	ZoneSaveTaskCount = 0;
+	ZoneLodTaskCount = 0;
+	bStopZoneLod = false;
 }
 
 ASandboxTerrainController::ASandboxTerrainController() {
@@ -111,6 +138,19 @@ ASandboxTerrainController::ASandboxTerrainController() {
 	TerrainSize = 5;
 	ZoneGridDimension = EVoxelDimEnum::VS_64;
 	bEnableLOD = false;
+	bEnableDensityMips = false;
+	bEnableZoneApron = false;
+	bGradientNormals = false;
+	bSurfaceNets = false;
+	bOptimizeVertexCache = false;
+	bLogVertexCacheStats = false;
+	CollisionLOD = 0;
+	ActiveTerrainEditCount = 0;
+	ZoneRestoreTaskCount = 0;
+	bStopZoneRestore = false;
+	ZoneSaveTaskCount = 0;
+	ZoneLodTaskCount = 0;
+	bStopZoneLod = false;
 }
 
 void ASandboxTerrainController::BeginPlay() {
@@ -167,6 +207,21 @@ void ASandboxTerrainController::EndPlay(const EEndPlayReason::Type EndPlayReason
 		initial_zone_loader->WaitForFinish();
 	}
 
+	bStopZoneRestore = true;
+	while (ZoneRestoreTaskCount > 0) {
+		FPlatformProcess::Sleep(0.001f);
+	}
+
+	bStopZoneLod = true;
+	while (ZoneLodTaskCount > 0) {
+		FPlatformProcess::Sleep(0.001f);
+	}
+
+	// evicted zones are saved to the end
+	while (ZoneSaveTaskCount > 0) {
+		FPlatformProcess::Sleep(0.001f);
+	}
+
 	if (GetWorld()->GetAuthGameMode() == NULL) {
 		return;
 	}
@@ -196,6 +251,11 @@ void ASandboxTerrainController::EndPlay(const EEndPlayReason::Type EndPlayReason
 	}
 
 	TerrainZoneMap.Empty();
+
+	ZoneLodPendingSet.Empty();
+
+	ZoneLruList.clear();
+	ZoneLruMap.Empty();
 }
 
 void ASandboxTerrainController::Tick(float DeltaTime) {
@@ -207,6 +267,364 @@ void ASandboxTerrainController::Tick(float DeltaTime) {
 			task.f();
 		}
 	}	
+
+	UpdateViewLocation();
+
+	double now = FPlatformTime::Seconds();
+	if (now - LastZoneResidencyCheck > ZONE_RESIDENCY_CHECK_INTERVAL) {
+		LastZoneResidencyCheck = now;
+		CheckZoneResidency();
+	}
+
+	if (bEnableLOD && now - LastZoneLodCheck > ZONE_LOD_CHECK_INTERVAL) {
+		LastZoneLodCheck = now;
+		UpdateZoneLods();
+	}
+}
+
+void ASandboxTerrainController::UpdateViewLocation() {
+	APlayerController* PlayerController = GetWorld()->GetFirstPlayerController();
+	if (PlayerController == NULL) {
+		return;
+	}
+
+	FVector Location;
+	FRotator Rotation;
+	PlayerController->GetPlayerViewPoint(Location, Rotation);
+
+	ViewLocationMutex.lock();
+	ViewLocation = Location;
+	bHasViewLocation = true;
+	ViewLocationMutex.unlock();
+}
+
+bool ASandboxTerrainController::GetViewLocation(FVector& Location) {
+	ViewLocationMutex.lock();
+	Location = ViewLocation;
+	bool bHas = bHasViewLocation;
+	ViewLocationMutex.unlock();
+
+	return bHas;
+}
+
+//======================================================================================================================================================================
+// Zone LOD
+//======================================================================================================================================================================
+
+// same lod the mesh proxy draws the zone with
+int ASandboxTerrainController::GetZoneLod(FVector index, const FVector& Location) {
+	return USandboxTerrainMeshComponent::GetLodIndexForDistance(FVector::Dist(Location, index * 1000));
+}
+
+// lods of the zones behind the faces, LOD_ARRAY_SIZE if there is no zone, so the face gets no transition cells
+void ASandboxTerrainController::GetZoneNeighbourLod(FVector index, const FVector& Location, int* NeighbourLod) {
+	static const FVector FaceOffset[VOXEL_ZONE_FACES] = { FVector(-1, 0, 0), FVector(1, 0, 0), FVector(0, -1, 0), FVector(0, 1, 0), FVector(0, 0, -1), FVector(0, 0, 1) };
+
+	for (auto face = 0; face < VOXEL_ZONE_FACES; face++) {
+		FVector neighbour_index = index + FaceOffset[face];
+		NeighbourLod[face] = (getZoneByVectorIndex(neighbour_index) != NULL) ? GetZoneLod(neighbour_index, Location) : LOD_ARRAY_SIZE;
+	}
+}
+
+// collision is a LOD of the band the zone is drawn with, so it needs no pass of its own
+int ASandboxTerrainController::GetZoneCollisionLod(int Lod) {
+	const int CoarsestLod = FMath::FloorLog2(sandboxLodBandMask(Lod));
+	return (Lod == 0) ? FMath::Min((int)CollisionLOD, CoarsestLod) : CoarsestLod;
+}
+
+// Zones are meshed at the LODs of their distance band only. The LODs of the band that are missing when
+// the view moves are built in the background. The drawn lod is built again when its faces with transition
+// cells change, because the zone or a neighbour moved to another lod or a neighbour zone was added or evicted,
+// the collision lod when the zone moved to another band.
+void ASandboxTerrainController::UpdateZoneLods() {
+	FVector Location;
+	if (!GetViewLocation(Location)) {
+		return;
+	}
+
+	for (auto& Elem : TerrainZoneMap) {
+		const FVector index = Elem.Key;
+		UTerrainZoneComponent* Zone = Elem.Value;
+
+		// zones without a mesh are meshed by the loader or an edit
+		if (Zone == NULL || Zone->getVoxelData() == NULL || Zone->MainTerrainMesh->GetLodMask() == 0 || ZoneLodPendingSet.Contains(index)) {
+			continue;
+		}
+
+		const int Lod = GetZoneLod(index, Location);
+
+		int NeighbourLod[VOXEL_ZONE_FACES];
+		GetZoneNeighbourLod(index, Location, NeighbourLod);
+
+		int LodMask = sandboxLodBandMask(Lod) & ~Zone->MainTerrainMesh->GetLodMask();
+		// surface nets have no transition cells
+		if (!bSurfaceNets && Zone->MainTerrainMesh->HasLod(Lod) && Zone->MainTerrainMesh->GetTransitionFaceMask(Lod) != sandboxTransitionFaceMask(NeighbourLod, Lod)) {
+			LodMask |= 1 << Lod;
+		}
+
+		// the collision follows the band, its lod is built again to take it from
+		const int CollisionLod = GetZoneCollisionLod(Lod);
+		const bool bUpdateCollision = Zone->GetCollisionLod() != CollisionLod;
+		if (bUpdateCollision) {
+			LodMask |= 1 << CollisionLod;
+		}
+
+		if (LodMask == 0) {
+			continue;
+		}
+
+		// the zone is not evicted while it is pending
+		ZoneLodPendingSet.Add(index);
+		ZoneLodTaskCount++;
+
+		// The task gets no zone, only its voxel data that stays while it is pending and the parameters.
+		// EndPlay waits for the task, the zone is looked up again on the game thread to apply the mesh.
+		VoxelData* vd = Zone->getVoxelData();
+		const VoxelDataParam vdp = Zone->makeMeshParam(LodMask, bUpdateCollision);
+
+		Async<void>(EAsyncExecution::ThreadPool, [=]() {
+			std::shared_ptr<MeshData> md_ptr;
+			if (!bStopZoneLod) {
+				VoxelDataSnapshotPtr vd_snapshot = vd->snapshot();
+
+				if (vd_snapshot->getDensityFillState() == VoxelDataFillState::MIX) {
+					// the drawn lod is applied before the others are done
+					md_ptr = sandboxVoxelGenerateMesh(*vd_snapshot, vdp, [=](MeshDataPtr lod_md_ptr) {
+						invokeZoneMeshAsync(index, lod_md_ptr);
+					});
+				}
+			}
+
+			TerrainControllerTask task;
+			task.f = [=]() {
+				ZoneLodPendingSet.Remove(index);
+
+				UTerrainZoneComponent* Zone = getZoneByVectorIndex(index);
+				if (md_ptr && Zone != NULL) {
+					Zone->applyTerrainMesh(md_ptr);
+				}
+			};
+
+			AddAsyncTask(task);
+			ZoneLodTaskCount--;
+		});
+	}
+}
+
+//======================================================================================================================================================================
+// Zone residency
+//======================================================================================================================================================================
+
+void ASandboxTerrainController::CheckZoneResidency() {
+	APlayerController* PlayerController = GetWorld()->GetFirstPlayerController();
+	APawn* Pawn = (PlayerController != NULL) ? PlayerController->GetPawn() : NULL;
+
+	// evicted zones come back in the background when the player approaches them, all of them in one batch
+	if (Pawn != NULL) {
+		TArray<FVector> RestoreList;
+
+		VoxelDataMapMutex.lock();
+		for (const FVector& index : EvictedZoneSet) {
+			FVector ZoneOrigin = index * 1000;
+			if (FVector::Dist(ZoneOrigin, Pawn->GetActorLocation()) < ZoneEvictionDistance) {
+				RestoreList.Add(index);
+			}
+		}
+
+		for (const FVector& index : RestoreList) {
+			EvictedZoneSet.Remove(index);
+			RestoringZoneSet.Add(index);
+		}
+		VoxelDataMapMutex.unlock();
+
+		if (RestoreList.Num() > 0) {
+			RestoreEvictedZonesAsync(RestoreList);
+		}
+	}
+
+	// voxel data and zone pointers are held by edit threads, the initial loader, lod meshing and queued tasks
+	if (ActiveTerrainEditCount > 0 || ZoneRestoreTaskCount > 0 || HasNextAsyncTask() || ZoneLodPendingSet.Num() > 0) {
+		return;
+	}
+
+	if (initial_zone_loader != NULL && !initial_zone_loader->IsFinished()) {
+		return;
+	}
+
+	auto GetZoneResidentSize = [&](const FVector& index) {
+		SIZE_T Size = VoxelDataMap[index]->getMemorySize();
+
+		UTerrainZoneComponent* ZoneComponent = getZoneByVectorIndex(index);
+		if (ZoneComponent != NULL) {
+			Size += ZoneComponent->GetMeshDataSize();
+		}
+
+		return Size;
+	};
+
+	SIZE_T ResidentSize = 0;
+
+	VoxelDataMapMutex.lock();
+	for (auto& Elem : VoxelDataMap) {
+		ResidentSize += GetZoneResidentSize(Elem.Key);
+	}
+	VoxelDataMapMutex.unlock();
+
+	const SIZE_T Budget = (SIZE_T)FMath::Max(ZoneMemoryBudgetMB, 0) * 1024 * 1024;
+
+	SET_MEMORY_STAT(STAT_SandboxTerrainResidentZones, ResidentSize);
+	SET_MEMORY_STAT(STAT_SandboxTerrainZoneBudget, Budget);
+
+	if (Budget == 0 || ResidentSize <= Budget) {
+		return;
+	}
+
+	const bool bCanSave = GetWorld()->GetAuthGameMode() != NULL;
+	TArray<FVector> EvictList;
+
+	// least recently touched first, until enough of them are found
+	VoxelDataMapMutex.lock();
+	for (const FVector& index : ZoneLruList) {
+		if (ResidentSize <= Budget) {
+			break;
+		}
+
+		if (Pawn != NULL && FVector::Dist(index * 1000, Pawn->GetActorLocation()) < ZoneEvictionDistance) {
+			continue;
+		}
+
+		// like EndPlay, only the server saves zones, so clients keep changed ones
+		if (!bCanSave && VoxelDataMap[index]->isChanged()) {
+			continue;
+		}
+
+		ResidentSize -= GetZoneResidentSize(index);
+		EvictList.Add(index);
+	}
+	VoxelDataMapMutex.unlock();
+
+	EvictZonesAsync(EvictList);
+
+	SET_MEMORY_STAT(STAT_SandboxTerrainResidentZones, ResidentSize);
+	UE_LOG(LogTemp, Warning, TEXT("ASandboxTerrainController::CheckZoneResidency ----> evicted %d zones, resident %.1f MB of %d MB"), EvictList.Num(), ResidentSize / (1024.0 * 1024.0), ZoneMemoryBudgetMB);
+}
+
+// Zones leave the maps and their components are destroyed on the game thread, foliage is serialized there too.
+// Files are written on a pool thread, the zones are added to EvictedZoneSet when they can be loaded again.
+void ASandboxTerrainController::EvictZonesAsync(const TArray<FVector>& IndexList) {
+	struct EvictedZone {
+		FVector Index;
+		VoxelData* Data;
+		bool bChanged;
+		FString FileName;
+		bool bSaveFoliage;
+		TArray<uint8> FoliageData;
+		FString FoliageFileName;
+	};
+
+	std::shared_ptr<std::vector<EvictedZone>> ZoneList = std::make_shared<std::vector<EvictedZone>>();
+
+	for (const FVector& index : IndexList) {
+		EvictedZone Evicted;
+		Evicted.Index = index;
+
+		VoxelDataMapMutex.lock();
+		Evicted.Data = VoxelDataMap[index];
+		VoxelDataMap.Remove(index);
+		ZoneLruList.erase(ZoneLruMap[index]);
+		ZoneLruMap.Remove(index);
+		SavingZoneSet.Add(index);
+		VoxelDataMapMutex.unlock();
+
+		Evicted.bChanged = Evicted.Data->isChanged();
+		Evicted.FileName = getZoneFileName(index.X, index.Y, index.Z);
+		Evicted.bSaveFoliage = false;
+
+		UTerrainZoneComponent* Zone = getZoneByVectorIndex(index);
+		if (Zone != NULL) {
+			if (!bDisableFoliage) {
+				FBufferArchive BinaryData;
+				Zone->SerializeInstancedMeshes(BinaryData);
+
+				Evicted.bSaveFoliage = true;
+				Evicted.FoliageData = BinaryData;
+				Evicted.FoliageFileName = Zone->GetInstancedMeshesFileName();
+			}
+
+			TerrainZoneMap.Remove(index);
+			Zone->DestroyZone();
+		}
+
+		ZoneList->push_back(Evicted);
+	}
+
+	if (ZoneList->empty()) {
+		return;
+	}
+
+	ZoneSaveTaskCount++;
+
+	Async<void>(EAsyncExecution::ThreadPool, [=]() {
+		for (EvictedZone& Evicted : *ZoneList) {
+			if (Evicted.bChanged) {
+				sandboxSaveVoxelData(*Evicted.Data, Evicted.FileName);
+			}
+
+			if (Evicted.bSaveFoliage) {
+				FFileHelper::SaveArrayToFile(Evicted.FoliageData, *Evicted.FoliageFileName);
+			}
+
+			delete Evicted.Data;
+
+			VoxelDataMapMutex.lock();
+			SavingZoneSet.Remove(Evicted.Index);
+			EvictedZoneSet.Add(Evicted.Index);
+			VoxelDataMapMutex.unlock();
+			VoxelDataRestored.notify_all();
+		}
+
+		ZoneSaveTaskCount--;
+	});
+}
+
+// Load voxel data of a zone moved from EvictedZoneSet to RestoringZoneSet again and create its zone component
+// on the game thread. createZoneVoxeldata publishes it, so other threads never see it missing or load it twice.
+VoxelData* ASandboxTerrainController::RestoreEvictedZone(FVector index) {
+	FVector v = FVector((float)(index.X * 1000), (float)(index.Y * 1000), (float)(index.Z * 1000));
+	VoxelData* vd = createZoneVoxeldata(v);
+
+	if (vd->getDensityFillState() == VoxelDataFillState::MIX) {
+		invokeLazyZoneAsync(index);
+	}
+
+	return vd;
+}
+
+// zones must be in RestoringZoneSet, files are loaded on a pool thread one by one
+void ASandboxTerrainController::RestoreEvictedZonesAsync(const TArray<FVector>& IndexList) {
+	ZoneRestoreTaskCount++;
+
+	Async<void>(EAsyncExecution::ThreadPool, [=]() {
+		for (const FVector& index : IndexList) {
+			if (bStopZoneRestore) {
+				// not loaded zones stay evicted
+				VoxelDataMapMutex.lock();
+				RestoringZoneSet.Remove(index);
+				EvictedZoneSet.Add(index);
+				VoxelDataMapMutex.unlock();
+				VoxelDataRestored.notify_all();
+				continue;
+			}
+
+			RestoreEvictedZone(index);
+		}
+
+		if (!bStopZoneRestore) {
+			RemeshApronZones();
+		}
+
+		ZoneRestoreTaskCount--;
+	});
 }
 
 //======================================================================================================================================================================
@@ -263,6 +681,8 @@ TSet<FVector> ASandboxTerrainController::spawnInitialZone() {
 		InitialZoneSet.Add(FVector(0, 0, 0));
 	}	
 
+	RemeshApronZones();
+
 	return InitialZoneSet;
 }
 
@@ -346,6 +766,7 @@ public:
 
 	virtual uint32 Run() {
 		instance->editTerrain(origin, radius, strength, zone_handler);
+		instance->ActiveTerrainEditCount--;
 		return 0;
 	}
 };
@@ -358,11 +779,13 @@ void ASandboxTerrainController::digTerrainRoundHole(FVector origin, float r, flo
 		bool enableLOD = false;
 		bool operator()(VoxelData* vd, FVector v, float radius, float strength) {
 			changed = false;
-			vd->clearSubstanceCache();
 
-			for (int x = 0; x < vd->num(); x++) {
-				for (int y = 0; y < vd->num(); y++) {
-					for (int z = 0; z < vd->num(); z++) {
+			// only voxels inside the sphere bounds can change
+			VoxelDirtyRegion region = vd->clcVoxelRegion(v, radius);
+
+			for (int x = region.min_x; x <= region.max_x; x++) {
+				for (int y = region.min_y; y <= region.max_y; y++) {
+					for (int z = region.min_z; z <= region.max_z; z++) {
 						float density = vd->getDensity(x, y, z);
 						FVector o = vd->voxelIndexToVector(x, y, z);
 						o += vd->getOrigin();
@@ -374,17 +797,18 @@ void ASandboxTerrainController::digTerrainRoundHole(FVector origin, float r, flo
 							vd->setDensity(x, y, z, d);
 							changed = true;
 						}
-
-						if (enableLOD) {
-							vd->performSubstanceCacheLOD(x, y, z); 
-						} else {
-							vd->performSubstanceCacheNoLOD(x, y, z);
-						}
-	
 					}
 				}
 			}
 
+			vd->updateDensityMips(region);
+
+			if (enableLOD) {
+				vd->updateSubstanceCacheLOD(region);
+			} else {
+				vd->updateSubstanceCacheNoLOD(region);
+			}
+
 			return changed;
 		}
 	} zh;
@@ -404,11 +828,12 @@ void ASandboxTerrainController::digTerrainCubeHole(FVector origin, float r, floa
 
 			if (!not_empty) {
 
-				vd->clearSubstanceCache();
+				// only voxels inside the cube can change
+				VoxelDirtyRegion region = vd->clcVoxelRegion(v, radius);
 
-				for (int x = 0; x < vd->num(); x++) {
-					for (int y = 0; y < vd->num(); y++) {
-						for (int z = 0; z < vd->num(); z++) {
+				for (int x = region.min_x; x <= region.max_x; x++) {
+					for (int y = region.min_y; y <= region.max_y; y++) {
+						for (int z = region.min_z; z <= region.max_z; z++) {
 							FVector o = vd->voxelIndexToVector(x, y, z);
 							o += vd->getOrigin();
 							o -= v;
@@ -416,15 +841,17 @@ void ASandboxTerrainController::digTerrainCubeHole(FVector origin, float r, floa
 								vd->setDensity(x, y, z, 0);
 								changed = true;
 							}
-
-							if (enableLOD) {
-								vd->performSubstanceCacheLOD(x, y, z);
-							} else {
-								vd->performSubstanceCacheNoLOD(x, y, z);
-							}
 						}
 					}
 				}
+
+				vd->updateDensityMips(region);
+
+				if (enableLOD) {
+					vd->updateSubstanceCacheLOD(region);
+				} else {
+					vd->updateSubstanceCacheNoLOD(region);
+				}
 			}
 
 			return changed;
@@ -444,6 +871,7 @@ void ASandboxTerrainController::performTerrainChange(FVector origin, float radiu
 	te->strength = strength;
 	te->instance = this;
 
+	ActiveTerrainEditCount++;
 	FString thread_name = FString::Printf(TEXT("terrain_change-thread-%d"), FPlatformTime::Seconds());
 	FRunnableThread* thread = FRunnableThread::Create(te, *thread_name);
 	//FIXME delete thread after finish
@@ -495,6 +923,9 @@ void ASandboxTerrainController::editTerrain(FVector v, float radius, float s, H
 	
 	FVector base_zone_index = getZoneIndex(v);
 
+	// zones with a mesh to regenerate: changed ones and, with the apron, their neighbours
+	TArray<FVector> RemeshZoneList;
+
 	static const float vvv[3] = { -1, 0, 1 };
 	for (float x : vvv) {
 		for (float y : vvv) {
@@ -507,9 +938,20 @@ void ASandboxTerrainController::editTerrain(FVector v, float radius, float s, H
 
 				if (zone == NULL) {
 					if (vd != NULL) {
+						vd->beginEdit();
 						bool is_changed = handler(vd, v, radius, s);
 						if (is_changed) {
+							vd->compactBricks(vd->clcVoxelRegion(v, radius));
 							vd->setChanged();
+							vd->setCacheToValid();
+						}
+						vd->endEdit();
+
+						if (is_changed) {
+							if (bEnableZoneApron) {
+								SyncZoneApron(zone_index, vd, vd->clcVoxelRegion(v, radius), false, RemeshZoneList);
+							}
+
 							invokeLazyZoneAsync(zone_index);
 						}
 
@@ -529,25 +971,131 @@ void ASandboxTerrainController::editTerrain(FVector v, float radius, float s, H
 					continue;
 				}
 
+				vd->beginEdit();
 				bool is_changed = handler(vd, v, radius, s);
 				if (is_changed) {
+					vd->compactBricks(vd->clcVoxelRegion(v, radius));
 					vd->setChanged();
 					vd->setCacheToValid();
-					std::shared_ptr<MeshData> md_ptr = zone->generateMesh();
-					vd->resetLastMeshRegenerationTime();
-					invokeZoneMeshAsync(zone, md_ptr);
+				}
+				vd->endEdit();
+
+				if (is_changed) {
+					if (bEnableZoneApron) {
+						SyncZoneApron(zone_index, vd, vd->clcVoxelRegion(v, radius), false, RemeshZoneList);
+					}
+
+					RemeshZoneList.AddUnique(zone_index);
 				}
 
 			}
 		}
 	}
 
+	// meshes are generated after the aprons of all changed zones are in sync
+	for (const FVector& zone_index : RemeshZoneList) {
+		UTerrainZoneComponent* zone = getZoneByVectorIndex(zone_index);
+		VoxelData* vd = GetTerrainVoxelDataByIndex(zone_index);
+
+		if (zone == NULL || vd == NULL) {
+			continue;
+		}
+
+		// mesh is generated from a snapshot, next edit of the zone doesn't wait for it.
+		// The snapshot is taken after this, so it holds at least mesh_version.
+		uint64 mesh_version = vd->getChangeVersion();
+		std::shared_ptr<MeshData> md_ptr = zone->generateMesh();
+		vd->resetLastMeshRegenerationTime(mesh_version);
+		invokeZoneMeshAsync(zone, md_ptr);
+	}
+
+	// evicted zones the edit looked up are loaded again
+	RemeshApronZones();
+
 	double end = FPlatformTime::Seconds();
 	double time = (end - start) * 1000;
 	UE_LOG(LogTemp, Warning, TEXT("ASandboxTerrainController::editTerrain-------------> %f %f %f --> %f ms"), v.X, v.Y, v.Z, time);
 }
 
 
+// Send planes next to the faces the region touches to the aprons of the neighbour zones, which are
+// added to UpdatedZoneList. With bReceive the zone also takes its own apron from the neighbours.
+// Only one voxel data is locked at a time.
+void ASandboxTerrainController::SyncZoneApron(FVector index, VoxelData* vd, const VoxelDirtyRegion& region, bool bReceive, TArray<FVector>& UpdatedZoneList) {
+	static const FVector FaceOffset[VOXEL_APRON_FACES] = { FVector(-1, 0, 0), FVector(1, 0, 0), FVector(0, -1, 0), FVector(0, 1, 0), FVector(0, 0, -1), FVector(0, 0, 1) };
+
+	const int n = vd->num();
+	const int lower[3] = { region.min_x, region.min_y, region.min_z };
+	const int upper[3] = { region.max_x, region.max_y, region.max_z };
+	std::vector<unsigned char> slab;
+
+	for (auto face = 0; face < VOXEL_APRON_FACES; face++) {
+		FVector neighbour_index = index + FaceOffset[face];
+
+		// not loaded or evicted neighbours are not loaded for this
+		VoxelDataMapMutex.lock();
+		VoxelData* neighbour = VoxelDataMap.Contains(neighbour_index) ? VoxelDataMap[neighbour_index] : NULL;
+		VoxelDataMapMutex.unlock();
+
+		if (neighbour == NULL) {
+			continue;
+		}
+
+		// plane 0 and n - 1 are shared with the neighbour and edited in both zones
+		const int axis = face / 2;
+		const bool bTouched = (face & 1) ? upper[axis] >= n - 2 : lower[axis] <= 1;
+
+		if (bTouched) {
+			vd->beginEdit();
+			vd->copyApronSlab(face, slab);
+			vd->endEdit();
+
+			neighbour->beginEdit();
+			neighbour->setApronFace(face ^ 1, slab);
+			neighbour->endEdit();
+
+			UpdatedZoneList.AddUnique(neighbour_index);
+		}
+
+		if (bReceive) {
+			neighbour->beginEdit();
+			neighbour->copyApronSlab(face ^ 1, slab);
+			neighbour->endEdit();
+
+			vd->beginEdit();
+			vd->setApronFace(face, slab);
+			vd->endEdit();
+		}
+	}
+}
+
+// Called when a batch of zones is loaded: the initial zones, the loader, a background restore or the zones an edit
+// restored. Neighbours that got the apron of several zones of the batch are meshed once, zones meshed with the
+// apron meanwhile are up to date and skipped.
+void ASandboxTerrainController::RemeshApronZones() {
+	VoxelDataMapMutex.lock();
+	TSet<FVector> RemeshZoneSet = ApronRemeshZoneSet;
+	ApronRemeshZoneSet.Empty();
+	VoxelDataMapMutex.unlock();
+
+	for (const FVector& index : RemeshZoneSet) {
+		UTerrainZoneComponent* zone = getZoneByVectorIndex(index);
+
+		VoxelDataMapMutex.lock();
+		VoxelData* vd = VoxelDataMap.Contains(index) ? VoxelDataMap[index] : NULL;
+		VoxelDataMapMutex.unlock();
+
+		if (zone == NULL || vd == NULL || !vd->needToRegenerateMesh()) {
+			continue;
+		}
+
+		uint64 mesh_version = vd->getChangeVersion();
+		std::shared_ptr<MeshData> md_ptr = zone->generateMesh();
+		vd->resetLastMeshRegenerationTime(mesh_version);
+		invokeZoneMeshAsync(zone, md_ptr);
+	}
+}
+
 void ASandboxTerrainController::invokeZoneMeshAsync(UTerrainZoneComponent* zone, std::shared_ptr<MeshData> mesh_data_ptr) {
 	TerrainControllerTask task;
 	task.f = [=]() {
@@ -559,6 +1107,19 @@ void ASandboxTerrainController::invokeZoneMeshAsync(UTerrainZoneComponent* zone,
 	AddAsyncTask(task);
 }
 
+// the zone is looked up when the task runs on the game thread
+void ASandboxTerrainController::invokeZoneMeshAsync(FVector index, std::shared_ptr<MeshData> mesh_data_ptr) {
+	TerrainControllerTask task;
+	task.f = [=]() {
+		UTerrainZoneComponent* zone = getZoneByVectorIndex(index);
+		if (mesh_data_ptr && zone != NULL) {
+			zone->applyTerrainMesh(mesh_data_ptr);
+		}
+	};
+
+	AddAsyncTask(task);
+}
+
 void ASandboxTerrainController::invokeLazyZoneAsync(FVector index) {
 	TerrainControllerTask task;
 	FVector v = FVector((float)(index.X * 1000), (float)(index.Y * 1000), (float)(index.Z * 1000));
@@ -570,11 +1131,17 @@ void ASandboxTerrainController::invokeLazyZoneAsync(FVector index) {
 	}
 
 	task.f = [=]() {
-		UTerrainZoneComponent* zone = addTerrainZone(v);
+		// zone may be requested again before the task runs
+		UTerrainZoneComponent* zone = getZoneByVectorIndex(index);
+		if (zone == NULL) {
+			zone = addTerrainZone(v);
+		}
+
 		zone->setVoxelData(vd);
 
+		uint64 mesh_version = vd->getChangeVersion();
 		std::shared_ptr<MeshData> md_ptr = zone->generateMesh();
-		vd->resetLastMeshRegenerationTime();
+		vd->resetLastMeshRegenerationTime(mesh_version);
 		zone->applyTerrainMesh(md_ptr);
 	};
 
@@ -590,6 +1157,7 @@ VoxelData* ASandboxTerrainController::createZoneVoxeldata(FVector location) {
 	int dim = static_cast<int>(ZoneGridDimension);
 	VoxelData* vd = new VoxelData(dim, 100 * 10);
 	vd->setOrigin(location);
+	vd->setDensityMipsEnabled(bEnableDensityMips);
 
 	FVector index = getZoneIndex(location);
 	FString fileName = getZoneFileName(index.X, index.Y, index.Z);
@@ -604,11 +1172,28 @@ VoxelData* ASandboxTerrainController::createZoneVoxeldata(FVector location) {
 	}
 
 	vd->setChanged();
-	vd->resetLastSave();
+	vd->resetLastSave(vd->getChangeVersion());
 	vd->setCacheToValid();
 
 	RegisterTerrainVoxelData(vd, index);
 
+	if (bEnableZoneApron) {
+		VoxelDirtyRegion zone_region;
+		zone_region.add(0, 0, 0);
+		zone_region.add(dim - 1, dim - 1, dim - 1);
+
+		TArray<FVector> UpdatedZoneList;
+		SyncZoneApron(index, vd, zone_region, true, UpdatedZoneList);
+
+		// neighbours meshed without the apron of this zone are meshed again when the load is finished,
+		// the ones without zone get it with their first mesh
+		VoxelDataMapMutex.lock();
+		for (const FVector& neighbour_index : UpdatedZoneList) {
+			ApronRemeshZoneSet.Add(neighbour_index);
+		}
+		VoxelDataMapMutex.unlock();
+	}
+
 	double end = FPlatformTime::Seconds();
 	double time = (end - start) * 1000;
 	//UE_LOG(LogTemp, Warning, TEXT("ASandboxTerrainController::createZoneVoxeldata() -> %.8f %.8f %.8f --> %f ms"), index.X, index.Y, index.Z, time);
@@ -635,8 +1220,6 @@ void ASandboxTerrainController::generateTerrain(VoxelData &voxel_data) {
 				voxel_data.setDensity(x, y, z, den);
 				voxel_data.setMaterial(x, y, z, mat);
 
-				voxel_data.performSubstanceCacheLOD(x, y, z);
-
 				if (den == 0) zc++;
 				if (den == 1) fc++;
 				material_list.Add(mat);
@@ -644,6 +1227,8 @@ void ASandboxTerrainController::generateTerrain(VoxelData &voxel_data) {
 		}
 	}
 
+	voxel_data.compactBricks();
+
 	int s = voxel_data.num() * voxel_data.num() * voxel_data.num();
 
 	if (zc == s) {
@@ -663,6 +1248,8 @@ void ASandboxTerrainController::generateTerrain(VoxelData &voxel_data) {
 		voxel_data.deinitializeMaterial(base_mat);
 	}
 
+	voxel_data.rebuildDensityMips();
+	voxel_data.rebuildSubstanceCacheLOD();
 	voxel_data.setCacheToValid();
 
 	double end = FPlatformTime::Seconds();
@@ -672,6 +1259,30 @@ void ASandboxTerrainController::generateTerrain(VoxelData &voxel_data) {
 }
 
 
+void ASandboxTerrainController::RunTerrainBenchmark() {
+	// generated from scratch so loaded or edited zones do not affect results
+	VoxelData vd(static_cast<int>(ZoneGridDimension), 100 * 10);
+	vd.setOrigin(FVector(0));
+	vd.setDensityMipsEnabled(bEnableDensityMips);
+	generateTerrain(vd);
+
+	sandboxBenchmarkVoxelLayout(vd, 10);
+
+	static const EVoxelDimEnum ReuseDimensions[] = { EVoxelDimEnum::VS_32, EVoxelDimEnum::VS_64 };
+	for (EVoxelDimEnum Dimension : ReuseDimensions) {
+		VoxelData ReuseVoxelData(static_cast<int>(Dimension), 100 * 10);
+		ReuseVoxelData.setOrigin(FVector(0));
+		ReuseVoxelData.setDensityMipsEnabled(bEnableDensityMips);
+		generateTerrain(ReuseVoxelData);
+
+		sandboxBenchmarkVertexReuse(ReuseVoxelData, 10);
+		sandboxBenchmarkSurfaceNets(ReuseVoxelData, 10);
+		sandboxBenchmarkVertexCache(ReuseVoxelData, 10);
+	}
+
+	sandboxLogVoxelBufferPoolStats();
+}
+
 void ASandboxTerrainController::OnLoadZoneProgress(int progress, int total) {
 
 }
@@ -715,33 +1326,61 @@ bool ASandboxTerrainController::HasNextAsyncTask() {
 void ASandboxTerrainController::RegisterTerrainVoxelData(VoxelData* vd, FVector index) {
 	VoxelDataMapMutex.lock();
 	VoxelDataMap.Add(index, vd);
+	TouchZoneLru(index);
+
+	// a restored zone leaves the restoring state together with its publication
+	RestoringZoneSet.Remove(index);
 	VoxelDataMapMutex.unlock();
+
+	VoxelDataRestored.notify_all();
+}
+
+// moves the zone to the end of ZoneLruList, the caller holds VoxelDataMapMutex
+void ASandboxTerrainController::TouchZoneLru(FVector index) {
+	if (ZoneLruMap.Contains(index)) {
+		ZoneLruList.splice(ZoneLruList.end(), ZoneLruList, ZoneLruMap[index]);
+	} else {
+		ZoneLruMap.Add(index, ZoneLruList.insert(ZoneLruList.end(), index));
+	}
 }
 
 VoxelData* ASandboxTerrainController::GetTerrainVoxelDataByPos(FVector point) {
 	FVector index = sandboxSnapToGrid(point, 1000) / 1000;
+	return GetTerrainVoxelDataByIndex(index);
+}
+
+// Evicted zones are loaded again by the first thread that looks them up, other threads wait for it and for
+// zones that are still being saved. The game thread doesn't wait for files, it gets NULL and the zone is
+// restored in the background.
+VoxelData* ASandboxTerrainController::GetTerrainVoxelDataByIndex(FVector index) {
+	std::unique_lock<std::mutex> lock(VoxelDataMapMutex);
+
+	if (!IsInGameThread()) {
+		VoxelDataRestored.wait(lock, [&]() { return !RestoringZoneSet.Contains(index) && !SavingZoneSet.Contains(index); });
+	}
 
-	VoxelDataMapMutex.lock();
 	if (VoxelDataMap.Contains(index)) {
 		VoxelData* vd = VoxelDataMap[index];
-		VoxelDataMapMutex.unlock();
+		TouchZoneLru(index);
 		return vd;
 	}
 
-	VoxelDataMapMutex.unlock();
-	return NULL;
-}
+	if (!EvictedZoneSet.Contains(index)) {
+		return NULL;
+	}
 
-VoxelData* ASandboxTerrainController::GetTerrainVoxelDataByIndex(FVector index) {
-	VoxelDataMapMutex.lock();
-	if (VoxelDataMap.Contains(index)) {
-		VoxelData* vd = VoxelDataMap[index];
-		VoxelDataMapMutex.unlock();
-		return vd;
+	EvictedZoneSet.Remove(index);
+	RestoringZoneSet.Add(index);
+	lock.unlock();
+
+	if (IsInGameThread()) {
+		TArray<FVector> RestoreList;
+		RestoreList.Add(index);
+		RestoreEvictedZonesAsync(RestoreList);
+		return NULL;
 	}
 
-	VoxelDataMapMutex.unlock();
-	return NULL;
+	return RestoreEvictedZone(index);
 }
 
 //======================================================================================================================================================================
@@ -53,16 +53,17 @@ public:
 class FProcMeshIndexBuffer : public FIndexBuffer
 {
 public:
-	TArray<int32> Indices;
+	FProcMeshIndexArray Indices;
 
 	virtual void InitRHI() override
 	{
 		FRHIResourceCreateInfo CreateInfo;
 		void* Buffer = nullptr;
-		IndexBufferRHI = RHICreateAndLockIndexBuffer(sizeof(int32), Indices.Num() * sizeof(int32), BUF_Static, CreateInfo, Buffer);
+		const uint32 Stride = Indices.GetStride();
+		IndexBufferRHI = RHICreateAndLockIndexBuffer(Stride, Indices.Num() * Stride, BUF_Static, CreateInfo, Buffer);
 
-		// Write the indices to the index buffer.		
-		FMemory::Memcpy(Buffer, Indices.GetData(), Indices.Num() * sizeof(int32));
+		// Write the indices to the index buffer, 16 or 32 bit as the section stores them
+		FMemory::Memcpy(Buffer, Indices.GetData(), Indices.Num() * Stride);
 		RHIUnlockIndexBuffer(IndexBufferRHI);
 	}
 };
@@ -179,6 +180,20 @@ static void ConvertProcMeshToDynMeshVertex(FDynamicMeshVertex& Vert, const FProc
 	Vert.TangentZ.Vector.W = ProcVert.Tangent.bFlipTangentY ? 0 : 255;
 }
 
+// FLocalVertexFactory needs full vertices, a packed GPU stream would need an own vertex factory and shader.
+// So the GPU vertex buffer keeps FDynamicMeshVertex, only the index buffer gets the 16 bit indices of the section.
+static void ConvertPackedToDynMeshVertex(FDynamicMeshVertex& Vert, const FProcMeshPackedSection& Section, int32 VertIdx)
+{
+	const FProcMeshPackedVertex& PackedVert = Section.ProcVertexBuffer[VertIdx];
+
+	Vert.Position = Section.GetPosition(VertIdx);
+	Vert.Color = FColor(PackedVert.MaterialWeight, 0, 0, 0);
+	Vert.TextureCoordinate = FVector2D(0.f, 0.f);
+	Vert.TangentX = FVector(1.f, 0.f, 0.f);
+	Vert.TangentZ = PackedVert.GetNormal();
+	Vert.TangentZ.Vector.W = 255;
+}
+
 class FProceduralMeshSceneProxy : public FPrimitiveSceneProxy
 {
 public:
@@ -189,13 +204,14 @@ public:
 		, MaterialRelevance(Component->GetMaterialRelevance(GetScene().GetFeatureLevel()))
 	{
 		bLodFlag = Component->bLodFlag;
+		LodMask = Component->LodMask;
 
 		// Copy each section
 		const int32 NumSections = Component->ProcMeshSections.Num();
 		Sections.AddZeroed(NumSections);
 
 		for (int SectionIdx = 0; SectionIdx < NumSections; SectionIdx++) {
-			FProcMeshSection& SrcSection = Component->ProcMeshSections[SectionIdx].mainMesh;
+			FProcMeshPackedSection& SrcSection = Component->ProcMeshSections[SectionIdx].mainMesh;
 
 			if (SrcSection.ProcIndexBuffer.Num() > 0 && SrcSection.ProcVertexBuffer.Num() > 0) {
 				FMeshProxyLodSection* NewLodSection = new FMeshProxyLodSection();
@@ -203,9 +219,9 @@ public:
 				CopySection(SrcSection, &NewLodSection->mainMesh, Component);
 
 				if(SectionIdx > 0) {
-					FProcMeshSection& SrcTransitionSection = Component->ProcMeshSections[SectionIdx].transitionMeshArray[0];
+					FProcMeshPackedSection& SrcTransitionSection = Component->ProcMeshSections[SectionIdx].transitionMeshArray[0];
 						for (auto i = 0; i < 6; i++) {
-							FProcMeshSection& SrcTransitionSection = Component->ProcMeshSections[SectionIdx].transitionMeshArray[i];
+							FProcMeshPackedSection& SrcTransitionSection = Component->ProcMeshSections[SectionIdx].transitionMeshArray[i];
 
 							if (SrcTransitionSection.ProcIndexBuffer.Num() > 0 && SrcTransitionSection.ProcVertexBuffer.Num() > 0) {
 								NewLodSection->transitionMesh[i] = new FProcMeshProxySection();
@@ -233,7 +249,7 @@ public:
 		}
 	}
 
-	FORCEINLINE void CopySection(FProcMeshSection& SrcSection, FProcMeshProxySection* NewSection, USandboxTerrainMeshComponent* Component) {
+	FORCEINLINE void CopySection(FProcMeshPackedSection& SrcSection, FProcMeshProxySection* NewSection, USandboxTerrainMeshComponent* Component) {
 		if (SrcSection.ProcIndexBuffer.Num() > 0 && SrcSection.ProcVertexBuffer.Num() > 0) {
 
 			// Copy data from vertex buffer
@@ -241,11 +257,10 @@ public:
 
 			// Allocate verts
 			NewSection->VertexBuffer.Vertices.SetNumUninitialized(NumVerts);
-			// Copy verts
+			// Unpack verts
 			for (int VertIdx = 0; VertIdx < NumVerts; VertIdx++) {
-				const FProcMeshVertex& ProcVert = SrcSection.ProcVertexBuffer[VertIdx];
 				FDynamicMeshVertex& Vert = NewSection->VertexBuffer.Vertices[VertIdx];
-				ConvertProcMeshToDynMeshVertex(Vert, ProcVert);
+				ConvertPackedToDynMeshVertex(Vert, SrcSection, VertIdx);
 			}
 
 			// Copy index buffer
@@ -339,6 +354,12 @@ public:
 				const float ScreenSize = ComputeBoundsScreenSize(ProxyBounds.Origin, ProxyBounds.SphereRadius, *View);
 
 				const int LodIndex = GetLodIndex(View);
+
+				// built LOD without a surface
+				if (LodIndex < 0 || LodIndex >= Sections.Num() || Sections[LodIndex] == nullptr) {
+					continue;
+				}
+
 				const FProcMeshProxySection* Section = &Sections[LodIndex]->mainMesh;
 
 				if (Section != nullptr) {
@@ -387,27 +408,11 @@ public:
 			//const FBoxSphereBounds& ProxyBounds = GetBounds();
 			//const float ScreenSize = ComputeBoundsScreenSize(ProxyBounds.Origin, ProxyBounds.SphereRadius, *View);
 
+			// distance to the zone center like the terrain controller, which builds the transition cells for this lod
 			FVector ViewOrigin = View->ViewMatrices.GetViewOrigin();
-			float Distance = FVector::Dist(ViewOrigin, GetBounds().Origin);
-
-			const static float LodThreshold = 1500.0f;
-
-			if (Distance <= LodThreshold) {
-				return 0;
-			}
-
-			float LodThresholdMin = LodThreshold;
-			for (int Idx = 1; Idx < LOD_ARRAY_SIZE; Idx++) {
-				float LodThresholdMax = 2.0f * LodThresholdMin;
-
-				if (Distance > LodThresholdMin && Distance <= LodThresholdMax) {
-					return Idx;
-				}
-
-				LodThresholdMin *= 2;
-			}
+			float Distance = FVector::Dist(ViewOrigin, GetLocalToWorld().GetOrigin());
 
-			return LOD_ARRAY_SIZE - 1;
+			return USandboxTerrainMeshComponent::GetNearestLod(LodMask, USandboxTerrainMeshComponent::GetLodIndexForDistance(Distance));
 		}
 
 		return 0;
@@ -446,6 +451,8 @@ private:
 	FMaterialRelevance MaterialRelevance;
 
 	bool bLodFlag;
+
+	int32 LodMask;
 };
 
 
@@ -455,6 +462,61 @@ private:
 
 USandboxTerrainMeshComponent::USandboxTerrainMeshComponent(const FObjectInitializer& ObjectInitializer) : Super(ObjectInitializer) {
 	bLodFlag = false;
+	LodMask = 0;
+	MeshVoxelVersion = 0;
+}
+
+int USandboxTerrainMeshComponent::GetLodIndexForDistance(float Distance) {
+	const static float LodThreshold = 1500.0f;
+
+	if (Distance <= LodThreshold) {
+		return 0;
+	}
+
+	float LodThresholdMin = LodThreshold;
+	for (int Idx = 1; Idx < LOD_ARRAY_SIZE; Idx++) {
+		float LodThresholdMax = 2.0f * LodThresholdMin;
+
+		if (Distance > LodThresholdMin && Distance <= LodThresholdMax) {
+			return Idx;
+		}
+
+		LodThresholdMin *= 2;
+	}
+
+	return LOD_ARRAY_SIZE - 1;
+}
+
+int USandboxTerrainMeshComponent::GetNearestLod(int32 LodMask, int Lod) {
+	// coarser one first, it is cheaper to draw
+	for (int Offset = 0; Offset < LOD_ARRAY_SIZE; Offset++) {
+		if (Lod + Offset < LOD_ARRAY_SIZE && (LodMask & (1 << (Lod + Offset)))) {
+			return Lod + Offset;
+		}
+
+		if (Lod - Offset >= 0 && (LodMask & (1 << (Lod - Offset)))) {
+			return Lod - Offset;
+		}
+	}
+
+	return -1;
+}
+
+int USandboxTerrainMeshComponent::GetTransitionFaceMask(int Lod) const {
+	return HasLod(Lod) ? ProcMeshSections[Lod].TransitionFaceMask : 0;
+}
+
+SIZE_T USandboxTerrainMeshComponent::GetMeshDataSize() const {
+	SIZE_T Size = 0;
+	for (const MeshLodSection& Section : ProcMeshSections) {
+		Size += Section.mainMesh.ProcVertexBuffer.GetAllocatedSize() + Section.mainMesh.ProcIndexBuffer.GetAllocatedSize();
+
+		for (const FProcMeshPackedSection& TransitionMesh : Section.transitionMeshArray) {
+			Size += TransitionMesh.ProcVertexBuffer.GetAllocatedSize() + TransitionMesh.ProcIndexBuffer.GetAllocatedSize();
+		}
+	}
+
+	return Size;
 }
 
 FPrimitiveSceneProxy* USandboxTerrainMeshComponent::CreateSceneProxy() {
@@ -491,7 +553,11 @@ void USandboxTerrainMeshComponent::SetMeshSectionVisible(int32 SectionIndex, boo
 void USandboxTerrainMeshComponent::UpdateLocalBounds() {
 	FBox LocalBox(0);
 
-	LocalBox += ProcMeshSections[0].mainMesh.SectionLocalBox;
+	for (auto Lod = 0; Lod < ProcMeshSections.Num(); Lod++) {
+		if (HasLod(Lod)) {
+			LocalBox += ProcMeshSections[Lod].mainMesh.SectionLocalBox;
+		}
+	}
 
 	LocalBounds = LocalBox.IsValid ? FBoxSphereBounds(LocalBox) : FBoxSphereBounds(FVector(0, 0, 0), FVector(0, 0, 0), 0); // fallback to reset box sphere bounds
 	UpdateBounds(); // Update global bounds
@@ -509,18 +575,38 @@ void USandboxTerrainMeshComponent::SetMeshData(MeshDataPtr mdPtr) {
 	if (mdPtr) {
 		MeshData* meshData = mdPtr.get();
 
+		// built before the LODs the component has, the voxel data changed meanwhile
+		if (meshData->VoxelVersion < MeshVoxelVersion) {
+			return;
+		}
+
+		// LODs of older voxel data are dropped, the ones of the same data are kept
+		if (meshData->VoxelVersion > MeshVoxelVersion) {
+			for (auto& sectionLOD : ProcMeshSections) {
+				sectionLOD = MeshLodSection();
+			}
+
+			LodMask = 0;
+			MeshVoxelVersion = meshData->VoxelVersion;
+		}
+
 		auto lodIndex = 0;
 		for (auto& sectionLOD : meshData->MeshSectionLodArray) {
-			ProcMeshSections[lodIndex].mainMesh = sectionLOD.mainMesh;
+			if (meshData->LodMask & (1 << lodIndex)) {
+				ProcMeshSections[lodIndex].mainMesh = sectionLOD.mainMesh;
+				ProcMeshSections[lodIndex].TransitionFaceMask = sectionLOD.TransitionFaceMask;
 
-			if (bLodFlag) {
-				for (auto i = 0; i < 6; i++) {
-					ProcMeshSections[lodIndex].transitionMeshArray[i] = sectionLOD.transitionMeshArray[i];
+				if (bLodFlag) {
+					for (auto i = 0; i < 6; i++) {
+						ProcMeshSections[lodIndex].transitionMeshArray[i] = sectionLOD.transitionMeshArray[i];
+					}
 				}
 			}
 
 			lodIndex++;
 		}
+
+		LodMask |= meshData->LodMask;
 	}
 
 	UpdateLocalBounds(); // Update overall bounds
@@ -27,6 +27,25 @@ public:
 		this->bLodFlag = bLodFlag;
 	}
 
+	// LOD drawn at the distance from the view to the mesh
+	static int GetLodIndexForDistance(float Distance);
+
+	// LOD of LodMask nearest to Lod, -1 if there is none
+	static int GetNearestLod(int32 LodMask, int Lod);
+
+	bool HasLod(int Lod) const {
+		return (LodMask & (1 << Lod)) != 0;
+	}
+
+	int32 GetLodMask() const {
+		return LodMask;
+	}
+
+	// faces with transition cells the lod was built with
+	int GetTransitionFaceMask(int Lod) const;
+
+	SIZE_T GetMeshDataSize() const;
+
 	//~ Begin UPrimitiveComponent Interface.
 	virtual FPrimitiveSceneProxy* CreateSceneProxy() override;
 	virtual class UBodySetup* GetBodySetup() override;
@@ -56,6 +75,12 @@ private:
 	/** Array of sections of mesh */
 	TArray<MeshLodSection> ProcMeshSections;
 
+	// LODs in ProcMeshSections, the others are not built yet. Mesh data of the same voxel
+	// data version adds its LODs, a newer version replaces them.
+	int32 LodMask;
+
+	uint64 MeshVoxelVersion;
+
 	/** Local space bounds of mesh */
 	UPROPERTY()
 	FBoxSphereBounds LocalBounds;
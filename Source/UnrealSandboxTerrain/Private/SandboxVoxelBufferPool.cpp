@@ -0,0 +1,164 @@
+#include "UnrealSandboxTerrainPrivatePCH.h"
+#include "SandboxVoxelBufferPool.h"
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#define POOL_CLASS_NUM (VOXEL_BUFFER_POOL_MAX_SIZE / VOXEL_BUFFER_POOL_GRANULARITY)
+
+// buffers moved between a thread cache and the shared pool at once
+#define POOL_BATCH_SIZE 64
+
+// thread cache is flushed to the shared pool above this number of buffers per class
+#define POOL_THREAD_CACHE_SIZE (POOL_BATCH_SIZE * 2)
+
+// shared pool frees buffers above this limit
+#define POOL_MAX_POOLED_BYTES (64 * 1024 * 1024)
+
+static FORCEINLINE int clcPoolClass(int size) {
+	return (size + VOXEL_BUFFER_POOL_GRANULARITY - 1) / VOXEL_BUFFER_POOL_GRANULARITY - 1;
+}
+
+static FORCEINLINE int clcPoolClassSize(int pool_class) {
+	return (pool_class + 1) * VOXEL_BUFFER_POOL_GRANULARITY;
+}
+
+static std::atomic<uint64> pool_hits(0);
+static std::atomic<uint64> pool_misses(0);
+static std::atomic<uint64> pool_releases(0);
+
+class VoxelBufferSharedPool {
+
+private:
+	std::mutex mutex;
+	std::vector<unsigned char*> free_list[POOL_CLASS_NUM];
+	uint64 pooled_bytes = 0;
+
+public:
+	~VoxelBufferSharedPool() {
+		for (auto& list : free_list) {
+			for (unsigned char* buffer : list) {
+				delete[] buffer;
+			}
+		}
+	}
+
+	// move up to POOL_BATCH_SIZE buffers to the thread cache
+	void take(int pool_class, std::vector<unsigned char*>& cache) {
+		mutex.lock();
+		std::vector<unsigned char*>& list = free_list[pool_class];
+		const size_t n = FMath::Min((size_t)POOL_BATCH_SIZE, list.size());
+		cache.insert(cache.end(), list.end() - n, list.end());
+		list.resize(list.size() - n);
+		pooled_bytes -= n * clcPoolClassSize(pool_class);
+		mutex.unlock();
+	}
+
+	// take all but count buffers from the thread cache
+	void give(int pool_class, std::vector<unsigned char*>& cache, size_t count) {
+		const uint64 class_size = clcPoolClassSize(pool_class);
+
+		mutex.lock();
+		std::vector<unsigned char*>& list = free_list[pool_class];
+		while (cache.size() > count) {
+			unsigned char* buffer = cache.back();
+			cache.pop_back();
+
+			if (pooled_bytes + class_size > POOL_MAX_POOLED_BYTES) {
+				delete[] buffer;
+			} else {
+				list.push_back(buffer);
+				pooled_bytes += class_size;
+			}
+		}
+		mutex.unlock();
+	}
+
+	uint64 getPooledBytes() {
+		mutex.lock();
+		uint64 bytes = pooled_bytes;
+		mutex.unlock();
+		return bytes;
+	}
+};
+
+static VoxelBufferSharedPool shared_pool;
+
+class VoxelBufferThreadCache {
+
+public:
+	std::vector<unsigned char*> free_list[POOL_CLASS_NUM];
+
+	// loader and edit threads are short lived - hand their buffers back on exit
+	~VoxelBufferThreadCache() {
+		for (auto pool_class = 0; pool_class < POOL_CLASS_NUM; pool_class++) {
+			shared_pool.give(pool_class, free_list[pool_class], 0);
+		}
+	}
+};
+
+static thread_local VoxelBufferThreadCache thread_cache;
+
+unsigned char* sandboxAllocVoxelBuffer(int size) {
+	if (size > VOXEL_BUFFER_POOL_MAX_SIZE) {
+		pool_misses.fetch_add(1, std::memory_order_relaxed);
+		return new unsigned char[size];
+	}
+
+	const int pool_class = clcPoolClass(size);
+	std::vector<unsigned char*>& cache = thread_cache.free_list[pool_class];
+
+	if (cache.empty()) {
+		shared_pool.take(pool_class, cache);
+	}
+
+	if (cache.empty()) {
+		pool_misses.fetch_add(1, std::memory_order_relaxed);
+		return new unsigned char[clcPoolClassSize(pool_class)];
+	}
+
+	pool_hits.fetch_add(1, std::memory_order_relaxed);
+	unsigned char* buffer = cache.back();
+	cache.pop_back();
+	return buffer;
+}
+
+void sandboxFreeVoxelBuffer(unsigned char* buffer, int size) {
+	if (buffer == NULL) {
+		return;
+	}
+
+	if (size > VOXEL_BUFFER_POOL_MAX_SIZE) {
+		delete[] buffer;
+		return;
+	}
+
+	pool_releases.fetch_add(1, std::memory_order_relaxed);
+
+	const int pool_class = clcPoolClass(size);
+	std::vector<unsigned char*>& cache = thread_cache.free_list[pool_class];
+	cache.push_back(buffer);
+
+	if (cache.size() > POOL_THREAD_CACHE_SIZE) {
+		shared_pool.give(pool_class, cache, POOL_THREAD_CACHE_SIZE - POOL_BATCH_SIZE);
+	}
+}
+
+VoxelBufferPoolStats sandboxGetVoxelBufferPoolStats() {
+	VoxelBufferPoolStats stats;
+	stats.hits = pool_hits.load(std::memory_order_relaxed);
+	stats.misses = pool_misses.load(std::memory_order_relaxed);
+	stats.releases = pool_releases.load(std::memory_order_relaxed);
+	stats.pooled_bytes = shared_pool.getPooledBytes();
+	return stats;
+}
+
+void sandboxLogVoxelBufferPoolStats() {
+	VoxelBufferPoolStats stats = sandboxGetVoxelBufferPoolStats();
+	const uint64 total = stats.hits + stats.misses;
+	const double hit_rate = (total > 0) ? 100.0 * stats.hits / total : 0;
+
+	UE_LOG(LogTemp, Warning, TEXT("voxel buffer pool: hits %llu, misses %llu (%.1f%% hit), releases %llu, pooled %llu KB"), 
+		stats.hits, stats.misses, hit_rate, stats.releases, stats.pooled_bytes / 1024);
+}
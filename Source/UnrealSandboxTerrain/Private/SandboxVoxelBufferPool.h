@@ -0,0 +1,25 @@
+#pragma once
+
+#include "EngineMinimal.h"
+
+// Recycles voxel brick buffers instead of returning them to the system allocator.
+// Buffers are grouped in size classes of VOXEL_BUFFER_POOL_GRANULARITY bytes. Every thread keeps
+// a small cache per class and exchanges buffers with the shared pool in batches.
+#define VOXEL_BUFFER_POOL_GRANULARITY 16
+#define VOXEL_BUFFER_POOL_MAX_SIZE 1024
+
+typedef struct VoxelBufferPoolStats {
+	uint64 hits = 0;
+	uint64 misses = 0;
+	uint64 releases = 0;
+
+	// bytes held in the shared pool (thread caches are not counted)
+	uint64 pooled_bytes = 0;
+} VoxelBufferPoolStats;
+
+// size must be passed again to sandboxFreeVoxelBuffer
+unsigned char* sandboxAllocVoxelBuffer(int size);
+void sandboxFreeVoxelBuffer(unsigned char* buffer, int size);
+
+VoxelBufferPoolStats sandboxGetVoxelBufferPoolStats();
+void sandboxLogVoxelBufferPoolStats();
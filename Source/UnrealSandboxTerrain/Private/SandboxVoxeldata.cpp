@@ -1,93 +1,425 @@
 
 #include "UnrealSandboxTerrainPrivatePCH.h"
 #include "SandboxVoxeldata.h"
+#include "SandboxVoxelBufferPool.h"
+#include "Async/ParallelFor.h"
 
 #include "Transvoxel.h"
 
 #include <cmath>
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+
+#if VOXEL_CELL_CASE_SSE2
+#include <emmintrin.h>
+#endif
 
 
 //====================================================================================
 // Voxel data impl
 //====================================================================================
 
-    VoxelData::VoxelData(int num, float size){
-       // int s = num*num*num;
+	// Brick buffers are shared between VoxelData and its snapshots.
+	// Reference counter is stored in a header in front of the voxel bytes.
+	#define BRICK_BUFFER_HEADER_SIZE 16
+
+	static FORCEINLINE std::atomic<int>& brickBufferRefCount(const unsigned char* buffer) {
+		return *reinterpret_cast<std::atomic<int>*>(const_cast<unsigned char*>(buffer) - BRICK_BUFFER_HEADER_SIZE);
+	}
+
+	static FORCEINLINE unsigned char* allocBrickBuffer(int size) {
+		unsigned char* block = sandboxAllocVoxelBuffer(size + BRICK_BUFFER_HEADER_SIZE);
+		new (block) std::atomic<int>(1);
+		return block + BRICK_BUFFER_HEADER_SIZE;
+	}
+
+	static FORCEINLINE void retainBrickBuffer(unsigned char* buffer) {
+		if (buffer != NULL) {
+			brickBufferRefCount(buffer).fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	static FORCEINLINE void releaseBrickBuffer(unsigned char* buffer, int size) {
+		if (buffer != NULL && brickBufferRefCount(buffer).fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			sandboxFreeVoxelBuffer(buffer - BRICK_BUFFER_HEADER_SIZE, size + BRICK_BUFFER_HEADER_SIZE);
+		}
+	}
+
+	// copy buffer if a snapshot still holds it
+	static FORCEINLINE void detachBrickBuffer(unsigned char*& buffer, int size) {
+		if (brickBufferRefCount(buffer).load(std::memory_order_acquire) > 1) {
+			unsigned char* copy = allocBrickBuffer(size);
+			memcpy(copy, buffer, size);
+			releaseBrickBuffer(buffer, size);
+			buffer = copy;
+		}
+	}
 
-        density_data = NULL;
-		density_state = VoxelDataFillState::ZERO;
 
-		material_data = NULL;
+    VoxelData::VoxelData(int num, float size){
+		density_state = VoxelDataFillState::ZERO;
 
 		voxel_num = num;
         volume_size = size;
+
+		brick_num = (num + VOXEL_BRICK_SIZE - 1) / VOXEL_BRICK_SIZE;
+
+		for (auto level = 0; level < VOXEL_DENSITY_BOUNDS_LEVELS; level++) {
+			const int block_size = 1 << (VOXEL_DENSITY_BOUNDS_SHIFT + level);
+			density_bounds_num[level] = (num + block_size - 1) / block_size;
+		}
+
+		// new data is neither saved, meshed nor cached
+		change_version = 1;
+		save_version = 0;
+		mesh_version = 0;
+		cache_version = 0;
     }
 
     VoxelData::~VoxelData(){
-        delete[] density_data;
-		delete[] material_data;
+		releaseBricks();
     }
 
-	FORCEINLINE void VoxelData::initializeDensity() {
-		int s = voxel_num * voxel_num * voxel_num;
-		density_data = new unsigned char[s];
-		for (auto x = 0; x < voxel_num; x++) {
-			for (auto y = 0; y < voxel_num; y++) {
-				for (auto z = 0; z < voxel_num; z++) {
-					if (density_state == VoxelDataFillState::ALL) {
-						setDensity(x, y, z, 1);
+	FORCEINLINE void VoxelData::initializeBricks() {
+		bricks.resize(brick_num * brick_num * brick_num);
+
+		for (VoxelBrick& brick : bricks) {
+			brick.density_state = (density_state == VoxelDataFillState::ALL) ? VoxelDataFillState::ALL : VoxelDataFillState::ZERO;
+			brick.base_fill_mat = base_fill_mat;
+		}
+
+		resetDensityBounds((density_state == VoxelDataFillState::ALL) ? 255 : 0);
+	}
+
+	FORCEINLINE void VoxelData::releaseBricks() {
+		for (VoxelBrick& brick : bricks) {
+			releaseBrickDensity(brick);
+			releaseBrickMaterial(brick);
+		}
+
+		bricks.clear();
+		bricks.shrink_to_fit();
+
+		for (auto& level_bounds : density_bounds) {
+			level_bounds.clear();
+			level_bounds.shrink_to_fit();
+		}
+
+		density_mips.clear();
+		density_mips.shrink_to_fit();
+	}
+
+	FORCEINLINE void VoxelData::resetDensityBounds(unsigned char d) {
+		VoxelDensityBounds bounds;
+		bounds.min = d;
+		bounds.max = d;
+
+		for (auto level = 0; level < VOXEL_DENSITY_BOUNDS_LEVELS; level++) {
+			const int n = density_bounds_num[level];
+			density_bounds[level].assign(n * n * n, bounds);
+		}
+	}
+
+	FORCEINLINE void VoxelData::widenDensityBounds(int x, int y, int z, unsigned char d) {
+		for (auto level = 0; level < VOXEL_DENSITY_BOUNDS_LEVELS; level++) {
+			const int shift = VOXEL_DENSITY_BOUNDS_SHIFT + level;
+			const int n = density_bounds_num[level];
+			VoxelDensityBounds& bounds = density_bounds[level][((x >> shift) * n + (y >> shift)) * n + (z >> shift)];
+
+			if (d < bounds.min) bounds.min = d;
+			if (d > bounds.max) bounds.max = d;
+		}
+	}
+
+	// exact bounds of the blocks holding voxels of the region; finest level from bricks, coarser levels from finer ones
+	void VoxelData::updateDensityBounds(const VoxelDirtyRegion& region) {
+		const int block_size = 1 << VOXEL_DENSITY_BOUNDS_SHIFT;
+		const int n0 = density_bounds_num[0];
+
+		int bx0 = region.min_x >> VOXEL_DENSITY_BOUNDS_SHIFT, bx1 = region.max_x >> VOXEL_DENSITY_BOUNDS_SHIFT;
+		int by0 = region.min_y >> VOXEL_DENSITY_BOUNDS_SHIFT, by1 = region.max_y >> VOXEL_DENSITY_BOUNDS_SHIFT;
+		int bz0 = region.min_z >> VOXEL_DENSITY_BOUNDS_SHIFT, bz1 = region.max_z >> VOXEL_DENSITY_BOUNDS_SHIFT;
+
+		for (auto bx = bx0; bx <= bx1; bx++) {
+			for (auto by = by0; by <= by1; by++) {
+				for (auto bz = bz0; bz <= bz1; bz++) {
+					const int x0 = bx * block_size;
+					const int y0 = by * block_size;
+					const int z0 = bz * block_size;
+					const VoxelBrick& brick = bricks[clcBrickIndex(x0, y0, z0)];
+					VoxelDensityBounds& bounds = density_bounds[0][(bx * n0 + by) * n0 + bz];
+
+					if (brick.density_data == NULL) {
+						bounds.min = bounds.max = (brick.density_state == VoxelDataFillState::ALL) ? 255 : 0;
+						continue;
+					}
+
+					bounds = VoxelDensityBounds();
+					const int x1 = FMath::Min(x0 + block_size, voxel_num);
+					const int y1 = FMath::Min(y0 + block_size, voxel_num);
+					const int z1 = FMath::Min(z0 + block_size, voxel_num);
+
+					for (auto x = x0; x < x1; x++) {
+						for (auto y = y0; y < y1; y++) {
+							for (auto z = z0; z < z1; z++) {
+								const unsigned char d = brick.density_data[clcBrickLocalIndex(x, y, z)];
+								if (d < bounds.min) bounds.min = d;
+								if (d > bounds.max) bounds.max = d;
+							}
+						}
 					}
+				}
+			}
+		}
 
-					if (density_state == VoxelDataFillState::ZERO) {
-						setDensity(x, y, z, 0);
+		for (auto level = 1; level < VOXEL_DENSITY_BOUNDS_LEVELS; level++) {
+			const int n = density_bounds_num[level];
+			const int fn = density_bounds_num[level - 1];
+
+			bx0 >>= 1, bx1 >>= 1;
+			by0 >>= 1, by1 >>= 1;
+			bz0 >>= 1, bz1 >>= 1;
+
+			for (auto bx = bx0; bx <= bx1; bx++) {
+				for (auto by = by0; by <= by1; by++) {
+					for (auto bz = bz0; bz <= bz1; bz++) {
+						VoxelDensityBounds bounds;
+
+						for (auto fx = bx * 2; fx < FMath::Min(bx * 2 + 2, fn); fx++) {
+							for (auto fy = by * 2; fy < FMath::Min(by * 2 + 2, fn); fy++) {
+								for (auto fz = bz * 2; fz < FMath::Min(bz * 2 + 2, fn); fz++) {
+									const VoxelDensityBounds& fine = density_bounds[level - 1][(fx * fn + fy) * fn + fz];
+									if (fine.min < bounds.min) bounds.min = fine.min;
+									if (fine.max > bounds.max) bounds.max = fine.max;
+								}
+							}
+						}
+
+						density_bounds[level][(bx * n + by) * n + bz] = bounds;
 					}
 				}
 			}
 		}
 	}
 
-	FORCEINLINE void VoxelData::initializeMaterial() {
-		int s = voxel_num * voxel_num * voxel_num;
-		material_data = new unsigned char[s];
-		for (auto x = 0; x < voxel_num; x++) {
-			for (auto y = 0; y < voxel_num; y++) {
-				for (auto z = 0; z < voxel_num; z++) {
-					setMaterial(x, y, z, base_fill_mat);
+	FORCEINLINE bool VoxelData::isSurfacePossible(int x0, int y0, int z0, int x1, int y1, int z1, int level) const {
+		if (bricks.empty()) {
+			return false;
+		}
+
+		const int shift = VOXEL_DENSITY_BOUNDS_SHIFT + level;
+		const int n = density_bounds_num[level];
+		const std::vector<VoxelDensityBounds>& level_bounds = density_bounds[level];
+
+		unsigned char min = 255;
+		unsigned char max = 0;
+
+		// voxels outside of the zone read as zero density
+		if (x1 >= voxel_num || y1 >= voxel_num || z1 >= voxel_num) {
+			min = 0;
+		}
+
+		const int bx1 = FMath::Min(x1, voxel_num - 1) >> shift;
+		const int by1 = FMath::Min(y1, voxel_num - 1) >> shift;
+		const int bz1 = FMath::Min(z1, voxel_num - 1) >> shift;
+
+		for (auto bx = FMath::Max(x0, 0) >> shift; bx <= bx1; bx++) {
+			for (auto by = FMath::Max(y0, 0) >> shift; by <= by1; by++) {
+				for (auto bz = FMath::Max(z0, 0) >> shift; bz <= bz1; bz++) {
+					const VoxelDensityBounds& bounds = level_bounds[(bx * n + by) * n + bz];
+					if (bounds.min < min) min = bounds.min;
+					if (bounds.max > max) max = bounds.max;
+
+					if (min <= VOXEL_ISOLEVEL_RAW && max > VOXEL_ISOLEVEL_RAW) {
+						return true;
+					}
 				}
 			}
 		}
+
+		return false;
 	}
 
-	FORCEINLINE void VoxelData::setDensity(int x, int y, int z, float density){
-		if (density_data == NULL) {
-			if (density_state == VoxelDataFillState::ZERO && density == 0){
+	FORCEINLINE void VoxelData::initializeBrickDensity(VoxelBrick& brick) {
+		unsigned char d = (brick.density_state == VoxelDataFillState::ALL) ? 255 : 0;
+		brick.density_data = allocBrickBuffer(VOXEL_BRICK_VOLUME);
+		memset(brick.density_data, d, VOXEL_BRICK_VOLUME);
+		brick.density_state = VoxelDataFillState::MIX;
+		density_state = VoxelDataFillState::MIX;
+	}
+
+	static FORCEINLINE int clcBrickMaterialBufferSize(int bits) {
+		if (bits == 8) {
+			return VOXEL_BRICK_VOLUME;
+		}
+
+		return (1 << bits) + VOXEL_BRICK_VOLUME * bits / 8;
+	}
+
+	FORCEINLINE void VoxelData::releaseBrickDensity(VoxelBrick& brick) {
+		releaseBrickBuffer(brick.density_data, VOXEL_BRICK_VOLUME);
+		brick.density_data = NULL;
+	}
+
+	FORCEINLINE unsigned char* VoxelData::getWritableBrickDensity(VoxelBrick& brick) {
+		detachBrickBuffer(brick.density_data, VOXEL_BRICK_VOLUME);
+		return brick.density_data;
+	}
+
+	FORCEINLINE void VoxelData::releaseBrickMaterial(VoxelBrick& brick) {
+		if (brick.material_data != NULL) {
+			releaseBrickBuffer(brick.material_data, clcBrickMaterialBufferSize(brick.material_bits));
+		}
+
+		brick.material_data = NULL;
+		brick.material_bits = 0;
+		brick.material_palette_size = 0;
+	}
+
+	FORCEINLINE unsigned char VoxelData::getBrickMaterial(const VoxelBrick& brick, int i) const {
+		const int bits = brick.material_bits;
+		if (bits == 8) {
+			return brick.material_data[i];
+		}
+
+		const unsigned char* indices = brick.material_data + (1 << bits);
+		const int bit = i * bits;
+		const int p = (indices[bit >> 3] >> (bit & 7)) & ((1 << bits) - 1);
+		return brick.material_data[p];
+	}
+
+	FORCEINLINE void VoxelData::decodeBrickMaterial(const VoxelBrick& brick, unsigned char* materials) const {
+		if (brick.material_data == NULL) {
+			memset(materials, brick.base_fill_mat, VOXEL_BRICK_VOLUME);
+			return;
+		}
+
+		for (auto i = 0; i < VOXEL_BRICK_VOLUME; i++) {
+			materials[i] = getBrickMaterial(brick, i);
+		}
+	}
+
+	// replace brick material buffer with materials packed as bits wide palette indices
+	FORCEINLINE void VoxelData::encodeBrickMaterial(VoxelBrick& brick, const unsigned char* materials, int bits) {
+		unsigned char* data = allocBrickBuffer(clcBrickMaterialBufferSize(bits));
+		int palette_size = 0;
+
+		if (bits == 8) {
+			memcpy(data, materials, VOXEL_BRICK_VOLUME);
+		} else {
+			unsigned char* indices = data + (1 << bits);
+			memset(indices, 0, VOXEL_BRICK_VOLUME * bits / 8);
+
+			for (auto i = 0; i < VOXEL_BRICK_VOLUME; i++) {
+				int p = 0;
+				while (p < palette_size && data[p] != materials[i]) {
+					p++;
+				}
+
+				if (p == palette_size) {
+					check(p < (1 << bits));
+					data[p] = materials[i];
+					palette_size++;
+				}
+
+				const int bit = i * bits;
+				indices[bit >> 3] |= p << (bit & 7);
+			}
+		}
+
+		releaseBrickMaterial(brick);
+		brick.material_data = data;
+		brick.material_palette_size = palette_size;
+		brick.material_bits = bits;
+	}
+
+	FORCEINLINE void VoxelData::setBrickMaterial(VoxelBrick& brick, int i, unsigned char material) {
+		if (brick.material_data == NULL) {
+			if (material == brick.base_fill_mat) {
 				return;
 			}
 
-			if (density_state == VoxelDataFillState::ALL && density == 1) {
+			unsigned char materials[VOXEL_BRICK_VOLUME];
+			memset(materials, brick.base_fill_mat, VOXEL_BRICK_VOLUME);
+			encodeBrickMaterial(brick, materials, 1);
+		}
+
+		detachBrickBuffer(brick.material_data, clcBrickMaterialBufferSize(brick.material_bits));
+
+		if (brick.material_bits == 8) {
+			brick.material_data[i] = material;
+			return;
+		}
+
+		int p = 0;
+		while (p < brick.material_palette_size && brick.material_data[p] != material) {
+			p++;
+		}
+
+		if (p == brick.material_palette_size) {
+			if (p == (1 << brick.material_bits)) {
+				// palette is full - widen indices
+				unsigned char materials[VOXEL_BRICK_VOLUME];
+				decodeBrickMaterial(brick, materials);
+				materials[i] = material;
+				encodeBrickMaterial(brick, materials, brick.material_bits * 2);
 				return;
 			}
 
-			initializeDensity();
-			density_state = VoxelDataFillState::MIX;
+			brick.material_data[p] = material;
+			brick.material_palette_size++;
 		}
 
-        if(x < voxel_num && y < voxel_num && z < voxel_num){
-            int index = x * voxel_num * voxel_num + y * voxel_num + z;	
+		const int bits = brick.material_bits;
+		unsigned char* indices = brick.material_data + (1 << bits);
+		const int bit = i * bits;
+		const int mask = ((1 << bits) - 1) << (bit & 7);
+		indices[bit >> 3] = (indices[bit >> 3] & ~mask) | (p << (bit & 7));
+	}
 
+	FORCEINLINE void VoxelData::setDensity(int x, int y, int z, float density){
+        if(x < voxel_num && y < voxel_num && z < voxel_num){
 			if (density < 0) density = 0;
 			if (density > 1) density = 1;
 
 			unsigned char d = 255 * density;
 
-			density_data[index] = d;
+			if (bricks.empty()) {
+				if (density_state == VoxelDataFillState::ZERO && d == 0) {
+					return;
+				}
+
+				if (density_state == VoxelDataFillState::ALL && d == 255) {
+					return;
+				}
+
+				initializeBricks();
+			}
+
+			VoxelBrick& brick = bricks[clcBrickIndex(x, y, z)];
+			if (brick.density_data == NULL) {
+				if (brick.density_state == VoxelDataFillState::ZERO && d == 0) {
+					return;
+				}
+
+				if (brick.density_state == VoxelDataFillState::ALL && d == 255) {
+					return;
+				}
+
+				initializeBrickDensity(brick);
+			}
+
+			edit_region.add(x, y, z);
+			widenDensityBounds(x, y, z, d);
+			getWritableBrickDensity(brick)[clcBrickLocalIndex(x, y, z)] = d;
         }
     }
 
 	FORCEINLINE float VoxelData::getDensity(int x, int y, int z) const {
-		if (density_data == NULL) {
+		if (bricks.empty()) {
 			if (density_state == VoxelDataFillState::ALL) {
 				return 1;
 			}
@@ -96,47 +428,52 @@
 		}
 
         if(x < voxel_num && y < voxel_num && z < voxel_num){
-			int index = x * voxel_num * voxel_num + y * voxel_num + z;
-
-			float d = (float)density_data[index] / 255.0f;
-            return d;
+			return (float)getRawDensity(x, y, z) / 255.0f;
         } else {
             return 0;
         }
     }
 
 	FORCEINLINE unsigned char VoxelData::getRawDensity(int x, int y, int z) const {
-		auto index = x * voxel_num * voxel_num + y * voxel_num + z;
-		return density_data[index];
-	}
+		if (bricks.empty()) {
+			return (density_state == VoxelDataFillState::ALL) ? 255 : 0;
+		}
 
-	FORCEINLINE void VoxelData::setMaterial(int x, int y, int z, int material) {
-		if (material_data == NULL) {
-			initializeMaterial();
+		const VoxelBrick& brick = bricks[clcBrickIndex(x, y, z)];
+		if (brick.density_data == NULL) {
+			return (brick.density_state == VoxelDataFillState::ALL) ? 255 : 0;
 		}
 
+		return brick.density_data[clcBrickLocalIndex(x, y, z)];
+	}
+
+	FORCEINLINE void VoxelData::setMaterial(int x, int y, int z, int material) {
 		if (x < voxel_num && y < voxel_num && z < voxel_num) {
-			int index = x * voxel_num * voxel_num + y * voxel_num + z;
-			material_data[index] = material;
+			setVoxelPointMaterial(x, y, z, material);
 		}
 	}
 
 	FORCEINLINE int VoxelData::getMaterial(int x, int y, int z) const {
-		if (material_data == NULL) {
+		if (bricks.empty()) {
 			return base_fill_mat;
 		}
 
 		if (x < voxel_num && y < voxel_num && z < voxel_num) {
-			int index = x * voxel_num * voxel_num + y * voxel_num + z;
-			return material_data[index];
+			const VoxelBrick& brick = bricks[clcBrickIndex(x, y, z)];
+			if (brick.material_data == NULL) {
+				return brick.base_fill_mat;
+			}
+
+			return getBrickMaterial(brick, clcBrickLocalIndex(x, y, z));
 		} else {
 			return 0;
 		}
 	}
 
 	FORCEINLINE FVector VoxelData::voxelIndexToVector(int x, int y, int z) const {
-		static const float step = size() / (num() - 1);
-		static const float s = -size() / 2;
+		// zones of different sizes live in one process, so nothing of the size is cached here
+		const float step = size() / (num() - 1);
+		const float s = -size() / 2;
 		FVector v(s, s, s);
 		FVector a(x * step, y * step, z * step);
 		v = v + a;
@@ -163,54 +500,61 @@
 
 	FORCEINLINE VoxelPoint VoxelData::getVoxelPoint(int x, int y, int z) const {
 		VoxelPoint vp;
-		int index = x * voxel_num * voxel_num + y * voxel_num + z;
-
-		vp.material = base_fill_mat;
-		vp.density = 0;
-
-		if (density_data != NULL) {
-			vp.density = density_data[index];
-		}
-
-		if (material_data != NULL) {
-			vp.material = material_data[index];
-		}
+		vp.material = getMaterial(x, y, z);
 
+		// A zone with uniform density had no density buffer before bricks and reports 0 whatever its fill state,
+		// also if it keeps bricks for materials. Otherwise uniform bricks hold the value that was written to them.
+		vp.density = (density_state == VoxelDataFillState::MIX) ? getRawDensity(x, y, z) : 0;
 		return vp;
 	}
 
 	FORCEINLINE void VoxelData::setVoxelPoint(int x, int y, int z, unsigned char density, unsigned char material) {
-		if (density_data == NULL) {
-			initializeDensity();
-			density_state = VoxelDataFillState::MIX;
-		}
+		setVoxelPointDensity(x, y, z, density);
+		setVoxelPointMaterial(x, y, z, material);
+	}
+
+	FORCEINLINE void VoxelData::setVoxelPointDensity(int x, int y, int z, unsigned char density) {
+		if (bricks.empty()) {
+			if (density_state == VoxelDataFillState::ZERO && density == 0) {
+				return;
+			}
+
+			if (density_state == VoxelDataFillState::ALL && density == 255) {
+				return;
+			}
 
-		if (material_data == NULL) {
-			initializeMaterial();
+			initializeBricks();
 		}
 
-		int index = x * voxel_num * voxel_num + y * voxel_num + z;
-		material_data[index] = material;
-		density_data[index] = density;
-	}
+		VoxelBrick& brick = bricks[clcBrickIndex(x, y, z)];
+		if (brick.density_data == NULL) {
+			if (brick.density_state == VoxelDataFillState::ZERO && density == 0) {
+				return;
+			}
 
-	FORCEINLINE void VoxelData::setVoxelPointDensity(int x, int y, int z, unsigned char density) {
-		if (density_data == NULL) {
-			initializeDensity();
-			density_state = VoxelDataFillState::MIX;
+			if (brick.density_state == VoxelDataFillState::ALL && density == 255) {
+				return;
+			}
+
+			initializeBrickDensity(brick);
 		}
 
-		int index = x * voxel_num * voxel_num + y * voxel_num + z;
-		density_data[index] = density;
+		edit_region.add(x, y, z);
+		widenDensityBounds(x, y, z, density);
+		getWritableBrickDensity(brick)[clcBrickLocalIndex(x, y, z)] = density;
 	}
 
 	FORCEINLINE void VoxelData::setVoxelPointMaterial(int x, int y, int z, unsigned char material) {
-		if (material_data == NULL) {
-			initializeMaterial();
+		if (bricks.empty()) {
+			if (material == base_fill_mat) {
+				return;
+			}
+
+			initializeBricks();
 		}
 
-		int index = x * voxel_num * voxel_num + y * voxel_num + z;
-		material_data[index] = material;
+		edit_region.add(x, y, z);
+		setBrickMaterial(bricks[clcBrickIndex(x, y, z)], clcBrickLocalIndex(x, y, z), material);
 	}
 
 	FORCEINLINE void VoxelData::deinitializeDensity(VoxelDataFillState state) {
@@ -219,299 +563,2128 @@
 		}
 
 		density_state = state;
-		if (density_data != NULL) {
-			delete density_data;
+		edit_region.add(0, 0, 0);
+		edit_region.add(voxel_num - 1, voxel_num - 1, voxel_num - 1);
+
+		for (VoxelBrick& brick : bricks) {
+			releaseBrickDensity(brick);
+			brick.density_state = state;
+		}
+
+		if (!bricks.empty()) {
+			resetDensityBounds((state == VoxelDataFillState::ALL) ? 255 : 0);
 		}
 
-		density_data = NULL;
+		density_mips.clear();
+
+		if (isMaterialUniform()) {
+			releaseBricks();
+		}
 	}
 
 	FORCEINLINE void VoxelData::deinitializeMaterial(unsigned char base_mat) {
 		base_fill_mat = base_mat;
+		edit_region.add(0, 0, 0);
+		edit_region.add(voxel_num - 1, voxel_num - 1, voxel_num - 1);
 
-		if (material_data != NULL) {
-			delete material_data;
+		for (VoxelBrick& brick : bricks) {
+			releaseBrickMaterial(brick);
+			brick.base_fill_mat = base_mat;
 		}
 
-		material_data = NULL;
+		if (density_state != VoxelDataFillState::MIX) {
+			releaseBricks();
+		}
 	}
 
-	FORCEINLINE VoxelDataFillState VoxelData::getDensityFillState()	const {
-		return density_state;
-	}
-
-	FORCEINLINE bool VoxelData::performCellSubstanceCaching(int x, int y, int z, int lod, int step) {
-		if (x <= 0 || y <= 0 || z <= 0) {
-			return false;
-		}
-
-		if (x < step || y < step || z < step) {
-			return false;
-		}
-
-		unsigned char density[8];
-		static unsigned char isolevel = 127;
-
-		const int rx = x - step;
-		const int ry = y - step;
-		const int rz = z - step;
-
-		density[0] = getRawDensity(x, y - step, z);
-		density[1] = getRawDensity(x, y, z);
-		density[2] = getRawDensity(x - step, y - step, z);
-		density[3] = getRawDensity(x - step, y, z);
-		density[4] = getRawDensity(x, y - step, z - step);
-		density[5] = getRawDensity(x, y, z - step);
-		density[6] = getRawDensity(rx, ry, rz);
-		density[7] = getRawDensity(x - step, y, z - step);
-
-		if (density[0] > isolevel &&
-			density[1] > isolevel &&
-			density[2] > isolevel &&
-			density[3] > isolevel &&
-			density[4] > isolevel &&
-			density[5] > isolevel &&
-			density[6] > isolevel &&
-			density[7] > isolevel) {
-			return false;
-		}
-
-		if (density[0] <= isolevel &&
-			density[1] <= isolevel &&
-			density[2] <= isolevel &&
-			density[3] <= isolevel &&
-			density[4] <= isolevel &&
-			density[5] <= isolevel &&
-			density[6] <= isolevel &&
-			density[7] <= isolevel) {
-			return false;
-		}
-
-		int index = clcLinearIndex(rx, ry, rz);
-		SubstanceCache& lodCache = substanceCacheLOD[lod];
-		lodCache.cellList.push_back(index);
-		return true;
-	}
-
-
-	FORCEINLINE void VoxelData::performSubstanceCacheNoLOD(int x, int y, int z) {
-		if (density_data == NULL) {
-			return;
-		}
-
-		performCellSubstanceCaching(x, y, z, 0, 1);
-	}
-
-	FORCEINLINE void VoxelData::performSubstanceCacheLOD(int x, int y, int z) {
-		if (density_data == NULL) {
-			return;
-		}
-		
-		for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
-			int s = 1 << lod;
-			if (x >= s && y >= s && z >= s) {
-				if (x % s == 0 && y % s == 0 && z % s == 0) {
-					performCellSubstanceCaching(x, y, z, lod, s);
-				}
+	FORCEINLINE bool VoxelData::isMaterialUniform() const {
+		for (const VoxelBrick& brick : bricks) {
+			if (brick.material_data != NULL || brick.base_fill_mat != base_fill_mat) {
+				return false;
 			}
-		}
-	}
-
-	//====================================================================================
-	
-static FORCEINLINE FVector clcNormal(FVector &p1, FVector &p2, FVector &p3) {
-    float A = p1.Y * (p2.Z - p3.Z) + p2.Y * (p3.Z - p1.Z) + p3.Y * (p1.Z - p2.Z);
-    float B = p1.Z * (p2.X - p3.X) + p2.Z * (p3.X - p1.X) + p3.Z * (p1.X - p2.X);
-    float C = p1.X * (p2.Y - p3.Y) + p2.X * (p3.Y - p1.Y) + p3.X * (p1.Y - p2.Y);
-    // float D = -(p1.x * (p2.y * p3.z - p3.y * p2.z) + p2.x * (p3.y * p1.z - p1.y * p3.z) + p3.x * (p1.y * p2.z - p2.y
-    // * p1.z));
+		}
 
-    FVector n(A, B, C);
-    n.Normalize();
-    return n;
-}
+		return true;
+	}
 
-//####################################################################################################################################
-//
-//	VoxelMeshExtractor
-//
-//####################################################################################################################################
+	// check only voxels inside the zone; the tail of the last brick on each axis is never written
+	FORCEINLINE bool VoxelData::isBrickDataUniform(const unsigned char* data, int bx, int by, int bz) const {
+		const int x0 = bx * VOXEL_BRICK_SIZE;
+		const int y0 = by * VOXEL_BRICK_SIZE;
+		const int z0 = bz * VOXEL_BRICK_SIZE;
+		const int x1 = FMath::Min(x0 + VOXEL_BRICK_SIZE, voxel_num);
+		const int y1 = FMath::Min(y0 + VOXEL_BRICK_SIZE, voxel_num);
+		const int z1 = FMath::Min(z0 + VOXEL_BRICK_SIZE, voxel_num);
+		const unsigned char v = data[clcBrickLocalIndex(x0, y0, z0)];
+
+		for (auto x = x0; x < x1; x++) {
+			for (auto y = y0; y < y1; y++) {
+				for (auto z = z0; z < z1; z++) {
+					if (data[clcBrickLocalIndex(x, y, z)] != v) {
+						return false;
+					}
+				}
+			}
+		}
 
-//#define FORCEINLINE FORCENOINLINE  //debug
+		return true;
+	}
 
-class VoxelMeshExtractor {
+	// drop the material buffer of a single material brick or narrow its palette to the materials still in use
+	FORCEINLINE void VoxelData::compactBrickMaterial(VoxelBrick& brick, int bx, int by, int bz) {
+		const int x0 = bx * VOXEL_BRICK_SIZE;
+		const int y0 = by * VOXEL_BRICK_SIZE;
+		const int z0 = bz * VOXEL_BRICK_SIZE;
+		const int x1 = FMath::Min(x0 + VOXEL_BRICK_SIZE, voxel_num);
+		const int y1 = FMath::Min(y0 + VOXEL_BRICK_SIZE, voxel_num);
+		const int z1 = FMath::Min(z0 + VOXEL_BRICK_SIZE, voxel_num);
+
+		unsigned char materials[VOXEL_BRICK_VOLUME];
+		decodeBrickMaterial(brick, materials);
+
+		bool used[256] = { false };
+		int used_num = 0;
+		for (auto x = x0; x < x1; x++) {
+			for (auto y = y0; y < y1; y++) {
+				for (auto z = z0; z < z1; z++) {
+					const unsigned char m = materials[clcBrickLocalIndex(x, y, z)];
+					if (!used[m]) {
+						used[m] = true;
+						used_num++;
+					}
+				}
+			}
+		}
 
+		if (used_num == 1) {
+			brick.base_fill_mat = materials[0];
+			releaseBrickMaterial(brick);
+			return;
+		}
+
+		int bits = 1;
+		while ((1 << bits) < used_num && bits < 8) {
+			bits *= 2;
+		}
+
+		if (bits < brick.material_bits || used_num < brick.material_palette_size) {
+			// the tail of the last brick on each axis is never read, don't let it hold palette entries
+			for (auto i = 0; i < VOXEL_BRICK_VOLUME; i++) {
+				if (!used[materials[i]]) {
+					materials[i] = materials[0];
+				}
+			}
+
+			encodeBrickMaterial(brick, materials, bits);
+		}
+	}
+
+	void VoxelData::compactBricks() {
+		VoxelDirtyRegion region;
+		region.add(0, 0, 0);
+		region.add(voxel_num - 1, voxel_num - 1, voxel_num - 1);
+		compactBricks(region);
+	}
+
+	void VoxelData::compactBricks(const VoxelDirtyRegion& region) {
+		if (bricks.empty() || region.isEmpty()) {
+			return;
+		}
+
+		for (auto bx = region.min_x >> VOXEL_BRICK_SHIFT; bx <= region.max_x >> VOXEL_BRICK_SHIFT; bx++) {
+			for (auto by = region.min_y >> VOXEL_BRICK_SHIFT; by <= region.max_y >> VOXEL_BRICK_SHIFT; by++) {
+				for (auto bz = region.min_z >> VOXEL_BRICK_SHIFT; bz <= region.max_z >> VOXEL_BRICK_SHIFT; bz++) {
+					VoxelBrick& brick = bricks[bx * brick_num * brick_num + by * brick_num + bz];
+
+					if (brick.density_data != NULL && isBrickDataUniform(brick.density_data, bx, by, bz)) {
+						const unsigned char d = brick.density_data[0];
+						if (d == 0 || d == 255) {
+							releaseBrickDensity(brick);
+							brick.density_state = (d == 0) ? VoxelDataFillState::ZERO : VoxelDataFillState::ALL;
+						}
+					}
+
+					if (brick.material_data != NULL) {
+						compactBrickMaterial(brick, bx, by, bz);
+					}
+				}
+			}
+		}
+
+		updateDensityBounds(region);
+	}
+
+	SIZE_T VoxelData::getMemorySize() const {
+		SIZE_T size = sizeof(VoxelData) + bricks.capacity() * sizeof(VoxelBrick);
+
+		for (const VoxelBrick& brick : bricks) {
+			if (brick.density_data != NULL) {
+				size += VOXEL_BRICK_VOLUME + BRICK_BUFFER_HEADER_SIZE;
+			}
+
+			if (brick.material_data != NULL) {
+				size += clcBrickMaterialBufferSize(brick.material_bits) + BRICK_BUFFER_HEADER_SIZE;
+			}
+		}
+
+		for (const auto& level_bounds : density_bounds) {
+			size += level_bounds.capacity() * sizeof(VoxelDensityBounds);
+		}
+
+		for (const std::shared_ptr<VoxelDensityMip>& mip : density_mips) {
+			size += mip->density.capacity() + mip->material.capacity();
+		}
+
+		for (const SubstanceCache& lodCache : substanceCacheLOD) {
+			size += lodCache.cellList.capacity() * sizeof(uint32);
+		}
+
+		for (const VoxelApronFace& face : apron) {
+			if (face.density) {
+				size += face.density->capacity();
+			}
+		}
+
+		return size;
+	}
+
+	std::shared_ptr<const VoxelData> VoxelData::snapshot() const {
+		VoxelData* vd = new VoxelData(voxel_num, volume_size);
+
+		edit_mutex.lock();
+
+		vd->density_state = density_state;
+		vd->base_fill_mat = base_fill_mat;
+		vd->bricks = bricks;
+		vd->density_bounds = density_bounds;
+		vd->density_mips_enabled = density_mips_enabled;
+		vd->density_mips = density_mips;
+		vd->apron = apron;
+
+		for (VoxelBrick& brick : vd->bricks) {
+			retainBrickBuffer(brick.density_data);
+			retainBrickBuffer(brick.material_data);
+		}
+
+		vd->change_version = change_version.load();
+		vd->save_version = save_version.load();
+		vd->mesh_version = mesh_version.load();
+		vd->cache_version = cache_version.load();
+
+		dirty_region_mutex.lock();
+		vd->save_region = save_region;
+		vd->mesh_region = mesh_region;
+		vd->cache_region = cache_region;
+		dirty_region_mutex.unlock();
+
+		vd->origin = origin;
+		vd->lower = lower;
+		vd->upper = upper;
+
+		// mesh generator reads cache only if it is valid
+		if (isSubstanceCacheValid()) {
+			vd->substanceCacheLOD = substanceCacheLOD;
+		}
+
+		vd->DataState = DataState;
+
+		edit_mutex.unlock();
+
+		return std::shared_ptr<const VoxelData>(vd);
+	}
+
+	void VoxelData::setChanged() {
+		dirty_region_mutex.lock();
+		save_region.add(edit_region);
+		mesh_region.add(edit_region);
+		cache_region.add(edit_region);
+		change_version++;
+		dirty_region_mutex.unlock();
+
+		edit_region.clear();
+	}
+
+	void VoxelData::setUpToDate(std::atomic<uint64>& version, VoxelDirtyRegion& region, uint64 up_to_version) {
+		dirty_region_mutex.lock();
+		if (up_to_version > version) {
+			version = up_to_version;
+		}
+
+		// edits after up_to_version can't be taken out of the region, it stays dirty until they are handled too
+		if (up_to_version >= change_version) {
+			region.clear();
+		}
+		dirty_region_mutex.unlock();
+	}
+
+	VoxelDirtyRegion VoxelData::getDirtyRegion(const VoxelDirtyRegion& region) const {
+		dirty_region_mutex.lock();
+		VoxelDirtyRegion ret = region;
+		dirty_region_mutex.unlock();
+		return ret;
+	}
+
+	FORCEINLINE VoxelDataFillState VoxelData::getDensityFillState()	const {
+		return density_state;
+	}
+
+	// Calls f(z) for lower corners z = z_begin, z_begin + stride, ... < z_end of size wide cells in row (x, y).
+	// Runs of cells are skipped if density bounds show that no voxel of them crosses the isolevel,
+	// first by 16^3 blocks, then by 4^3 blocks. Cells are visited in the same order as a plain loop.
+	// A mip sample of a size wide cell is filtered from voxels up to size - 1 away, so the checked box grows by that.
+	template<typename F>
+	static FORCEINLINE void forEachSurfaceCellInRow(const VoxelData& vd, int x, int y, int z_begin, int z_end, int stride, int size, F f) {
+		const int seg = FMath::Max(16, stride);
+		const int sub = FMath::Max(4, stride);
+		const int m = vd.hasDensityMips() ? size - 1 : 0;
+
+		for (auto zs = z_begin; zs < z_end; zs += seg) {
+			const int ze = FMath::Min(zs + seg, z_end);
+			if (!vd.isSurfacePossible(x - m, y - m, zs - m, x + size + m, y + size + m, ze - 1 + size + m, 2)) {
+				continue;
+			}
+
+			for (auto zb = zs; zb < ze; zb += sub) {
+				const int zbe = FMath::Min(zb + sub, ze);
+				if (!vd.isSurfacePossible(x - m, y - m, zb - m, x + size + m, y + size + m, zbe - 1 + size + m, 0)) {
+					continue;
+				}
+
+				for (auto z = zb; z < zbe; z += stride) {
+					f(z);
+				}
+			}
+		}
+	}
+
+	// Like forEachSurfaceCellInRow but calls f(z_begin, z_end) once for each run of adjacent cells that are not skipped.
+	template<typename F>
+	static FORCEINLINE void forEachSurfaceRunInRow(const VoxelData& vd, int x, int y, int z_begin, int z_end, int stride, int size, F f) {
+		int run_begin = z_begin;
+		int run_end = z_begin;
+
+		forEachSurfaceCellInRow(vd, x, y, z_begin, z_end, stride, size, [&](int z) {
+			if (z != run_end) {
+				if (run_end > run_begin) {
+					f(run_begin, run_end);
+				}
+
+				run_begin = z;
+			}
+
+			run_end = z + stride;
+		});
+
+		if (run_end > run_begin) {
+			f(run_begin, run_end);
+		}
+	}
+
+	static FORCEINLINE bool isSurfaceCaseCode(unsigned char case_code) {
+		return case_code != 0 && case_code != 255;
+	}
+
+#if VOXEL_CELL_CASE_SSE2
+	// 0xff where the raw density is below the isolevel
+	static FORCEINLINE __m128i clcBelowIsolevelMask(const unsigned char* density) {
+		const __m128i v = _mm_loadu_si128((const __m128i*)density);
+		return _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(VOXEL_ISOLEVEL_RAW)), v);
+	}
+
+	static FORCEINLINE __m128i clcCaseCodeBits(const unsigned char* density, int bit) {
+		return _mm_and_si128(clcBelowIsolevelMask(density), _mm_set1_epi8((char)bit));
+	}
+#endif
+
+	static FORCEINLINE unsigned char clcCaseCodeBit(unsigned char density, int bit) {
+		return (density <= VOXEL_ISOLEVEL_RAW) ? bit : 0;
+	}
+
+	void VoxelData::clcCellCaseCodeRow(int x, int y, int z, int count, int lod, unsigned char* case_code) const {
+		const int step = 1 << lod;
+
+		// the 4 corner columns of the row: (x, y), (x, y + step), (x + step, y), (x + step, y + step)
+		unsigned char column[4][VOXEL_CELL_ROW_MAX + 1];
+
+		for (auto i = 0; i <= count; i++) {
+			const int cz = z + i * step;
+			column[0][i] = getRawDensityLOD(x, y, cz, lod);
+			column[1][i] = getRawDensityLOD(x, y + step, cz, lod);
+			column[2][i] = getRawDensityLOD(x + step, y, cz, lod);
+			column[3][i] = getRawDensityLOD(x + step, y + step, cz, lod);
+		}
+
+		int i = 0;
+
+#if VOXEL_CELL_CASE_SSE2
+		for (; i + 16 <= count; i += 16) {
+			__m128i code = clcCaseCodeBits(&column[1][i], 0x01);
+			code = _mm_or_si128(code, clcCaseCodeBits(&column[0][i], 0x02));
+			code = _mm_or_si128(code, clcCaseCodeBits(&column[3][i], 0x04));
+			code = _mm_or_si128(code, clcCaseCodeBits(&column[2][i], 0x08));
+			code = _mm_or_si128(code, clcCaseCodeBits(&column[1][i + 1], 0x10));
+			code = _mm_or_si128(code, clcCaseCodeBits(&column[0][i + 1], 0x20));
+			code = _mm_or_si128(code, clcCaseCodeBits(&column[3][i + 1], 0x40));
+			code = _mm_or_si128(code, clcCaseCodeBits(&column[2][i + 1], 0x80));
+			_mm_storeu_si128((__m128i*)&case_code[i], code);
+		}
+#endif
+
+		for (; i < count; i++) {
+			case_code[i] = clcCaseCodeBit(column[1][i], 0x01)
+				| clcCaseCodeBit(column[0][i], 0x02)
+				| clcCaseCodeBit(column[3][i], 0x04)
+				| clcCaseCodeBit(column[2][i], 0x08)
+				| clcCaseCodeBit(column[1][i + 1], 0x10)
+				| clcCaseCodeBit(column[0][i + 1], 0x20)
+				| clcCaseCodeBit(column[3][i + 1], 0x40)
+				| clcCaseCodeBit(column[2][i + 1], 0x80);
+		}
+	}
+
+	FORCEINLINE bool VoxelData::isSubstanceCell(int x, int y, int z, int step) const {
+		if (x <= 0 || y <= 0 || z <= 0) {
+			return false;
+		}
+
+		if (x < step || y < step || z < step) {
+			return false;
+		}
+
+		unsigned char density[8];
+		static unsigned char isolevel = 127;
+
+		const int rx = x - step;
+		const int ry = y - step;
+		const int rz = z - step;
+		const int lod = FMath::CountTrailingZeros(step);
+
+		density[0] = getRawDensityLOD(x, y - step, z, lod);
+		density[1] = getRawDensityLOD(x, y, z, lod);
+		density[2] = getRawDensityLOD(x - step, y - step, z, lod);
+		density[3] = getRawDensityLOD(x - step, y, z, lod);
+		density[4] = getRawDensityLOD(x, y - step, z - step, lod);
+		density[5] = getRawDensityLOD(x, y, z - step, lod);
+		density[6] = getRawDensityLOD(rx, ry, rz, lod);
+		density[7] = getRawDensityLOD(x - step, y, z - step, lod);
+
+		if (density[0] > isolevel &&
+			density[1] > isolevel &&
+			density[2] > isolevel &&
+			density[3] > isolevel &&
+			density[4] > isolevel &&
+			density[5] > isolevel &&
+			density[6] > isolevel &&
+			density[7] > isolevel) {
+			return false;
+		}
+
+		if (density[0] <= isolevel &&
+			density[1] <= isolevel &&
+			density[2] <= isolevel &&
+			density[3] <= isolevel &&
+			density[4] <= isolevel &&
+			density[5] <= isolevel &&
+			density[6] <= isolevel &&
+			density[7] <= isolevel) {
+			return false;
+		}
+
+		return true;
+	}
+
+	FORCEINLINE bool VoxelData::performCellSubstanceCaching(int x, int y, int z, int lod, int step) {
+		if (!isSubstanceCell(x, y, z, step)) {
+			return false;
+		}
+
+		uint32 index = clcLinearIndex(x - step, y - step, z - step);
+		SubstanceCache& lodCache = substanceCacheLOD[lod];
+		lodCache.cellList.push_back(index);
+		return true;
+	}
+
+
+	FORCEINLINE void VoxelData::performSubstanceCacheNoLOD(int x, int y, int z) {
+		if (density_state != VoxelDataFillState::MIX) {
+			return;
+		}
+
+		performCellSubstanceCaching(x, y, z, 0, 1);
+	}
+
+	FORCEINLINE void VoxelData::performSubstanceCacheLOD(int x, int y, int z) {
+		if (density_state != VoxelDataFillState::MIX) {
+			return;
+		}
+		
+		for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+			int s = 1 << lod;
+			if (x >= s && y >= s && z >= s) {
+				if (x % s == 0 && y % s == 0 && z % s == 0) {
+					performCellSubstanceCaching(x, y, z, lod, s);
+				}
+			}
+		}
+	}
+
+	void VoxelData::rebuildSubstanceCacheLOD() {
+		for (SubstanceCache& lodCache : substanceCacheLOD) {
+			lodCache.cellList.clear();
+		}
+
+		if (density_state != VoxelDataFillState::MIX) {
+			return;
+		}
+
+		for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+			const int s = 1 << lod;
+			std::vector<uint32>& cellList = substanceCacheLOD[lod].cellList;
+			unsigned char case_code[VOXEL_CELL_ROW_MAX];
+
+			for (auto x = 0; x < voxel_num - s; x += s) {
+				for (auto y = 0; y < voxel_num - s; y += s) {
+					forEachSurfaceRunInRow(*this, x, y, 0, voxel_num - s, s, s, [&](int z_begin, int z_end) {
+						const int count = (z_end - z_begin) / s;
+						clcCellCaseCodeRow(x, y, z_begin, count, lod, case_code);
+
+						for (auto i = 0; i < count; i++) {
+							if (isSurfaceCaseCode(case_code[i])) {
+								cellList.push_back(clcLinearIndex(x, y, z_begin + i * s));
+							}
+						}
+					});
+				}
+			}
+
+			substanceCacheLOD[lod].cellList.shrink_to_fit();
+		}
+	}
+
+	// cells of the lod with a corner in region, given by the upper corner passed to performCellSubstanceCaching
+	FORCEINLINE void VoxelData::updateSubstanceCache(const VoxelDirtyRegion& changed, int lod) {
+		const int s = 1 << lod;
+		std::vector<uint32>& cellList = substanceCacheLOD[lod].cellList;
+
+		if (density_state != VoxelDataFillState::MIX) {
+			cellList.clear();
+			return;
+		}
+
+		if (changed.isEmpty()) {
+			return;
+		}
+
+		// a changed voxel moves mip samples of the lod up to s - 1 voxels away
+		VoxelDirtyRegion region = changed;
+		if (lod > 0 && hasDensityMips()) {
+			region.add(FMath::Max(0, changed.min_x - s + 1), FMath::Max(0, changed.min_y - s + 1), FMath::Max(0, changed.min_z - s + 1));
+			region.add(FMath::Min(voxel_num - 1, changed.max_x + s - 1), FMath::Min(voxel_num - 1, changed.max_y + s - 1), FMath::Min(voxel_num - 1, changed.max_z + s - 1));
+		}
+
+		// first and last upper corner on the lod grid of cells touching the region
+		const int x0 = FMath::Max(s, (region.min_x + s - 1) / s * s);
+		const int y0 = FMath::Max(s, (region.min_y + s - 1) / s * s);
+		const int z0 = FMath::Max(s, (region.min_z + s - 1) / s * s);
+		const int x1 = FMath::Min(voxel_num - 1, region.max_x + s);
+		const int y1 = FMath::Min(voxel_num - 1, region.max_y + s);
+		const int z1 = FMath::Min(voxel_num - 1, region.max_z + s);
+
+		if (x0 > x1 || y0 > y1 || z0 > z1) {
+			return;
+		}
+
+		// drop cached cells of the region
+		auto it = std::remove_if(cellList.begin(), cellList.end(), [&](uint32 index) {
+			int x, y, z;
+			clcVoxelIndex(index, x, y, z);
+			x += s; 
+			y += s; 
+			z += s;
+			return x >= x0 && x <= x1 && y >= y0 && y <= y1 && z >= z0 && z <= z1;
+		});
+		cellList.erase(it, cellList.end());
+
+		std::vector<uint32> regionCellList;
+		unsigned char case_code[VOXEL_CELL_ROW_MAX];
+
+		for (auto x = x0; x <= x1; x += s) {
+			for (auto y = y0; y <= y1; y += s) {
+				forEachSurfaceRunInRow(*this, x - s, y - s, z0 - s, z1 - s + 1, s, s, [&](int z_begin, int z_end) {
+					const int count = (z_end - z_begin) / s;
+					clcCellCaseCodeRow(x - s, y - s, z_begin, count, lod, case_code);
+
+					for (auto i = 0; i < count; i++) {
+						if (isSurfaceCaseCode(case_code[i])) {
+							regionCellList.push_back(clcLinearIndex(x - s, y - s, z_begin + i * s));
+						}
+					}
+				});
+			}
+		}
+
+		// keep ascending order like a full rebuild
+		const size_t n = cellList.size();
+		cellList.insert(cellList.end(), regionCellList.begin(), regionCellList.end());
+		std::inplace_merge(cellList.begin(), cellList.begin() + n, cellList.end());
+	}
+
+	void VoxelData::updateSubstanceCacheNoLOD(const VoxelDirtyRegion& region) {
+		if (!isSubstanceCacheValid()) {
+			for (SubstanceCache& lodCache : substanceCacheLOD) {
+				lodCache.cellList.clear();
+			}
+
+			VoxelDirtyRegion zone;
+			zone.add(0, 0, 0);
+			zone.add(voxel_num - 1, voxel_num - 1, voxel_num - 1);
+			updateSubstanceCache(zone, 0);
+			return;
+		}
+
+		updateSubstanceCache(region, 0);
+
+		// like performSubstanceCacheNoLOD, the LOD cache is not maintained
+		for (auto lod = 1; lod < LOD_ARRAY_SIZE; lod++) {
+			substanceCacheLOD[lod].cellList.clear();
+		}
+	}
+
+	void VoxelData::updateSubstanceCacheLOD(const VoxelDirtyRegion& region) {
+		if (!isSubstanceCacheValid()) {
+			rebuildSubstanceCacheLOD();
+			return;
+		}
+
+		for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+			updateSubstanceCache(region, lod);
+		}
+	}
+
+	VoxelDirtyRegion VoxelData::clcVoxelRegion(FVector center, float extent) const {
+		const float step = size() / (num() - 1);
+		const FVector local = center - origin;
+
+		// one voxel margin against rounding
+		VoxelDirtyRegion region;
+		region.add(
+			FMath::Clamp(FMath::FloorToInt((local.X - extent + size() / 2) / step) - 1, 0, voxel_num - 1),
+			FMath::Clamp(FMath::FloorToInt((local.Y - extent + size() / 2) / step) - 1, 0, voxel_num - 1),
+			FMath::Clamp(FMath::FloorToInt((local.Z - extent + size() / 2) / step) - 1, 0, voxel_num - 1));
+		region.add(
+			FMath::Clamp(FMath::CeilToInt((local.X + extent + size() / 2) / step) + 1, 0, voxel_num - 1),
+			FMath::Clamp(FMath::CeilToInt((local.Y + extent + size() / 2) / step) + 1, 0, voxel_num - 1),
+			FMath::Clamp(FMath::CeilToInt((local.Z + extent + size() / 2) / step) + 1, 0, voxel_num - 1));
+
+		return region;
+	}
+
+	void VoxelData::setDensityMipsEnabled(bool enabled) {
+		density_mips_enabled = enabled;
+		rebuildDensityMips();
+	}
+
+	FORCEINLINE unsigned char VoxelData::getMipSourceDensity(int level, int x, int y, int z) const {
+		if (level == 0) {
+			return getRawDensity(x, y, z);
+		}
+
+		const VoxelDensityMip& mip = *density_mips[level - 1];
+		return mip.density[(x * mip.num + y) * mip.num + z];
+	}
+
+	FORCEINLINE unsigned char VoxelData::getMipSourceMaterial(int level, int x, int y, int z) const {
+		if (level == 0) {
+			return getMaterial(x, y, z);
+		}
+
+		const VoxelDensityMip& mip = *density_mips[level - 1];
+		return mip.material[(x * mip.num + y) * mip.num + z];
+	}
+
+	// 3x3x3 tent filter (1 2 1) over the previous level. Samples on a zone face are filtered only
+	// along the face, so they match the same samples of the neighbour zone and LOD meshes keep closed seams.
+	// Material is taken from the voxel under the sample.
+	FORCEINLINE void VoxelData::buildDensityMipSample(int level, int i, int j, int k) {
+		VoxelDensityMip& mip = *density_mips[level - 1];
+		const int n = mip.num;
+		const int sx = i * 2;
+		const int sy = j * 2;
+		const int sz = k * 2;
+		const int dx = (i == 0 || i == n - 1) ? 0 : 1;
+		const int dy = (j == 0 || j == n - 1) ? 0 : 1;
+		const int dz = (k == 0 || k == n - 1) ? 0 : 1;
+
+		uint32 sum = 0;
+		uint32 weight_sum = 0;
+		for (auto x = -dx; x <= dx; x++) {
+			for (auto y = -dy; y <= dy; y++) {
+				for (auto z = -dz; z <= dz; z++) {
+					const uint32 w = (x == 0 ? 2 : 1) * (y == 0 ? 2 : 1) * (z == 0 ? 2 : 1);
+					sum += w * getMipSourceDensity(level - 1, sx + x, sy + y, sz + z);
+					weight_sum += w;
+				}
+			}
+		}
+
+		const int index = (i * n + j) * n + k;
+		mip.density[index] = (sum + weight_sum / 2) / weight_sum;
+		mip.material[index] = getMipSourceMaterial(level - 1, sx, sy, sz);
+	}
+
+	void VoxelData::rebuildDensityMips() {
+		density_mips.clear();
+
+		if (!density_mips_enabled || density_state != VoxelDataFillState::MIX || bricks.empty()) {
+			density_mips.shrink_to_fit();
+			return;
+		}
+
+		density_mips.resize(LOD_ARRAY_SIZE - 1);
+
+		for (auto level = 1; level < LOD_ARRAY_SIZE; level++) {
+			density_mips[level - 1] = std::make_shared<VoxelDensityMip>();
+			VoxelDensityMip& mip = *density_mips[level - 1];
+			const int n = ((voxel_num - 1) >> level) + 1;
+			mip.num = n;
+			mip.density.resize(n * n * n);
+			mip.material.resize(n * n * n);
+
+			for (auto i = 0; i < n; i++) {
+				for (auto j = 0; j < n; j++) {
+					for (auto k = 0; k < n; k++) {
+						buildDensityMipSample(level, i, j, k);
+					}
+				}
+			}
+		}
+	}
+
+	// copy the level if a snapshot still holds it
+	void VoxelData::detachDensityMip(int level) {
+		std::shared_ptr<VoxelDensityMip>& mip = density_mips[level - 1];
+		if (mip.use_count() > 1) {
+			mip = std::make_shared<VoxelDensityMip>(*mip);
+		}
+	}
+
+	// rebuild only samples filtered from changed voxels, level by level
+	void VoxelData::updateDensityMips(const VoxelDirtyRegion& region) {
+		if (!density_mips_enabled) {
+			return;
+		}
+
+		if (density_mips.empty() || density_state != VoxelDataFillState::MIX || bricks.empty()) {
+			rebuildDensityMips();
+			return;
+		}
+
+		if (region.isEmpty()) {
+			return;
+		}
+
+		int x0 = region.min_x, y0 = region.min_y, z0 = region.min_z;
+		int x1 = region.max_x, y1 = region.max_y, z1 = region.max_z;
+
+		for (auto level = 1; level < LOD_ARRAY_SIZE; level++) {
+			detachDensityMip(level);
+			const int n = density_mips[level - 1]->num;
+
+			// samples with a tap in the changed range of the previous level
+			x0 = FMath::Max(0, (x0 - 1) >> 1);
+			y0 = FMath::Max(0, (y0 - 1) >> 1);
+			z0 = FMath::Max(0, (z0 - 1) >> 1);
+			x1 = FMath::Min(n - 1, (x1 + 1) >> 1);
+			y1 = FMath::Min(n - 1, (y1 + 1) >> 1);
+			z1 = FMath::Min(n - 1, (z1 + 1) >> 1);
+
+			for (auto i = x0; i <= x1; i++) {
+				for (auto j = y0; j <= y1; j++) {
+					for (auto k = z0; k <= z1; k++) {
+						buildDensityMipSample(level, i, j, k);
+					}
+				}
+			}
+		}
+	}
+
+	// plane next to the face, one voxel inside of the shared border plane
+	void VoxelData::copyApronSlab(int face, std::vector<unsigned char>& slab) const {
+		const int n = voxel_num;
+		const int axis = face / 2;
+		const int p = (face & 1) ? n - 2 : 1;
+
+		slab.resize(n * n);
+		for (auto a = 0; a < n; a++) {
+			for (auto b = 0; b < n; b++) {
+				unsigned char d;
+				if (axis == 0) {
+					d = getRawDensity(p, a, b);
+				} else if (axis == 1) {
+					d = getRawDensity(a, p, b);
+				} else {
+					d = getRawDensity(a, b, p);
+				}
+
+				slab[a * n + b] = d;
+			}
+		}
+	}
+
+	void VoxelData::setApronFace(int face, const std::vector<unsigned char>& slab) {
+		apron[face].density = std::make_shared<const std::vector<unsigned char>>(slab);
+		apron[face].valid = true;
+
+		// The apron changes the normals on the face plane, so it is a new version for meshes and LODs of the old
+		// one are not merged with the new ones. Voxels of the zone stay the same, save and cache stay up to date.
+		int lower[3] = { 0, 0, 0 };
+		int upper[3] = { voxel_num - 1, voxel_num - 1, voxel_num - 1 };
+		if (face & 1) {
+			lower[face / 2] = voxel_num - 1;
+		} else {
+			upper[face / 2] = 0;
+		}
+
+		dirty_region_mutex.lock();
+		const uint64 version = change_version;
+		change_version++;
+		mesh_region.add(lower[0], lower[1], lower[2]);
+		mesh_region.add(upper[0], upper[1], upper[2]);
+
+		if (save_version >= version) {
+			save_version = version + 1;
+		}
+
+		if (cache_version >= version) {
+			cache_version = version + 1;
+		}
+		dirty_region_mutex.unlock();
+	}
+
+	bool VoxelData::hasApron() const {
+		for (const VoxelApronFace& face : apron) {
+			if (face.valid) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	FORCEINLINE unsigned char VoxelData::getRawDensityExt(int x, int y, int z) const {
+		const int n = voxel_num;
+		const int face = (x < 0) ? 0 : (x >= n) ? 1 : (y < 0) ? 2 : (y >= n) ? 3 : (z < 0) ? 4 : (z >= n) ? 5 : -1;
+
+		if (face >= 0 && apron[face].valid) {
+			const int axis = face / 2;
+			const int a = (axis == 0) ? y : x;
+			const int b = (axis == 2) ? y : z;
+
+			if (a >= 0 && a < n && b >= 0 && b < n) {
+				return (*apron[face].density)[a * n + b];
+			}
+		}
+
+		return getRawDensity(FMath::Clamp(x, 0, n - 1), FMath::Clamp(y, 0, n - 1), FMath::Clamp(z, 0, n - 1));
+	}
+
+	FORCEINLINE float VoxelData::getDensityLOD(int x, int y, int z, int lod) const {
+		if (clcDensityMipLevel(x, y, z, lod) == 0) {
+			return getDensity(x, y, z);
+		}
+
+		return (float)getRawDensityLOD(x, y, z, lod) / 255.0f;
+	}
+
+	FORCEINLINE unsigned char VoxelData::getRawDensityLOD(int x, int y, int z, int lod) const {
+		const int level = clcDensityMipLevel(x, y, z, lod);
+		if (level == 0) {
+			// cells of the coarsest lods can be larger than the zone, outside is empty like in getDensity
+			if (x >= voxel_num || y >= voxel_num || z >= voxel_num) {
+				return 0;
+			}
+
+			return getRawDensity(x, y, z);
+		}
+
+		const VoxelDensityMip& mip = *density_mips[level - 1];
+		return mip.density[((x >> level) * mip.num + (y >> level)) * mip.num + (z >> level)];
+	}
+
+	FORCEINLINE int VoxelData::getMaterialLOD(int x, int y, int z, int lod) const {
+		const int level = clcDensityMipLevel(x, y, z, lod);
+		if (level == 0) {
+			return getMaterial(x, y, z);
+		}
+
+		const VoxelDensityMip& mip = *density_mips[level - 1];
+		return mip.material[((x >> level) * mip.num + (y >> level)) * mip.num + (z >> level)];
+	}
+
+	//====================================================================================
+	
+static FORCEINLINE FVector clcNormal(FVector &p1, FVector &p2, FVector &p3) {
+    float A = p1.Y * (p2.Z - p3.Z) + p2.Y * (p3.Z - p1.Z) + p3.Y * (p1.Z - p2.Z);
+    float B = p1.Z * (p2.X - p3.X) + p2.Z * (p3.X - p1.X) + p3.Z * (p1.X - p2.X);
+    float C = p1.X * (p2.Y - p3.Y) + p2.X * (p3.Y - p1.Y) + p3.X * (p1.Y - p2.Y);
+    // float D = -(p1.x * (p2.y * p3.z - p3.y * p2.z) + p2.x * (p3.y * p1.z - p1.y * p3.z) + p3.x * (p1.y * p2.z - p2.y
+    // * p1.z));
+
+    FVector n(A, B, C);
+    n.Normalize();
+    return n;
+}
+
+//####################################################################################################################################
+//
+//	VoxelMeshExtractor
+//
+//####################################################################################################################################
+
+//#define FORCEINLINE FORCENOINLINE  //debug
+
+// regular cell edge of a slice, valid if the stamp matches the use of the deck and the slice
+struct EdgeDeckEntry {
+	int stamp = -1;
+	int index = -1;
+};
+
+// decks are cleared only when the use counter runs out, stamps are (use << 8) | slice
+#define EDGE_DECK_MAX_USE (1 << 22)
+
+// vertex on the plane shared with the previous slab
+struct SlabBorderVertex {
+	uint64 key;
+	int index;
+
+	// normal the vertex was made with, gradient normals are never averaged
+	FVector normal;
+	bool has_normal;
+};
+
+// vertex reuse tables of one mesh section
+struct MeshHandlerScratch {
+	std::vector<EdgeDeckEntry> edge_deck[2];
+	int edge_deck_use = 0;
+	TMap<uint64, int> edge_vertex_map;
+	TMap<FVector, int> vertex_map;
+
+	// vertices on edges of the planes shared with the previous and the next slab, by edge key
+	std::vector<SlabBorderVertex> low_border;
+	TMap<uint64, int> high_border;
+
+	// normals averaged into each vertex, kept if there is a previous slab
+	std::vector<int> average_count;
+
+	// edge vertex was made with a gradient normal, by vertex index
+	std::vector<bool> gradient_normal;
+
+	// vertex index of the slab to index of the stitched section
+	std::vector<int> slab_remap;
+};
+
+// tables of the surface nets extractor of one lod
+struct SurfaceNetsScratch {
+	// vertex of each cell or -1, only the entries of cell_list are set
+	std::vector<int> cell_index;
+
+	// surface cells in the order they were found and the corners of each that are solid
+	std::vector<uint32> cell_list;
+	std::vector<uint8> cell_corner;
+
+	// vertices of cells collapsed onto the zone faces, by cell key
+	TMap<uint32, int> border_index;
+};
+
+// tables of the vertex cache pass of one section
+struct VertexCacheScratch {
+	// triangles of each vertex, the ones of vertex v from adjacency_offset[v]
+	std::vector<int> adjacency_offset;
+	std::vector<int> adjacency;
+
+	// triangles of each vertex not emitted yet
+	std::vector<int> live_count;
+
+	// time a vertex or a cache line entered the simulated cache
+	std::vector<int> cache_time;
+
+	std::vector<int> dead_end;
+	std::vector<int> candidate;
+	std::vector<uint8> emitted;
+	std::vector<int> remap;
+
+	TArray<int32> index_buffer;
+	TArray<FProcMeshVertex> vertex_buffer;
+};
+
+// LOD as it is meshed, in full precision vertices. They are packed to MeshLodSection once the LOD is done
+struct MeshBuildLodSection {
+	FProcMeshSection mainMesh;
+
+	FProcMeshSection transitionMeshArray[6];
+
+	TArray<FVector> DebugPointList;
+};
+
+// Everything a zone is meshed into before the result is copied to MeshData. Contexts are recycled
+// and their buffers are reset, not freed, so steady state meshing allocates only the MeshData itself.
+struct VoxelMeshContext {
+	MeshBuildLodSection lod_section[LOD_ARRAY_SIZE];
+
+	// slabs of a LOD are stitched here before packing, in the context of the first slab
+	FProcMeshSection stitch_section[LOD_ARRAY_SIZE];
+
+	// main mesh and 6 transition sections of every LOD
+	MeshHandlerScratch handler_scratch[LOD_ARRAY_SIZE][7];
+
+	// collision mesh, meshed in one pass in the context of the first slab
+	MeshBuildLodSection collision_section;
+
+	MeshHandlerScratch collision_scratch[7];
+
+	SurfaceNetsScratch nets_scratch[LOD_ARRAY_SIZE];
+
+	SurfaceNetsScratch nets_collision_scratch;
+
+	// vertex cache pass of every LOD, in the context of the first slab
+	VertexCacheScratch cache_scratch[LOD_ARRAY_SIZE];
+};
+
+// contexts kept for reuse, there is one in use per slab being meshed
+#define VOXEL_MESH_CONTEXT_POOL_SIZE 16
+
+// Edit and loader threads are short lived, so contexts are kept in a shared pool
+// rather than per thread. A zone takes the lock twice.
+class VoxelMeshContextPool {
+
+private:
+	std::mutex mutex;
+	std::vector<VoxelMeshContext*> free_list;
+
+public:
+	~VoxelMeshContextPool() {
+		for (VoxelMeshContext* context : free_list) {
+			delete context;
+		}
+	}
+
+	VoxelMeshContext* take() {
+		VoxelMeshContext* context = NULL;
+
+		mutex.lock();
+		if (!free_list.empty()) {
+			context = free_list.back();
+			free_list.pop_back();
+		}
+		mutex.unlock();
+
+		return (context != NULL) ? context : new VoxelMeshContext();
+	}
+
+	void give(VoxelMeshContext* context) {
+		mutex.lock();
+		if (free_list.size() < VOXEL_MESH_CONTEXT_POOL_SIZE) {
+			free_list.push_back(context);
+			context = NULL;
+		}
+		mutex.unlock();
+
+		delete context;
+	}
+};
+
+static VoxelMeshContextPool mesh_context_pool;
+
+// like FProcMeshSection::Reset but buffers keep their memory
+static FORCEINLINE void resetMeshSection(FProcMeshSection& section) {
+	section.ProcVertexBuffer.Reset();
+	section.ProcIndexBuffer.Reset();
+	section.SectionLocalBox.Init();
+	section.bEnableCollision = false;
+	section.bSectionVisible = true;
+}
+
+static FORCEINLINE void resetMeshLodSection(MeshBuildLodSection& lod_section) {
+	resetMeshSection(lod_section.mainMesh);
+
+	for (FProcMeshSection& section : lod_section.transitionMeshArray) {
+		resetMeshSection(section);
+	}
+
+	lod_section.DebugPointList.Reset();
+}
+
+class VoxelMeshExtractor {
+
+private:
+
+	MeshBuildLodSection &mesh_data;
+	const VoxelData &voxel_data;
+	const VoxelDataParam voxel_data_param;
+
+	typedef struct PointAddr {
+		uint8 x = 0;
+		uint8 y = 0;
+		uint8 z = 0;
+
+		PointAddr(const uint8 x0, const uint8 y0, const uint8 z0) : x(x0), y(y0), z(z0) { }
+		PointAddr() { }
+
+
+		FORCEINLINE const PointAddr operator-(const PointAddr& rv) const {
+			return PointAddr(x - rv.x, y - rv.y, z - rv.z);
+		}
+
+		FORCEINLINE const PointAddr operator+(const PointAddr& rv) const {
+			return PointAddr(x + rv.x, y + rv.y, z + rv.z);
+		}
+
+		FORCEINLINE const PointAddr operator/(int val) const {
+			return PointAddr(x / val, y / val, z / val);
+		}
+
+		FORCEINLINE void operator = (const PointAddr &a) {
+			x = a.x;
+			y = a.y;
+			z = a.z;
+		}
+
+	} PointAddr;
+
+
+	struct Point {
+		PointAddr adr;
+		FVector pos;
+		float density;
+		int material_id;
+	};
+
+	struct TmpPoint {
+		FVector v;
+		int mat_id;
+		float mat_weight = 0;
+
+		// normal from the density gradient, used instead of averaged triangle normals
+		bool has_normal = false;
+		FVector n;
+	};
+
+	// vertex of a cell on the voxel edge a - b, index is -1 until it is in the mesh
+	struct EdgeVertex {
+		PointAddr a;
+		PointAddr b;
+		int index = -1;
+		TmpPoint point;
+	};
+
+	class MeshHandler {
+
+	private:
+		FProcMeshSection* meshSection;
+		VoxelMeshExtractor* extractor;
+
+		int ntriang = 0;
+		int vertex_index = 0;
+
+		// Vertex reuse by voxel edge. Regular cell edges are kept in two decks by the x slice of their
+		// lower corner (Transvoxel reuse), so cells visited in x order find the edges of the previous slice.
+		// Transition cell edges have half step end points and are kept in a map.
+		bool position_map;
+		int deck_step = 1;
+		int deck_num = 0;
+		int deck_stamp = 0;
+
+		// x of the planes shared with the previous and the next slab or -1
+		int border_low = -1;
+		int border_high = -1;
+		MeshHandlerScratch* scratch;
+
+		// the tables live in the mesh context, so they keep their memory between zones
+		std::vector<EdgeDeckEntry>* edge_deck;
+		TMap<uint64, int>* EdgeVertexMap;
+		TMap<FVector, int>* VertexMap;
+
+		FORCEINLINE EdgeDeckEntry* getDeckEntry(const PointAddr& a, const PointAddr& b) {
+			if (a.x != b.x ? (a.x | b.x) % deck_step : (a.y | a.z | b.y | b.z) % deck_step) {
+				return NULL;
+			}
+
+			const int x = FMath::Min(a.x, b.x) / deck_step;
+			const int y = FMath::Min(a.y, b.y) / deck_step;
+			const int z = FMath::Min(a.z, b.z) / deck_step;
+			const int axis = (a.x != b.x) ? 0 : (a.y != b.y) ? 1 : 2;
+
+			return &edge_deck[x & 1][(y * deck_num + z) * 3 + axis];
+		}
+
+		static FORCEINLINE uint64 clcEdgeKey(const PointAddr& a, const PointAddr& b) {
+			const uint64 ka = (a.x << 16) | (a.y << 8) | a.z;
+			const uint64 kb = (b.x << 16) | (b.y << 8) | b.z;
+			return (ka < kb) ? (ka << 24) | kb : (kb << 24) | ka;
+		}
+
+	public:
+		void init(VoxelMeshExtractor* e, FProcMeshSection* s, MeshHandlerScratch* h, bool transition, int low, int high) {
+			extractor = e;
+			meshSection = s;
+			scratch = h;
+			edge_deck = h->edge_deck;
+			EdgeVertexMap = &h->edge_vertex_map;
+			VertexMap = &h->vertex_map;
+
+			EdgeVertexMap->Reset();
+			VertexMap->Reset();
+			h->low_border.clear();
+			h->high_border.Reset();
+			h->average_count.clear();
+			h->gradient_normal.clear();
+
+			border_low = low;
+			border_high = high;
+
+			position_map = e->voxel_data_param.bPositionVertexMap;
+
+			if (!transition && !position_map) {
+				deck_step = e->voxel_data_param.step();
+				deck_num = (e->voxel_data.num() - 1) / deck_step + 1;
+
+				const size_t deck_size = deck_num * deck_num * 3;
+				if (edge_deck[0].size() != deck_size || ++h->edge_deck_use >= EDGE_DECK_MAX_USE) {
+					for (auto i = 0; i < 2; i++) {
+						edge_deck[i].assign(deck_size, EdgeDeckEntry());
+					}
+
+					h->edge_deck_use = 1;
+				}
+
+				deck_stamp = h->edge_deck_use << 8;
+			}
+		}
+
+		// index of the vertex already made on the edge or -1
+		FORCEINLINE int findEdgeVertex(const PointAddr& a, const PointAddr& b) {
+			if (position_map) {
+				return -1;
+			}
+
+			if (deck_num > 0) {
+				EdgeDeckEntry* entry = getDeckEntry(a, b);
+				if (entry != NULL) {
+					return (entry->stamp == (deck_stamp | (FMath::Min(a.x, b.x) / deck_step))) ? entry->index : -1;
+				}
+			}
+
+			const int* index = EdgeVertexMap->Find(clcEdgeKey(a, b));
+			return (index != NULL) ? *index : -1;
+		}
+
+		FORCEINLINE void setEdgeVertex(const PointAddr& a, const PointAddr& b, int index) {
+			if (deck_num > 0) {
+				EdgeDeckEntry* entry = getDeckEntry(a, b);
+				if (entry != NULL) {
+					entry->stamp = deck_stamp | (FMath::Min(a.x, b.x) / deck_step);
+					entry->index = index;
+					return;
+				}
+			}
+
+			EdgeVertexMap->Add(clcEdgeKey(a, b), index);
+		}
+
+		FORCEINLINE const FVector& getVertexPosition(int index) const {
+			return meshSection->ProcVertexBuffer[index].Position;
+		}
+
+		// the edge gradient can be zero, then the vertex was made with the triangle normal
+		FORCEINLINE bool hasVertexNormal(int index) const {
+			return scratch->gradient_normal[index];
+		}
+
+		FORCEINLINE void addVertexTest(TmpPoint &point, FVector n, int &index) {
+			FVector v = point.v;
+
+			meshSection->ProcIndexBuffer.Add(index);
+
+			int t = point.mat_weight * 255;
+
+			FProcMeshVertex Vertex;
+			Vertex.Position = v;
+			Vertex.Normal = n;
+			Vertex.UV0 = FVector2D(0.f, 0.f);
+			Vertex.Color = FColor(t, 0, 0, 0);
+			Vertex.Tangent = FProcMeshTangent();
+
+			meshSection->SectionLocalBox += Vertex.Position;
+			meshSection->ProcVertexBuffer.Add(Vertex);
+
+			vertex_index++;
+		}
+
+		FORCEINLINE void addVertex(const TmpPoint &point, const FVector& n, int &index) {
+			FVector v = point.v;
+
+			const int* vindex_ptr = VertexMap->Find(v);
+			if (vindex_ptr != NULL) {
+				int vindex = *vindex_ptr;
+
+				FProcMeshVertex& Vertex = meshSection->ProcVertexBuffer[vindex];
+
+				if (!point.has_normal) {
+					FVector nvert = Vertex.Normal;
+
+					FVector tmp(nvert);
+					tmp += n;
+					tmp /= 2;
+
+					Vertex.Normal = tmp;
+				}
+
+				meshSection->ProcIndexBuffer.Add(vindex);
+
+			} else {
+				meshSection->ProcIndexBuffer.Add(index);
+
+				int t = point.mat_weight * 255;
+
+				FProcMeshVertex Vertex;
+				Vertex.Position = v;
+				Vertex.Normal = point.has_normal ? point.n : n;
+				Vertex.UV0 = FVector2D(0.f, 0.f);
+				Vertex.Color = FColor(t, 0, 0, 0);
+				Vertex.Tangent = FProcMeshTangent();
+
+				meshSection->SectionLocalBox += Vertex.Position;
+
+				meshSection->ProcVertexBuffer.Add(Vertex);
+
+				VertexMap->Add(v, index);
+				vertex_index++;
+			}
+		}
+
+		FORCEINLINE void addTriangle(TmpPoint &tmp1, TmpPoint &tmp2, TmpPoint &tmp3) {
+			const FVector n = -clcNormal(tmp1.v, tmp2.v, tmp3.v);
+
+			addVertex(tmp1, n, vertex_index);
+			addVertex(tmp2, n, vertex_index);
+			addVertex(tmp3, n, vertex_index);
+
+			ntriang++;
+		}
+
+		FORCEINLINE void addEdgeVertex(EdgeVertex& ev, const FVector& n) {
+			if (position_map) {
+				addVertex(ev.point, n, vertex_index);
+				return;
+			}
+
+			if (ev.index >= 0) {
+				FProcMeshVertex& Vertex = meshSection->ProcVertexBuffer[ev.index];
+
+				if (!ev.point.has_normal) {
+					FVector tmp(Vertex.Normal);
+					tmp += n;
+					tmp /= 2;
+
+					Vertex.Normal = tmp;
+
+					if (border_low >= 0) {
+						scratch->average_count[ev.index]++;
+					}
+				}
+
+				meshSection->ProcIndexBuffer.Add(ev.index);
+				return;
+			}
+
+			ev.index = vertex_index;
+			meshSection->ProcIndexBuffer.Add(ev.index);
+
+			int t = ev.point.mat_weight * 255;
+
+			FProcMeshVertex Vertex;
+			Vertex.Position = ev.point.v;
+			Vertex.Normal = ev.point.has_normal ? ev.point.n : n;
+			Vertex.UV0 = FVector2D(0.f, 0.f);
+			Vertex.Color = FColor(t, 0, 0, 0);
+			Vertex.Tangent = FProcMeshTangent();
+
+			meshSection->SectionLocalBox += Vertex.Position;
+			meshSection->ProcVertexBuffer.Add(Vertex);
+
+			setEdgeVertex(ev.a, ev.b, ev.index);
+			scratch->gradient_normal.push_back(ev.point.has_normal);
+
+			if (border_low >= 0) {
+				scratch->average_count.push_back(0);
+			}
+
+			if (ev.a.x == ev.b.x) {
+				if (ev.a.x == border_low) {
+					SlabBorderVertex border;
+					border.key = clcEdgeKey(ev.a, ev.b);
+					border.index = ev.index;
+					border.normal = Vertex.Normal;
+					border.has_normal = ev.point.has_normal;
+					scratch->low_border.push_back(border);
+				} else if (ev.a.x == border_high) {
+					scratch->high_border.Add(clcEdgeKey(ev.a, ev.b), ev.index);
+				}
+			}
+
+			vertex_index++;
+		}
+
+		// triangle of cell edge vertices, vertices made by previous cells on the same edges are reused
+		FORCEINLINE void addTriangle(EdgeVertex& ev1, EdgeVertex& ev2, EdgeVertex& ev3) {
+			const FVector n = -clcNormal(ev1.point.v, ev2.point.v, ev3.point.v);
+
+			addEdgeVertex(ev1, n);
+			addEdgeVertex(ev2, n);
+			addEdgeVertex(ev3, n);
+
+			ntriang++;
+		}
+
+	};
+
+
+	MeshHandler handlerArray[7];
+	MeshHandler* mainMeshHandler;
+	MeshHandler* transitionHandlerArray[6];
+
+public:
+	// scratch holds the tables of the main mesh and the 6 transition sections,
+	// border_low and border_high are x of the planes shared with the previous and the next slab or -1
+	VoxelMeshExtractor(MeshBuildLodSection &a, const VoxelData &b, const VoxelDataParam c, MeshHandlerScratch* scratch, int border_low, int border_high) : mesh_data(a), voxel_data(b), voxel_data_param(c) {
+		mainMeshHandler = &handlerArray[0];
+		mainMeshHandler->init(this, &a.mainMesh, &scratch[0], false, border_low, border_high);
+		border_normals = voxel_data.hasApron() && !voxel_data_param.z_cut;
+		gradient_normals = voxel_data_param.bGradientNormals && !voxel_data_param.z_cut;
+
+		if (voxel_data_param.bGenerateLOD) {
+			transition_mask = voxel_data_param.transitionFaceMask(voxel_data_param.lod);
+		}
+
+		const int n = voxel_data.num() - 1;
+		zone_lower = voxel_data.voxelIndexToVector(0, 0, 0);
+		zone_upper = voxel_data.voxelIndexToVector(n, n, n);
+		cell_size = voxel_data.voxelIndexToVector(voxel_data_param.step(), 0, 0).X - zone_lower.X;
+
+		for (auto i = 0; i < 6; i++) {
+			transitionHandlerArray[i] = &handlerArray[i + 1];
+			transitionHandlerArray[i]->init(this, &a.transitionMeshArray[i], &scratch[i + 1], true, border_low, border_high);
+		}
+	}
+    
 private:
+	double isolevel = 0.5f;
 
-	MeshLodSection &mesh_data;
-	const VoxelData &voxel_data;
-	const VoxelDataParam voxel_data_param;
+	// vertices on zone faces get gradient normals from the apron, the same as in the neighbour zone
+	bool border_normals = false;
+
+	// every vertex gets the gradient normal, no triangle normals are averaged
+	bool gradient_normals = false;
+
+	// faces with transition cells, bit f for section f
+	int transition_mask = 0;
+
+	// zone faces and the cell width of the lod, to shrink regular cells next to transition cells
+	FVector zone_lower;
+	FVector zone_upper;
+	float cell_size = 0;
+
+	FORCEINLINE Point getVoxelpoint(PointAddr adr) {
+		return getVoxelpoint(adr.x, adr.y, adr.z, voxel_data_param.lod);
+	}
+
+	FORCEINLINE Point getVoxelpoint(uint8 x, uint8 y, uint8 z) {
+		return getVoxelpoint(x, y, z, voxel_data_param.lod);
+	}
+
+	FORCEINLINE Point getVoxelpoint(PointAddr adr, int lod) {
+		return getVoxelpoint(adr.x, adr.y, adr.z, lod);
+	}
+
+	FORCEINLINE Point getVoxelpoint(uint8 x, uint8 y, uint8 z, int lod) {
+		Point vp;
+		vp.adr = PointAddr(x,y,z);
+		vp.density = getDensity(x, y, z, lod);
+		vp.material_id = getMaterial(x, y, z, lod);
+		vp.pos = voxel_data.voxelIndexToVector(x, y, z);
+		return vp;
+	}
+
+	FORCEINLINE float getDensity(int x, int y, int z) {
+		return getDensity(x, y, z, voxel_data_param.lod);
+	}
+
+	FORCEINLINE float getDensity(int x, int y, int z, int lod) {
+		int step = voxel_data_param.step();
+		if (voxel_data_param.z_cut) {
+			FVector p = voxel_data.voxelIndexToVector(x, y, z);
+			p += voxel_data.getOrigin();
+			if (p.Z > voxel_data_param.z_cut_level) {
+				return 0;
+			}
+		}
+
+		return voxel_data.getDensityLOD(x, y, z, lod);
+	}
+
+	FORCEINLINE int getMaterial(int x, int y, int z) {
+		return getMaterial(x, y, z, voxel_data_param.lod);
+	}
+
+	FORCEINLINE int getMaterial(int x, int y, int z, int lod) {
+		return voxel_data.getMaterialLOD(x, y, z, lod);
+	}
+
+	FORCEINLINE FVector vertexInterpolation(FVector p1, FVector p2, float valp1, float valp2) {
+		if (std::abs(isolevel - valp1) < 0.00001) {
+			return p1;
+		}
+
+		if (std::abs(isolevel - valp2) < 0.00001) {
+			return p2;
+		}
+
+		if (std::abs(valp1 - valp2) < 0.00001) {
+			return p1;
+		}
+
+		if (valp1 == valp2) {
+			return p1;
+		}
+
+		float mu = (isolevel - valp1) / (valp2 - valp1);
+
+		FVector tmp;
+		tmp.X = p1.X + mu * (p2.X - p1.X);
+		tmp.Y = p1.Y + mu * (p2.Y - p1.Y);
+		tmp.Z = p1.Z + mu * (p2.Z - p1.Z);
+
+		return tmp;
+	}
+
+	FORCEINLINE void materialCalculation(struct TmpPoint& tp, Point point1, Point point2) {
+		static const int base_mat = 1; // dirt is base material
+
+		FVector p1 = point1.pos;
+		FVector p2 = point2.pos;
+		const int mat1 = point1.material_id;
+		const int mat2 = point2.material_id;
+		
+		if ((base_mat == mat1)&&(base_mat == mat2)) {
+			tp.mat_id = base_mat;
+			tp.mat_weight = 0;
+			return;
+		}
+
+		if (mat1 == mat2) {
+			tp.mat_id = base_mat;
+			tp.mat_weight = 1;
+			return;
+		}
+
+		FVector tmp(p1);
+		tmp -= p2;
+		float s = tmp.Size();
+
+		p1 -= tp.v;
+		p2 -= tp.v;
+
+		float s1 = p1.Size();
+		float s2 = p2.Size();
+
+		if (mat1 != base_mat) {
+			tp.mat_weight = s1 / s;
+			return;
+		}
+
+		if (mat2 != base_mat) {
+			tp.mat_weight = s2 / s;
+			return;
+		}
+	}
+
+	FORCEINLINE void materialCalculation2(struct TmpPoint& tp, Point point1, Point point2) {
+		static const int base_mat = 1; // dirt
+
+		float mu = (isolevel - point1.density) / (point2.density - point1.density);
+
+		PointAddr tmp;
+		tmp.x = point1.adr.x + mu * (point2.adr.x - point1.adr.x);
+		tmp.y = point1.adr.y + mu * (point2.adr.y - point1.adr.y);
+		tmp.z = point1.adr.z + mu * (point2.adr.z - point1.adr.z);
+
+		tp.mat_id = getMaterial(tmp.x, tmp.y, tmp.z);
+
+		if (base_mat == tp.mat_id) {
+			tp.mat_weight = 0;
+		} else {
+			tp.mat_weight = 1;
+		}
+	}
+
+	FORCEINLINE FVector clcGradient(const PointAddr& adr) {
+		const int x = adr.x;
+		const int y = adr.y;
+		const int z = adr.z;
+		const int e = voxel_data.num() - 1;
+
+		// inner voxels have all neighbours in the bricks
+		if (x > 0 && y > 0 && z > 0 && x < e && y < e && z < e) {
+			return FVector(
+				voxel_data.getRawDensity(x + 1, y, z) - voxel_data.getRawDensity(x - 1, y, z),
+				voxel_data.getRawDensity(x, y + 1, z) - voxel_data.getRawDensity(x, y - 1, z),
+				voxel_data.getRawDensity(x, y, z + 1) - voxel_data.getRawDensity(x, y, z - 1));
+		}
+
+		return FVector(
+			voxel_data.getRawDensityExt(x + 1, y, z) - voxel_data.getRawDensityExt(x - 1, y, z),
+			voxel_data.getRawDensityExt(x, y + 1, z) - voxel_data.getRawDensityExt(x, y - 1, z),
+			voxel_data.getRawDensityExt(x, y, z + 1) - voxel_data.getRawDensityExt(x, y, z - 1));
+	}
+
+	FORCEINLINE bool isBorderEdge(const Point& point1, const Point& point2) {
+		const int e = voxel_data.num() - 1;
+		const PointAddr& a = point1.adr;
+		const PointAddr& b = point2.adr;
+
+		return (a.x == b.x && (a.x == 0 || a.x == e)) || (a.y == b.y && (a.y == 0 || a.y == e)) || (a.z == b.z && (a.z == 0 || a.z == e));
+	}
+
+	FORCEINLINE bool hasGradientNormal(const Point& point1, const Point& point2) {
+		return gradient_normals || (border_normals && isBorderEdge(point1, point2));
+	}
+
+	// density gradient at the surface point of the edge
+	FORCEINLINE FVector clcEdgeGradient(const Point& point1, const Point& point2) {
+		float mu = 0;
+		if (std::abs(point2.density - point1.density) > 0.00001) {
+			mu = FMath::Clamp((float)((isolevel - point1.density) / (point2.density - point1.density)), 0.0f, 1.0f);
+		}
+
+		return clcGradient(point1.adr) * (1 - mu) + clcGradient(point2.adr) * mu;
+	}
+
+	// Regular cells next to a face with transition cells are shrunk by half a cell, which the transition cells fill.
+	// A vertex moves inward by the inset scaled down to 0 at the far side of its cell, along the surface so the
+	// shape is kept (Lengyel, Transvoxel, 4.4). The back face vertices of the transition cells move the same way.
+	FORCEINLINE void shrinkBoundaryVertex(TmpPoint& point, const Point& point1, const Point& point2) {
+		const float inset = cell_size * 0.5f;
+		FVector delta(0, 0, 0);
+		bool shrink = false;
+
+		for (auto axis = 0; axis < 3; axis++) {
+			if (transition_mask & (1 << (axis * 2))) {
+				const float t = (point.v[axis] - zone_lower[axis]) / cell_size;
+				if (t < 1) {
+					delta[axis] += (1 - t) * inset;
+					shrink = true;
+				}
+			}
+
+			if (transition_mask & (2 << (axis * 2))) {
+				const float t = (zone_upper[axis] - point.v[axis]) / cell_size;
+				if (t < 1) {
+					delta[axis] -= (1 - t) * inset;
+					shrink = true;
+				}
+			}
+		}
+
+		if (!shrink) {
+			return;
+		}
+
+		const FVector g = clcEdgeGradient(point1, point2);
+		if (g.SizeSquared() > 0) {
+			const FVector n = g.GetSafeNormal();
+			delta -= n * (n | delta);
+		}
+
+		// a vertex on a face without transition cells stays on it, the neighbour zone has the same vertex
+		for (auto axis = 0; axis < 3; axis++) {
+			if ((!(transition_mask & (1 << (axis * 2))) && point.v[axis] <= zone_lower[axis])
+				|| (!(transition_mask & (2 << (axis * 2))) && point.v[axis] >= zone_upper[axis])) {
+				delta[axis] = 0;
+			}
+		}
+
+		point.v += delta;
+	}
+
+	FORCEINLINE TmpPoint vertexClc(Point& point1, Point& point2) {
+		struct TmpPoint ret;
+
+		ret.v = vertexInterpolation(point1.pos, point2.pos, point1.density, point2.density);
+
+		// gradient is taken at full resolution on every lod, so the shading does not change with the lod
+		if (hasGradientNormal(point1, point2)) {
+			// density grows into the solid, the normal points out of it
+			FVector g = clcEdgeGradient(point1, point2);
+			if (g.SizeSquared() > 0) {
+				ret.n = -g.GetSafeNormal();
+				ret.has_normal = true;
+			}
+		}
+
+		if (voxel_data_param.lod == 0) {
+			materialCalculation(ret, point1, point2);
+		} else {
+			materialCalculation2(ret, point1, point2);
+		}
+		return ret;
+	}
+
+	FORCEINLINE void getConrers(int8 (&corner)[8], Point (&d)[8]) {
+		for (auto i = 0; i < 8; i++) {
+			corner[i] = (d[i].density < isolevel) ? 0 : -127;
+		}
+	}
+
+	FORCEINLINE PointAddr clcMediumAddr(const PointAddr& adr1, const PointAddr& adr2) {
+		uint8 x = (adr2.x - adr1.x) / 2 + adr1.x;
+		uint8 y = (adr2.y - adr1.y) / 2 + adr1.y;
+		uint8 z = (adr2.z - adr1.z) / 2 + adr1.z;
+
+		return PointAddr(x, y, z);
+	}
+
+	FORCEINLINE void extractRegularCell(Point (&d)[8]) {
+		int8 corner[8];
+		for (auto i = 0; i < 8; i++) {
+			corner[i] = (d[i].density < isolevel) ? -127 : 0;
+		}
+
+		unsigned long caseCode = ((corner[0] >> 7) & 0x01)
+			| ((corner[1] >> 6) & 0x02)
+			| ((corner[2] >> 5) & 0x04)
+			| ((corner[3] >> 4) & 0x08)
+			| ((corner[4] >> 3) & 0x10)
+			| ((corner[5] >> 2) & 0x20)
+			| ((corner[6] >> 1) & 0x40)
+			| (corner[7] & 0x80);
+
+		if (caseCode == 0) {
+			return;
+		}
+
+		unsigned int c = regularCellClass[caseCode];
+		RegularCellData cd = regularCellData[c];
+		EdgeVertex vertexList[12];
+
+		for (int i = 0; i < cd.GetVertexCount(); i++) {
+			const int edgeCode = regularVertexData[caseCode][i];
+			const unsigned short v0 = (edgeCode >> 4) & 0x0F;
+			const unsigned short v1 = edgeCode & 0x0F;
+			makeEdgeVertex(mainMeshHandler, vertexList[i], d[v0], d[v1], transition_mask != 0);
+		}
+
+		for (int i = 0; i < cd.GetTriangleCount() * 3; i += 3) {
+			mainMeshHandler->addTriangle(vertexList[cd.vertexIndex[i]], vertexList[cd.vertexIndex[i + 1]], vertexList[cd.vertexIndex[i + 2]]);
+		}
+	}
+
+	// reuse the vertex of the edge if there is one, otherwise calculate it
+	FORCEINLINE void makeEdgeVertex(MeshHandler* meshHandler, EdgeVertex& ev, Point& point1, Point& point2, bool shrink) {
+		ev.a = point1.adr;
+		ev.b = point2.adr;
+		ev.index = meshHandler->findEdgeVertex(ev.a, ev.b);
+
+		if (ev.index >= 0) {
+			ev.point.v = meshHandler->getVertexPosition(ev.index);
+			ev.point.has_normal = meshHandler->hasVertexNormal(ev.index);
+		} else {
+			ev.point = vertexClc(point1, point2);
+
+			if (shrink) {
+				shrinkBoundaryVertex(ev.point, point1, point2);
+			}
+		}
+	}
+
+	FORCEINLINE void extractTransitionCell(int sectionNumber, Point& d0, Point& d2, Point& d6, Point& d8) {
+		Point d[14];
+
+		// The face is sampled like the finer neighbour does it, at lod - 1. With density mips the
+		// corners of the lod differ from that level. The back face keeps the corners of the lod.
+		const int face_lod = voxel_data_param.lod - 1;
+
+		d[0] = getVoxelpoint(d0.adr, face_lod);
+		d[1] = getVoxelpoint(clcMediumAddr(d2.adr, d0.adr), face_lod);
+		d[2] = getVoxelpoint(d2.adr, face_lod);
+
+		PointAddr a3 = clcMediumAddr(d6.adr, d0.adr);
+		PointAddr a5 = clcMediumAddr(d8.adr, d2.adr);
+
+		d[3] = getVoxelpoint(a3, face_lod);
+		d[4] = getVoxelpoint(clcMediumAddr(a5, a3), face_lod);
+		d[5] = getVoxelpoint(a5, face_lod);
 
-	typedef struct PointAddr {
-		uint8 x = 0;
-		uint8 y = 0;
-		uint8 z = 0;
+		d[6] = getVoxelpoint(d6.adr, face_lod);
+		d[7] = getVoxelpoint(clcMediumAddr(d8.adr, d6.adr), face_lod);
+		d[8] = getVoxelpoint(d8.adr, face_lod);
 
-		PointAddr(const uint8 x0, const uint8 y0, const uint8 z0) : x(x0), y(y0), z(z0) { }
-		PointAddr() { }
+		d[9] = d0;
+		d[0xa] = d2;
+		d[0xb] = d6;
+		d[0xc] = d8;
 
 
-		FORCEINLINE const PointAddr operator-(const PointAddr& rv) const {
-			return PointAddr(x - rv.x, y - rv.y, z - rv.z);
+		for (auto i = 0; i < 9; i++) {
+			//mesh_data.DebugPointList.Add(d[i].pos);
 		}
 
-		FORCEINLINE const PointAddr operator+(const PointAddr& rv) const {
-			return PointAddr(x + rv.x, y + rv.y, z + rv.z);
+		int8 corner[9];
+		for (auto i = 0; i < 9; i++) {
+			corner[i] = (d[i].density < isolevel) ? -127 : 0;
 		}
 
-		FORCEINLINE const PointAddr operator/(int val) const {
-			return PointAddr(x / val, y / val, z / val);
+		static const int caseCodeCoeffs[9] = { 0x01, 0x02, 0x04, 0x80, 0x100, 0x08, 0x40, 0x20, 0x10 };
+		static const int charByteSz = sizeof(int8) * 8;
+
+		unsigned long caseCode = 0;
+		for (auto ci = 0; ci < 9; ++ci) {
+			// add the coefficient only if the value is negative
+			caseCode += ((corner[ci] >> (charByteSz - 1)) & 1) * caseCodeCoeffs[ci];
 		}
 
-		FORCEINLINE void operator = (const PointAddr &a) {
-			x = a.x;
-			y = a.y;
-			z = a.z;
+		if (caseCode == 0) {
+			return;
 		}
 
-	} PointAddr;
+		unsigned int classIndex = transitionCellClass[caseCode];
 
+		const bool inverse = (classIndex & 128) != 0;
 
-	struct Point {
-		PointAddr adr;
-		FVector pos;
-		float density;
-		int material_id;
-	};
+		TransitionCellData cellData = transitionCellData[classIndex & 0x7F];
 
-	struct TmpPoint {
-		FVector v;
-		int mat_id;
-		float mat_weight = 0;
-	};
+		MeshHandler* meshHandler = transitionHandlerArray[sectionNumber];
+		EdgeVertex vertexList[12];
 
-	class MeshHandler {
+		for (int i = 0; i < cellData.GetVertexCount(); i++) {
+			const int edgeCode = transitionVertexData[caseCode][i];
+			const unsigned short v0 = (edgeCode >> 4) & 0x0F;
+			const unsigned short v1 = edgeCode & 0x0F;
 
-	private:
-		FProcMeshSection* meshSection;
-		VoxelMeshExtractor* extractor;
+			// corners 9 - c are the coarse face again, their vertices are on the inset back face
+			makeEdgeVertex(meshHandler, vertexList[i], d[v0], d[v1], v0 >= 9 && v1 >= 9);
 
-		int ntriang = 0;
-		int vertex_index = 0;
+			mesh_data.DebugPointList.Add(vertexList[i].point.v);
+		}
 
-		TMap<FVector, int> VertexMap;
+		for (int i = 0; i < cellData.GetTriangleCount() * 3; i += 3) {
+			EdgeVertex& ev1 = vertexList[cellData.vertexIndex[i]];
+			EdgeVertex& ev2 = vertexList[cellData.vertexIndex[i + 1]];
+			EdgeVertex& ev3 = vertexList[cellData.vertexIndex[i + 2]];
 
-	public:
-		MeshHandler(VoxelMeshExtractor* e, FProcMeshSection* s) : extractor(e), meshSection(s) { }
+			if (inverse) {
+				meshHandler->addTriangle(ev3, ev2, ev1);
+			} else {
+				meshHandler->addTriangle(ev1, ev2, ev3);
+			}
+			
+		}
+	}
 
-		FORCEINLINE void addVertexTest(TmpPoint &point, FVector n, int &index) {
-			FVector v = point.v;
+public:
+	// cell on a zone face that gets a transition cell even if its regular cell is empty
+	FORCEINLINE bool hasTransitionCell(int x, int y, int z) const {
+		if (transition_mask == 0) {
+			return false;
+		}
 
-			meshSection->ProcIndexBuffer.Add(index);
+		const int e = voxel_data.num() - voxel_data_param.step() - 1;
+		return ((transition_mask & 0x01) && x == 0) || ((transition_mask & 0x02) && x == e)
+			|| ((transition_mask & 0x04) && y == 0) || ((transition_mask & 0x08) && y == e)
+			|| ((transition_mask & 0x10) && z == 0) || ((transition_mask & 0x20) && z == e);
+	}
 
-			int t = point.mat_weight * 255;
+	// Cell with a transition cell but without surface at the corners of the lod, so it is not in the substance cache.
+	// Its transition faces are sampled at lod - 1 and can still cross the isolevel.
+	FORCEINLINE bool isTransitionOnlyCell(int x, int y, int z) const {
+		if (!hasTransitionCell(x, y, z)) {
+			return false;
+		}
 
-			FProcMeshVertex Vertex;
-			Vertex.Position = v;
-			Vertex.Normal = n;
-			Vertex.UV0 = FVector2D(0.f, 0.f);
-			Vertex.Color = FColor(t, 0, 0, 0);
-			Vertex.Tangent = FProcMeshTangent();
+		const int lod = voxel_data_param.lod;
+		const int step = voxel_data_param.step();
+		const int half = step / 2;
+		const bool below = voxel_data.getRawDensityLOD(x, y, z, lod) <= VOXEL_ISOLEVEL_RAW;
 
-			meshSection->SectionLocalBox += Vertex.Position;
-			meshSection->ProcVertexBuffer.Add(Vertex);
+		// same test as the case code of the cache
+		for (auto i = 0; i < 8; i++) {
+			const int cx = x + ((i & 1) ? step : 0);
+			const int cy = y + ((i & 2) ? step : 0);
+			const int cz = z + ((i & 4) ? step : 0);
+			if ((voxel_data.getRawDensityLOD(cx, cy, cz, lod) <= VOXEL_ISOLEVEL_RAW) != below) {
+				return false;
+			}
+		}
 
-			vertex_index++;
+		for (auto i = 0; i <= step; i += half) {
+			for (auto j = 0; j <= step; j += half) {
+				for (auto k = 0; k <= step; k += half) {
+					if ((voxel_data.getRawDensityLOD(x + i, y + j, z + k, lod - 1) <= VOXEL_ISOLEVEL_RAW) != below) {
+						return true;
+					}
+				}
+			}
 		}
 
-		FORCEINLINE void addVertex(const TmpPoint &point, const FVector& n, int &index) {
-			FVector v = point.v;
+		return false;
+	}
+
+	FORCEINLINE void generateCell(int x, int y, int z) {
+		Point d[8];
 
-			if (VertexMap.Contains(v)) {
-				int vindex = VertexMap[v];
+		int step = voxel_data_param.step();
 
-				FProcMeshVertex& Vertex = meshSection->ProcVertexBuffer[vindex];
-				FVector nvert = Vertex.Normal;
+        d[0] = getVoxelpoint(x, y + step, z);
+        d[1] = getVoxelpoint(x, y, z);
+        d[2] = getVoxelpoint(x + step, y + step, z);
+        d[3] = getVoxelpoint(x + step, y, z);
+        d[4] = getVoxelpoint(x, y + step, z + step);
+        d[5] = getVoxelpoint(x, y, z + step);
+        d[6] = getVoxelpoint(x + step, y + step, z + step);
+        d[7] = getVoxelpoint(x + step, y, z + step);
+		
+		extractRegularCell(d);
 
-				FVector tmp(nvert);
-				tmp += n;
-				tmp /= 2;
+		// only faces next to a finer zone get transition cells
+		if (transition_mask != 0) {
+			const int e = voxel_data.num() - step - 1;
 
-				Vertex.Normal = tmp;
-				meshSection->ProcIndexBuffer.Add(vindex);
+			if ((transition_mask & 0x01) && x == 0) extractTransitionCell(0, d[1], d[0], d[5], d[4]); // X+
+			if ((transition_mask & 0x02) && x == e) extractTransitionCell(1, d[2], d[3], d[6], d[7]); // X-
+			if ((transition_mask & 0x04) && y == 0) extractTransitionCell(2, d[3], d[1], d[7], d[5]); // Y-
+			if ((transition_mask & 0x08) && y == e) extractTransitionCell(3, d[0], d[2], d[4], d[6]); // Y+
+			if ((transition_mask & 0x10) && z == 0) extractTransitionCell(4, d[3], d[2], d[1], d[0]); // Z-
+			if ((transition_mask & 0x20) && z == e) extractTransitionCell(5, d[6], d[7], d[4], d[5]); // Z+
+		}
 
-			} else {
-				meshSection->ProcIndexBuffer.Add(index);
+    }
 
-				int t = point.mat_weight * 255;
+};
 
-				FProcMeshVertex Vertex;
-				Vertex.Position = v;
-				Vertex.Normal = n;
-				Vertex.UV0 = FVector2D(0.f, 0.f);
-				Vertex.Color = FColor(t, 0, 0, 0);
-				Vertex.Tangent = FProcMeshTangent();
+// Generates the cells of row (x, y) that may have surface. Case codes of the lod are classified in bulk first,
+// so cells without surface are skipped without fetching their corners, unless they have a transition cell.
+static void generateSurfaceCellsInRow(const VoxelData& vd, VoxelMeshExtractor& extractor, int x, int y, int z_end, int stride, int lod) {
+	const int s = 1 << lod;
 
-				meshSection->SectionLocalBox += Vertex.Position;
+	if (stride != s) {
+		forEachSurfaceCellInRow(vd, x, y, 0, z_end, stride, s, [&](int z) {
+			extractor.generateCell(x, y, z);
+		});
 
-				meshSection->ProcVertexBuffer.Add(Vertex);
+		return;
+	}
 
-				VertexMap.Add(v, index);
-				vertex_index++;
+	unsigned char case_code[VOXEL_CELL_ROW_MAX];
+
+	forEachSurfaceRunInRow(vd, x, y, 0, z_end, s, s, [&](int z_begin, int z_run_end) {
+		const int count = (z_run_end - z_begin) / s;
+		vd.clcCellCaseCodeRow(x, y, z_begin, count, lod, case_code);
+
+		for (auto i = 0; i < count; i++) {
+			const int z = z_begin + i * s;
+			if (isSurfaceCaseCode(case_code[i]) || extractor.hasTransitionCell(x, y, z)) {
+				extractor.generateCell(x, y, z);
 			}
 		}
+	});
+}
 
-		FORCEINLINE void addTriangle(TmpPoint &tmp1, TmpPoint &tmp2, TmpPoint &tmp3) {
-			const FVector n = -clcNormal(tmp1.v, tmp2.v, tmp3.v);
+// Cells of the lod from the substance cache with lower corner x in [x_begin, x_end). The list is
+// sorted by linear index, so the cells of the slab are one range of it.
+static void generateCachedCells(const VoxelData& vd, VoxelMeshExtractor& extractor, int lod, int x_begin, int x_end) {
+	const std::vector<uint32>& cellList = vd.substanceCacheLOD[lod].cellList;
+	auto begin = std::lower_bound(cellList.begin(), cellList.end(), (uint32)vd.clcLinearIndex(x_begin, 0, 0));
+	auto end = std::lower_bound(begin, cellList.end(), (uint32)vd.clcLinearIndex(x_end, 0, 0));
+
+	for (auto it = begin; it != end; ++it) {
+		int x, y, z;
+		vd.clcVoxelIndex(*it, x, y, z);
+		extractor.generateCell(x, y, z);
+	}
+}
 
-			addVertex(tmp1, n, vertex_index);
-			addVertex(tmp2, n, vertex_index);
-			addVertex(tmp3, n, vertex_index);
+// Cells of the lod on transition faces that are not in the substance cache, see isTransitionOnlyCell. Only the cell
+// layers of the faces in face_mask are visited, in the order of the linear index, cells on two faces once.
+static void generateTransitionOnlyCells(const VoxelData& vd, VoxelMeshExtractor& extractor, int face_mask, int lod, int x_begin, int x_end) {
+	const int s = 1 << lod;
+	const int e = vd.num() - s - 1;
 
-			ntriang++;
+	auto generateTransitionOnlyCell = [&](int x, int y, int z) {
+		if (extractor.isTransitionOnlyCell(x, y, z)) {
+			extractor.generateCell(x, y, z);
 		}
-
 	};
 
+	for (auto x = x_begin; x < x_end; x += s) {
+		// the x faces are whole layers of the slab
+		if (((face_mask & 0x01) && x == 0) || ((face_mask & 0x02) && x == e)) {
+			for (auto y = 0; y <= e; y += s) {
+				for (auto z = 0; z <= e; z += s) {
+					generateTransitionOnlyCell(x, y, z);
+				}
+			}
 
-	MeshHandler* mainMeshHandler;
-	TArray<MeshHandler*> transitionHandlerArray;
+			continue;
+		}
 
-public:
-	VoxelMeshExtractor(MeshLodSection &a, const VoxelData &b, const VoxelDataParam c) : mesh_data(a), voxel_data(b), voxel_data_param(c) {
-		mainMeshHandler = new MeshHandler(this, &a.mainMesh);
+		// the y faces are rows of the layer, the z faces the first and the last cell of the other rows
+		for (auto y = 0; y <= e; y += s) {
+			if (((face_mask & 0x04) && y == 0) || ((face_mask & 0x08) && y == e)) {
+				for (auto z = 0; z <= e; z += s) {
+					generateTransitionOnlyCell(x, y, z);
+				}
 
-		for (auto i = 0; i < 6; i++) {
-			transitionHandlerArray.Add(new MeshHandler(this, &a.transitionMeshArray[i]));
+				continue;
+			}
+
+			if (face_mask & 0x10) {
+				generateTransitionOnlyCell(x, y, 0);
+			}
+
+			if ((face_mask & 0x20) && (e != 0 || !(face_mask & 0x10))) {
+				generateTransitionOnlyCell(x, y, e);
+			}
 		}
 	}
+}
+
+// all cells of the grid that may have surface with lower corner x in [x_begin, x_end)
+static void generateGridCells(const VoxelData& vd, const VoxelDataParam& vdp, VoxelMeshExtractor& extractor, int stride, int lod, int x_begin, int x_end) {
+	int step = vdp.step();
+
+	for (auto x = x_begin; x < x_end; x += stride) {
+		for (auto y = 0; y < vd.num() - step; y += stride) {
+			if (vdp.z_cut) {
+				// z cut makes surface where voxel data has none
+				for (auto z = 0; z < vd.num() - step; z += stride) {
+					extractor.generateCell(x, y, z);
+				}
 
-	~VoxelMeshExtractor() {
-		delete mainMeshHandler;
+				continue;
+			}
 
-		for (MeshHandler* transitionHandler : transitionHandlerArray) {
-			delete transitionHandler;
+			generateSurfaceCellsInRow(vd, extractor, x, y, vd.num() - step, stride, lod);
 		}
 	}
-    
+}
+
+// Naive surface nets. Every cell of the lod with surface gets one vertex, the average of the isolevel crossings on its
+// edges, and every cell edge that crosses the isolevel gets a quad between the vertices of the 4 cells around it.
+// Cells around an edge on a zone face that lie outside the zone are collapsed onto the face. Their vertex is the average
+// of the crossings on the face, the same as the neighbour zone makes, so zones of the same lod have no gaps.
+class SurfaceNetsExtractor {
+
 private:
-	double isolevel = 0.5f;
+	FProcMeshSection &mesh_section;
+	const VoxelData &voxel_data;
+	const VoxelDataParam voxel_data_param;
+	SurfaceNetsScratch &scratch;
 
-	FORCEINLINE Point getVoxelpoint(PointAddr adr) {
-		return getVoxelpoint(adr.x, adr.y, adr.z);
+	const float isolevel = 0.5f;
+
+	// cell width in voxels and cells per axis
+	int step;
+	int cell_num;
+
+	FVector origin;
+	FVector voxel_size;
+
+	// vertices before this index are cell vertices with gradient normals, the rest are collapsed onto zone faces
+	int cell_vertex_num = 0;
+
+	// corner densities of the last cell visited
+	int last_cell[3] = { -1, -1, -1 };
+	float cell_density[8];
+
+public:
+	SurfaceNetsExtractor(MeshBuildLodSection &a, const VoxelData &b, const VoxelDataParam c, SurfaceNetsScratch &d) : mesh_section(a.mainMesh), voxel_data(b), voxel_data_param(c), scratch(d) {
+		step = voxel_data_param.step();
+		cell_num = (voxel_data.num() - 1) / step;
+		origin = voxel_data.voxelIndexToVector(0, 0, 0);
+		voxel_size = voxel_data.voxelIndexToVector(1, 1, 1) - origin;
+
+		const size_t cell_total = cell_num * cell_num * cell_num;
+		if (scratch.cell_index.size() != cell_total) {
+			scratch.cell_index.assign(cell_total, -1);
+		}
+
+		scratch.cell_list.clear();
+		scratch.cell_corner.clear();
+		scratch.border_index.Reset();
 	}
 
-	FORCEINLINE Point getVoxelpoint(uint8 x, uint8 y, uint8 z) {
-		Point vp;
-		vp.adr = PointAddr(x,y,z);
-		vp.density = getDensity(x, y, z);
-		vp.material_id = getMaterial(x, y, z);
-		vp.pos = voxel_data.voxelIndexToVector(x, y, z);
-		return vp;
+	void generateMesh() {
+		if (voxel_data.isSubstanceCacheValid() && !voxel_data_param.z_cut) {
+			generateCachedCellVertices();
+		} else {
+			generateGridCellVertices();
+		}
+
+		cell_vertex_num = mesh_section.ProcVertexBuffer.Num();
+
+		for (size_t n = 0; n < scratch.cell_list.size(); n++) {
+			generateCellQuads(scratch.cell_list[n], scratch.cell_corner[n]);
+		}
+
+		// collapsed vertices got the sum of their triangle normals
+		for (auto i = cell_vertex_num; i < mesh_section.ProcVertexBuffer.Num(); i++) {
+			FProcMeshVertex& Vertex = mesh_section.ProcVertexBuffer[i];
+			Vertex.Normal = Vertex.Normal.GetSafeNormal();
+		}
+
+		for (uint32 cell : scratch.cell_list) {
+			scratch.cell_index[cell] = -1;
+		}
 	}
 
-	FORCEINLINE float getDensity(int x, int y, int z) {
-		int step = voxel_data_param.step();
+private:
+	void generateCachedCellVertices() {
+		for (uint32 index : voxel_data.substanceCacheLOD[voxel_data_param.lod].cellList) {
+			int x, y, z;
+			voxel_data.clcVoxelIndex(index, x, y, z);
+			generateCellVertex(x, y, z);
+		}
+	}
+
+	void generateGridCellVertices() {
+		const int z_end = cell_num * step;
+		unsigned char case_code[VOXEL_CELL_ROW_MAX];
+
+		for (auto x = 0; x < z_end; x += step) {
+			for (auto y = 0; y < z_end; y += step) {
+				if (voxel_data_param.z_cut) {
+					// z cut makes surface where voxel data has none
+					for (auto z = 0; z < z_end; z += step) {
+						generateCellVertex(x, y, z);
+					}
+
+					continue;
+				}
+
+				forEachSurfaceRunInRow(voxel_data, x, y, 0, z_end, step, step, [&](int z_begin, int z_run_end) {
+					const int count = (z_run_end - z_begin) / step;
+					voxel_data.clcCellCaseCodeRow(x, y, z_begin, count, voxel_data_param.lod, case_code);
+
+					for (auto i = 0; i < count; i++) {
+						if (isSurfaceCaseCode(case_code[i])) {
+							generateCellVertex(x, y, z_begin + i * step);
+						}
+					}
+				});
+			}
+		}
+	}
+
+	FORCEINLINE float getDensity(int x, int y, int z) const {
 		if (voxel_data_param.z_cut) {
 			FVector p = voxel_data.voxelIndexToVector(x, y, z);
 			p += voxel_data.getOrigin();
@@ -520,406 +2693,786 @@ private:
 			}
 		}
 
-		return voxel_data.getDensity(x, y, z);
+		return voxel_data.getDensityLOD(x, y, z, voxel_data_param.lod);
 	}
 
-	FORCEINLINE int getMaterial(int x, int y, int z) {
-		return voxel_data.getMaterial(x, y, z);
+	// 1 if the material of the voxel is not the base material (dirt)
+	FORCEINLINE float getMaterialWeight(int x, int y, int z) const {
+		return (voxel_data.getMaterialLOD(x, y, z, voxel_data_param.lod) != 1) ? 1.f : 0.f;
 	}
 
-	FORCEINLINE FVector vertexInterpolation(FVector p1, FVector p2, float valp1, float valp2) {
-		if (std::abs(isolevel - valp1) < 0.00001) {
-			return p1;
+	FORCEINLINE int addVertex(const FVector& v, const FVector& n, float mat_weight) {
+		int t = mat_weight * 255;
+
+		FProcMeshVertex Vertex;
+		Vertex.Position = v;
+		Vertex.Normal = n;
+		Vertex.UV0 = FVector2D(0.f, 0.f);
+		Vertex.Color = FColor(t, 0, 0, 0);
+		Vertex.Tangent = FProcMeshTangent();
+
+		mesh_section.SectionLocalBox += Vertex.Position;
+		return mesh_section.ProcVertexBuffer.Add(Vertex);
+	}
+
+	// corner c of a cell is at offset (c & 1, (c >> 1) & 1, (c >> 2) & 1), its bit in the corner mask is set if it is solid
+	void generateCellVertex(int x, int y, int z) {
+		float* d = cell_density;
+		uint8 corner = 0;
+
+		// cells are visited in rows along z, the next cell in the row shares 4 corners
+		const bool next_in_row = x == last_cell[0] && y == last_cell[1] && z == last_cell[2] + step;
+		last_cell[0] = x;
+		last_cell[1] = y;
+		last_cell[2] = z;
+
+		for (auto c = 0; c < 8; c++) {
+			if (next_in_row && c < 4) {
+				d[c] = d[c + 4];
+			} else {
+				d[c] = getDensity(x + (c & 1) * step, y + ((c >> 1) & 1) * step, z + ((c >> 2) & 1) * step);
+			}
+
+			if (d[c] >= isolevel) {
+				corner |= 1 << c;
+			}
 		}
 
-		if (std::abs(isolevel - valp2) < 0.00001) {
-			return p2;
+		if (corner == 0 || corner == 0xff) {
+			return;
 		}
 
-		if (std::abs(valp1 - valp2) < 0.00001) {
-			return p1;
+		FVector sum(0, 0, 0);
+		float mat_sum = 0;
+		int crossing_num = 0;
+
+		for (auto c0 = 0; c0 < 8; c0++) {
+			for (auto axis = 0; axis < 3; axis++) {
+				const int c1 = c0 | (1 << axis);
+				if (c1 == c0 || ((corner >> c0) & 1) == ((corner >> c1) & 1)) {
+					continue;
+				}
+
+				const float t = (isolevel - d[c0]) / (d[c1] - d[c0]);
+				FVector p((float)(c0 & 1), (float)((c0 >> 1) & 1), (float)((c0 >> 2) & 1));
+				p[axis] = t;
+				sum += p;
+
+				const int solid = ((corner >> c0) & 1) ? c0 : c1;
+				mat_sum += getMaterialWeight(x + (solid & 1) * step, y + ((solid >> 1) & 1) * step, z + ((solid >> 2) & 1) * step);
+				crossing_num++;
+			}
 		}
 
-		if (valp1 == valp2) {
-			return p1;
+		// position in the cell and the trilinear density gradient there
+		const FVector u = sum / (float)crossing_num;
+		const FVector g(
+			(1 - u.Y) * (1 - u.Z) * (d[1] - d[0]) + u.Y * (1 - u.Z) * (d[3] - d[2]) + (1 - u.Y) * u.Z * (d[5] - d[4]) + u.Y * u.Z * (d[7] - d[6]),
+			(1 - u.X) * (1 - u.Z) * (d[2] - d[0]) + u.X * (1 - u.Z) * (d[3] - d[1]) + (1 - u.X) * u.Z * (d[6] - d[4]) + u.X * u.Z * (d[7] - d[5]),
+			(1 - u.X) * (1 - u.Y) * (d[4] - d[0]) + u.X * (1 - u.Y) * (d[5] - d[1]) + (1 - u.X) * u.Y * (d[6] - d[2]) + u.X * u.Y * (d[7] - d[3]));
+
+		// density grows into the solid, the normal points out of it
+		const FVector n = (g.SizeSquared() > 0) ? -g.GetSafeNormal() : FVector(0, 0, 1);
+		const FVector v = origin + (FVector(x, y, z) + u * (float)step) * voxel_size;
+		const int index = addVertex(v, n, mat_sum / crossing_num);
+
+		const uint32 cell = ((x / step) * cell_num + y / step) * cell_num + z / step;
+		scratch.cell_index[cell] = index;
+		scratch.cell_list.push_back(cell);
+		scratch.cell_corner.push_back(corner);
+	}
+
+	// Vertex of the cell at lattice coordinates q, each in [-1, cell_num]. Cells at -1 or cell_num on an axis are
+	// outside the zone and collapsed onto the face, their vertex is made from the crossings of the face part they touch.
+	int getCellVertex(const int (&q)[3]) {
+		if (q[0] >= 0 && q[1] >= 0 && q[2] >= 0 && q[0] < cell_num && q[1] < cell_num && q[2] < cell_num) {
+			return scratch.cell_index[(q[0] * cell_num + q[1]) * cell_num + q[2]];
 		}
 
-		float mu = (isolevel - valp1) / (valp2 - valp1);
+		const uint32 key = (q[0] + 1) | ((q[1] + 1) << 8) | ((q[2] + 1) << 16);
+		const int* index_ptr = scratch.border_index.Find(key);
+		if (index_ptr != NULL) {
+			return *index_ptr;
+		}
+
+		int lo[3];
+		int hi[3];
+		for (auto axis = 0; axis < 3; axis++) {
+			lo[axis] = FMath::Clamp(q[axis], 0, cell_num);
+			hi[axis] = (q[axis] >= 0 && q[axis] < cell_num) ? q[axis] + 1 : lo[axis];
+		}
+
+		FVector sum(0, 0, 0);
+		float mat_sum = 0;
+		int crossing_num = 0;
+
+		for (auto axis = 0; axis < 3; axis++) {
+			if (lo[axis] == hi[axis]) {
+				continue;
+			}
+
+			const int b = (axis + 1) % 3;
+			const int c = (axis + 2) % 3;
+
+			for (auto pb = lo[b]; pb <= hi[b]; pb++) {
+				for (auto pc = lo[c]; pc <= hi[c]; pc++) {
+					int p0[3];
+					p0[axis] = lo[axis];
+					p0[b] = pb;
+					p0[c] = pc;
+
+					int p1[3] = { p0[0], p0[1], p0[2] };
+					p1[axis] = hi[axis];
+
+					const float d0 = getDensity(p0[0] * step, p0[1] * step, p0[2] * step);
+					const float d1 = getDensity(p1[0] * step, p1[1] * step, p1[2] * step);
+					if ((d0 >= isolevel) == (d1 >= isolevel)) {
+						continue;
+					}
+
+					FVector p((float)p0[0], (float)p0[1], (float)p0[2]);
+					p[axis] += (isolevel - d0) / (d1 - d0);
+					sum += p;
+
+					const int* solid = (d0 >= isolevel) ? p0 : p1;
+					mat_sum += getMaterialWeight(solid[0] * step, solid[1] * step, solid[2] * step);
+					crossing_num++;
+				}
+			}
+		}
+
+		if (crossing_num == 0) {
+			return -1;
+		}
+
+		const FVector v = origin + sum * ((float)step / crossing_num) * voxel_size;
+		const int index = addVertex(v, FVector(0, 0, 0), mat_sum / crossing_num);
+		scratch.border_index.Add(key, index);
+		return index;
+	}
+
+	// quads of the edges the cell owns: the edges at its lower corner, and the ones on the upper faces of the zone
+	void generateCellQuads(uint32 cell, uint8 corner) {
+		static const int quad_offset[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+
+		const int cell_pos[3] = { (int)(cell / (cell_num * cell_num)), (int)((cell / cell_num) % cell_num), (int)(cell % cell_num) };
+
+		for (auto axis = 0; axis < 3; axis++) {
+			const int b = (axis + 1) % 3;
+			const int c = (axis + 2) % 3;
+			const int ob_num = (cell_pos[b] == cell_num - 1) ? 2 : 1;
+			const int oc_num = (cell_pos[c] == cell_num - 1) ? 2 : 1;
+
+			for (auto ob = 0; ob < ob_num; ob++) {
+				for (auto oc = 0; oc < oc_num; oc++) {
+					const int c0 = (ob << b) | (oc << c);
+					const int c1 = c0 | (1 << axis);
+					const bool solid0 = ((corner >> c0) & 1) != 0;
+					const bool solid1 = ((corner >> c1) & 1) != 0;
+					if (solid0 == solid1) {
+						continue;
+					}
+
+					// the 4 cells around the edge, counterclockwise around the axis
+					int quad[4];
+					bool valid = true;
+					for (auto i = 0; i < 4; i++) {
+						int q[3] = { cell_pos[0], cell_pos[1], cell_pos[2] };
+						q[b] += ob - quad_offset[i][0];
+						q[c] += oc - quad_offset[i][1];
+
+						quad[i] = getCellVertex(q);
+						valid = valid && quad[i] >= 0;
+					}
 
-		FVector tmp;
-		tmp.X = p1.X + mu * (p2.X - p1.X);
-		tmp.Y = p1.Y + mu * (p2.Y - p1.Y);
-		tmp.Z = p1.Z + mu * (p2.Z - p1.Z);
+					if (!valid) {
+						continue;
+					}
 
-		return tmp;
+					// same winding as Transvoxel triangles
+					if (solid1) {
+						addQuad(quad[0], quad[1], quad[2], quad[3]);
+					} else {
+						addQuad(quad[3], quad[2], quad[1], quad[0]);
+					}
+				}
+			}
+		}
 	}
 
-	FORCEINLINE void materialCalculation(struct TmpPoint& tp, Point point1, Point point2) {
-		static const int base_mat = 1; // dirt is base material
+	FORCEINLINE void addTriangle(int i1, int i2, int i3) {
+		mesh_section.ProcIndexBuffer.Add(i1);
+		mesh_section.ProcIndexBuffer.Add(i2);
+		mesh_section.ProcIndexBuffer.Add(i3);
 
-		FVector p1 = point1.pos;
-		FVector p2 = point2.pos;
-		const int mat1 = point1.material_id;
-		const int mat2 = point2.material_id;
-		
-		if ((base_mat == mat1)&&(base_mat == mat2)) {
-			tp.mat_id = base_mat;
-			tp.mat_weight = 0;
+		if (i1 < cell_vertex_num && i2 < cell_vertex_num && i3 < cell_vertex_num) {
 			return;
 		}
 
-		if (mat1 == mat2) {
-			tp.mat_id = base_mat;
-			tp.mat_weight = 1;
-			return;
+		FVector p1 = mesh_section.ProcVertexBuffer[i1].Position;
+		FVector p2 = mesh_section.ProcVertexBuffer[i2].Position;
+		FVector p3 = mesh_section.ProcVertexBuffer[i3].Position;
+		const FVector n = -clcNormal(p1, p2, p3);
+
+		const int index[3] = { i1, i2, i3 };
+		for (int i : index) {
+			if (i >= cell_vertex_num) {
+				mesh_section.ProcVertexBuffer[i].Normal += n;
+			}
 		}
+	}
 
-		FVector tmp(p1);
-		tmp -= p2;
-		float s = tmp.Size();
+	FORCEINLINE void addQuad(int i1, int i2, int i3, int i4) {
+		addTriangle(i1, i2, i3);
+		addTriangle(i1, i3, i4);
+	}
 
-		p1 -= tp.v;
-		p2 -= tp.v;
+};
 
-		float s1 = p1.Size();
-		float s2 = p2.Size();
+static FORCEINLINE FProcMeshSection& getHandlerSection(MeshBuildLodSection& lod_section, int handler) {
+	return (handler == 0) ? lod_section.mainMesh : lod_section.transitionMeshArray[handler - 1];
+}
 
-		if (mat1 != base_mat) {
-			tp.mat_weight = s1 / s;
-			return;
-		}
+static FORCEINLINE FProcMeshPackedSection& getHandlerSection(MeshLodSection& lod_section, int handler) {
+	return (handler == 0) ? lod_section.mainMesh : lod_section.transitionMeshArray[handler - 1];
+}
 
-		if (mat2 != base_mat) {
-			tp.mat_weight = s2 / s;
-			return;
-		}
+// Joins the section of the handler meshed slab by slab into dst, in slab order. A vertex on an edge of the plane
+// between two slabs is made by both of them, the copy of the upper slab is merged into the one of the lower slab.
+// Vertex order and indices are the same as meshing the LOD in one pass. The averaged normal is too, up to rounding:
+// the upper slab started from its first triangle normal n1 instead of the lower slab normal and averaged count
+// normals after it, so the one pass normal is upper + (lower - n1) / 2^(count + 1).
+static void stitchMeshSlabs(FProcMeshSection& dst, VoxelMeshContext** context, int slab_num, int lod_index, int handler) {
+	int vertex_num = 0;
+	int index_num = 0;
+
+	for (auto k = 0; k < slab_num; k++) {
+		const FProcMeshSection& src = getHandlerSection(context[k]->lod_section[lod_index], handler);
+		vertex_num += src.ProcVertexBuffer.Num();
+		index_num += src.ProcIndexBuffer.Num();
 	}
 
-	FORCEINLINE void materialCalculation2(struct TmpPoint& tp, Point point1, Point point2) {
-		static const int base_mat = 1; // dirt
+	dst.ProcVertexBuffer.Reserve(vertex_num);
+	dst.ProcIndexBuffer.Reserve(index_num);
 
-		float mu = (isolevel - point1.density) / (point2.density - point1.density);
+	for (auto k = 0; k < slab_num; k++) {
+		const FProcMeshSection& src = getHandlerSection(context[k]->lod_section[lod_index], handler);
+		MeshHandlerScratch& scratch = context[k]->handler_scratch[lod_index][handler];
+		std::vector<int>& remap = scratch.slab_remap;
+		remap.assign(src.ProcVertexBuffer.Num(), -1);
 
-		PointAddr tmp;
-		tmp.x = point1.adr.x + mu * (point2.adr.x - point1.adr.x);
-		tmp.y = point1.adr.y + mu * (point2.adr.y - point1.adr.y);
-		tmp.z = point1.adr.z + mu * (point2.adr.z - point1.adr.z);
+		if (k > 0) {
+			const MeshHandlerScratch& prev = context[k - 1]->handler_scratch[lod_index][handler];
 
-		tp.mat_id = getMaterial(tmp.x, tmp.y, tmp.z);
+			for (const SlabBorderVertex& border : scratch.low_border) {
+				const int* prev_index = prev.high_border.Find(border.key);
+				if (prev_index == NULL) {
+					continue;
+				}
 
-		if (base_mat == tp.mat_id) {
-			tp.mat_weight = 0;
-		} else {
-			tp.mat_weight = 1;
-		}
-	}
+				const int index = prev.slab_remap[*prev_index];
+				remap[border.index] = index;
 
-	FORCEINLINE TmpPoint vertexClc(Point& point1, Point& point2) {
-		struct TmpPoint ret;
+				if (!border.has_normal) {
+					FProcMeshVertex& Vertex = dst.ProcVertexBuffer[index];
+					FVector tmp(Vertex.Normal);
+					tmp -= border.normal;
+					tmp /= (float)(1 << FMath::Min(scratch.average_count[border.index] + 1, 30));
+					tmp += src.ProcVertexBuffer[border.index].Normal;
 
-		ret.v = vertexInterpolation(point1.pos, point2.pos, point1.density, point2.density);
+					Vertex.Normal = tmp;
+				}
+			}
+		}
 
-		if (voxel_data_param.lod == 0) {
-			materialCalculation(ret, point1, point2);
-		} else {
-			materialCalculation2(ret, point1, point2);
+		for (auto i = 0; i < src.ProcVertexBuffer.Num(); i++) {
+			if (remap[i] < 0) {
+				remap[i] = dst.ProcVertexBuffer.Num();
+				dst.ProcVertexBuffer.Add(src.ProcVertexBuffer[i]);
+			}
 		}
-		return ret;
-	}
 
-	FORCEINLINE void getConrers(int8 (&corner)[8], Point (&d)[8]) {
-		for (auto i = 0; i < 8; i++) {
-			corner[i] = (d[i].density < isolevel) ? 0 : -127;
+		for (int32 index : src.ProcIndexBuffer) {
+			dst.ProcIndexBuffer.Add(remap[index]);
 		}
+
+		dst.SectionLocalBox += src.SectionLocalBox;
 	}
+}
 
-	FORCEINLINE PointAddr clcMediumAddr(const PointAddr& adr1, const PointAddr& adr2) {
-		uint8 x = (adr2.x - adr1.x) / 2 + adr1.x;
-		uint8 y = (adr2.y - adr1.y) / 2 + adr1.y;
-		uint8 z = (adr2.z - adr1.z) / 2 + adr1.z;
+// A LOD is split into slabs of this many cells along x, which are meshed concurrently and stitched.
+// The split depends only on the zone size, so the mesh is the same for any number of threads.
+#define VOXEL_MESH_SLAB_CELLS 16
+#define VOXEL_MESH_SLAB_MAX ((VOXEL_CELL_ROW_MAX + VOXEL_MESH_SLAB_CELLS - 1) / VOXEL_MESH_SLAB_CELLS)
 
-		return PointAddr(x, y, z);
+// lod_index of the slab that is the collision mesh
+#define VOXEL_MESH_COLLISION_SLAB LOD_ARRAY_SIZE
+
+struct VoxelMeshSlab {
+	int lod_index;
+	int slab;
+	int x_begin;
+	int x_end;
+};
+
+// cache lines of the simulated vertex fetch, a FIFO of VOXEL_VERTEX_FETCH_LINES lines of VOXEL_VERTEX_FETCH_LINE bytes (16 KB)
+#define VOXEL_VERTEX_FETCH_LINE 64
+#define VOXEL_VERTEX_FETCH_LINES 256
+
+// triangles reordered together, in the order of the extractor. The vertices of a window take a few KB, so
+// the triangles of the next windows still find the shared ones in the fetch cache.
+#define VOXEL_VERTEX_CACHE_WINDOW 512
+
+// vertices transformed per triangle with a FIFO post-transform cache of VOXEL_VERTEX_CACHE_SIZE
+static float clcVertexCacheACMR(const TArray<int32>& indices, int vertex_num, VertexCacheScratch& scratch) {
+	if (indices.Num() < 3) {
+		return 0;
 	}
 
-	FORCEINLINE void extractRegularCell(Point (&d)[8]) {
-		int8 corner[8];
-		for (auto i = 0; i < 8; i++) {
-			corner[i] = (d[i].density < isolevel) ? -127 : 0;
+	// a vertex is in the cache while fewer than the cache size misses came after its own
+	scratch.cache_time.assign(vertex_num, 0);
+	int time = VOXEL_VERTEX_CACHE_SIZE + 1;
+	int miss_num = 0;
+
+	for (int32 index : indices) {
+		if (time - scratch.cache_time[index] > VOXEL_VERTEX_CACHE_SIZE) {
+			scratch.cache_time[index] = time++;
+			miss_num++;
 		}
+	}
 
-		unsigned long caseCode = ((corner[0] >> 7) & 0x01)
-			| ((corner[1] >> 6) & 0x02)
-			| ((corner[2] >> 5) & 0x04)
-			| ((corner[3] >> 4) & 0x08)
-			| ((corner[4] >> 3) & 0x10)
-			| ((corner[5] >> 2) & 0x20)
-			| ((corner[6] >> 1) & 0x40)
-			| (corner[7] & 0x80);
+	return miss_num / (float)(indices.Num() / 3);
+}
 
-		if (caseCode == 0) {
-			return;
-		}
+// bytes of packed vertices read in cache lines per byte of the packed vertex buffer
+static float clcVertexFetchRatio(const TArray<int32>& indices, int vertex_num, VertexCacheScratch& scratch) {
+	if (vertex_num == 0) {
+		return 0;
+	}
 
-		unsigned int c = regularCellClass[caseCode];
-		RegularCellData cd = regularCellData[c];
-		std::vector<TmpPoint> vertexList;
-		vertexList.reserve(cd.GetTriangleCount() * 3);
+	const int stride = sizeof(FProcMeshPackedVertex);
+	const int line_num = (vertex_num * stride + VOXEL_VERTEX_FETCH_LINE - 1) / VOXEL_VERTEX_FETCH_LINE;
 
-		for (int i = 0; i < cd.GetVertexCount(); i++) {
-			const int edgeCode = regularVertexData[caseCode][i];
-			const unsigned short v0 = (edgeCode >> 4) & 0x0F;
-			const unsigned short v1 = edgeCode & 0x0F;
-			struct TmpPoint tp = vertexClc(d[v0], d[v1]);
-			vertexList.push_back(tp);
-		}
+	scratch.cache_time.assign(line_num, 0);
+	int time = VOXEL_VERTEX_FETCH_LINES + 1;
+	int miss_num = 0;
 
-		for (int i = 0; i < cd.GetTriangleCount() * 3; i += 3) {
-			TmpPoint tmp1 = vertexList[cd.vertexIndex[i]];
-			TmpPoint tmp2 = vertexList[cd.vertexIndex[i + 1]];
-			TmpPoint tmp3 = vertexList[cd.vertexIndex[i + 2]];
+	for (int32 index : indices) {
+		const int first = index * stride / VOXEL_VERTEX_FETCH_LINE;
+		const int last = (index * stride + stride - 1) / VOXEL_VERTEX_FETCH_LINE;
 
-			mainMeshHandler->addTriangle(tmp1, tmp2, tmp3);
+		for (auto line = first; line <= last; line++) {
+			if (time - scratch.cache_time[line] > VOXEL_VERTEX_FETCH_LINES) {
+				scratch.cache_time[line] = time++;
+				miss_num++;
+			}
 		}
 	}
 
-	FORCEINLINE void extractTransitionCell(int sectionNumber, Point& d0, Point& d2, Point& d6, Point& d8) {
-		Point d[14];
+	return miss_num * VOXEL_VERTEX_FETCH_LINE / (float)(vertex_num * stride);
+}
 
-		d[0] = d0;
-		d[1] = getVoxelpoint(clcMediumAddr(d2.adr, d0.adr));
-		d[2] = d2;
+// Tipsify (Sander, Nehab, Barczak 2007). Triangles are emitted in fans around a vertex. The next fan is the vertex of
+// the last fan that has been in the cache longest and is still there after its own triangles are emitted, otherwise
+// the last dead end vertex with triangles left, otherwise the first triangle left. Walking the whole section at once
+// scatters the first use order of the vertices (fetch 1.00 -> 1.27 at LOD 0), so it walks windows of triangles.
+static void tipsifyIndices(const TArray<int32>& src, int vertex_num, TArray<int32>& dst, VertexCacheScratch& scratch) {
+	const int tri_num = src.Num() / 3;
 
-		PointAddr a3 = clcMediumAddr(d6.adr, d0.adr);
-		PointAddr a5 = clcMediumAddr(d8.adr, d2.adr);
+	scratch.live_count.assign(vertex_num, 0);
+	for (auto k = 0; k < tri_num * 3; k++) {
+		scratch.live_count[src[k]]++;
+	}
 
-		d[3] = getVoxelpoint(a3);
-		d[4] = getVoxelpoint(clcMediumAddr(a5, a3));
-		d[5] = getVoxelpoint(a5);
+	scratch.adjacency_offset.resize(vertex_num + 1);
+	scratch.adjacency_offset[0] = 0;
+	for (auto v = 0; v < vertex_num; v++) {
+		scratch.adjacency_offset[v + 1] = scratch.adjacency_offset[v] + scratch.live_count[v];
+	}
 
-		d[6] = d6;
-		d[7] = getVoxelpoint(clcMediumAddr(d8.adr, d6.adr));
-		d[8] = d8;
+	// cache_time is the fill position of each vertex first
+	scratch.adjacency.resize(tri_num * 3);
+	scratch.cache_time.assign(scratch.adjacency_offset.begin(), scratch.adjacency_offset.end() - 1);
+	for (auto k = 0; k < tri_num * 3; k++) {
+		scratch.adjacency[scratch.cache_time[src[k]]++] = k / 3;
+	}
 
-		d[9] = d0;
-		d[0xa] = d2;
-		d[0xb] = d6;
-		d[0xc] = d8;
+	scratch.cache_time.assign(vertex_num, 0);
+	scratch.emitted.assign(tri_num, 0);
+	scratch.live_count.assign(vertex_num, 0);
 
+	dst.Reset();
+	dst.Reserve(tri_num * 3);
 
-		for (auto i = 0; i < 9; i++) {
-			//mesh_data.DebugPointList.Add(d[i].pos);
-		}
+	int time = VOXEL_VERTEX_CACHE_SIZE + 1;
 
-		int8 corner[9];
-		for (auto i = 0; i < 9; i++) {
-			corner[i] = (d[i].density < isolevel) ? -127 : 0;
+	for (auto window_begin = 0; window_begin < tri_num; window_begin += VOXEL_VERTEX_CACHE_WINDOW) {
+		const int window_end = FMath::Min(window_begin + VOXEL_VERTEX_CACHE_WINDOW, tri_num);
+		for (auto k = window_begin * 3; k < window_end * 3; k++) {
+			scratch.live_count[src[k]]++;
 		}
 
-		static const int caseCodeCoeffs[9] = { 0x01, 0x02, 0x04, 0x80, 0x100, 0x08, 0x40, 0x20, 0x10 };
-		static const int charByteSz = sizeof(int8) * 8;
+		scratch.dead_end.clear();
+		int cursor = window_begin;
+		int fan = src[window_begin * 3];
 
-		unsigned long caseCode = 0;
-		for (auto ci = 0; ci < 9; ++ci) {
-			// add the coefficient only if the value is negative
-			caseCode += ((corner[ci] >> (charByteSz - 1)) & 1) * caseCodeCoeffs[ci];
-		}
+		while (fan >= 0) {
+			scratch.candidate.clear();
 
-		if (caseCode == 0) {
-			return;
-		}
+			for (auto k = scratch.adjacency_offset[fan]; k < scratch.adjacency_offset[fan + 1]; k++) {
+				const int t = scratch.adjacency[k];
+				if (t >= window_end || scratch.emitted[t]) {
+					continue;
+				}
 
-		unsigned int classIndex = transitionCellClass[caseCode];
+				scratch.emitted[t] = 1;
 
-		const bool inverse = (classIndex & 128) != 0;
+				for (auto j = 0; j < 3; j++) {
+					const int v = src[t * 3 + j];
+					dst.Add(v);
+					scratch.dead_end.push_back(v);
+					scratch.candidate.push_back(v);
+					scratch.live_count[v]--;
 
-		TransitionCellData cellData = transitionCellData[classIndex & 0x7F];
+					if (time - scratch.cache_time[v] > VOXEL_VERTEX_CACHE_SIZE) {
+						scratch.cache_time[v] = time++;
+					}
+				}
+			}
 
-		std::vector<TmpPoint> vertexList;
-		vertexList.reserve(cellData.GetTriangleCount() * 3);
+			// candidate that stays in the cache while its triangles are emitted, the oldest first
+			fan = -1;
+			int best = -1;
+			for (int v : scratch.candidate) {
+				if (scratch.live_count[v] <= 0) {
+					continue;
+				}
 
-		for (int i = 0; i < cellData.GetVertexCount(); i++) {
-			const int edgeCode = transitionVertexData[caseCode][i];
-			const unsigned short v0 = (edgeCode >> 4) & 0x0F;
-			const unsigned short v1 = edgeCode & 0x0F;
+				const int age = time - scratch.cache_time[v];
+				const int priority = (age + 2 * scratch.live_count[v] <= VOXEL_VERTEX_CACHE_SIZE) ? age : 0;
+				if (priority > best) {
+					best = priority;
+					fan = v;
+				}
+			}
 
-			struct TmpPoint tp = vertexClc(d[v0], d[v1]);
-			vertexList.push_back(tp);
+			if (fan >= 0) {
+				continue;
+			}
 
-			mesh_data.DebugPointList.Add(tp.v);
-		}
+			while (!scratch.dead_end.empty()) {
+				const int v = scratch.dead_end.back();
+				scratch.dead_end.pop_back();
 
-		for (int i = 0; i < cellData.GetTriangleCount() * 3; i += 3) {
-			TmpPoint tmp1 = vertexList[cellData.vertexIndex[i]];
-			TmpPoint tmp2 = vertexList[cellData.vertexIndex[i + 1]];
-			TmpPoint tmp3 = vertexList[cellData.vertexIndex[i + 2]];
+				if (scratch.live_count[v] > 0) {
+					fan = v;
+					break;
+				}
+			}
 
-			MeshHandler* meshHandler = transitionHandlerArray[sectionNumber];
+			while (fan < 0 && cursor < window_end) {
+				if (!scratch.emitted[cursor]) {
+					fan = src[cursor * 3];
+				}
 
-			if (inverse) {
-				meshHandler->addTriangle(tmp3, tmp2, tmp1);
-			} else {
-				meshHandler->addTriangle(tmp1, tmp2, tmp3);
+				cursor++;
 			}
-			
 		}
 	}
+}
 
-public:
-	FORCEINLINE void generateCell(int x, int y, int z) {
-		Point d[8];
+// Reorders the triangles of the section for the post-transform cache and then the vertices in the order the triangles
+// fetch them. Vertices no triangle uses are dropped. Statistics are taken before and after.
+// The fans only help sections with enough shared vertices, thin strips of transition cells may keep their order.
+static void optimizeVertexCache(FProcMeshSection& section, VertexCacheScratch& scratch, MeshSectionCacheStats& stats) {
+	const int vertex_num = section.ProcVertexBuffer.Num();
 
-		int step = voxel_data_param.step();
+	stats.acmr_before = clcVertexCacheACMR(section.ProcIndexBuffer, vertex_num, scratch);
+	stats.fetch_before = clcVertexFetchRatio(section.ProcIndexBuffer, vertex_num, scratch);
 
-        d[0] = getVoxelpoint(x, y + step, z);
-        d[1] = getVoxelpoint(x, y, z);
-        d[2] = getVoxelpoint(x + step, y + step, z);
-        d[3] = getVoxelpoint(x + step, y, z);
-        d[4] = getVoxelpoint(x, y + step, z + step);
-        d[5] = getVoxelpoint(x, y, z + step);
-        d[6] = getVoxelpoint(x + step, y + step, z + step);
-        d[7] = getVoxelpoint(x + step, y, z + step);
-		
-		extractRegularCell(d);
+	if (section.ProcIndexBuffer.Num() >= 3) {
+		tipsifyIndices(section.ProcIndexBuffer, vertex_num, scratch.index_buffer, scratch);
+		if (clcVertexCacheACMR(scratch.index_buffer, vertex_num, scratch) < stats.acmr_before) {
+			Swap(section.ProcIndexBuffer, scratch.index_buffer);
+		}
 
-		if (voxel_data_param.bGenerateLOD) {
-			if (voxel_data_param.lod > 0) {
-				const int e = voxel_data.num() - step - 1;
+		scratch.remap.assign(vertex_num, -1);
+		scratch.vertex_buffer.Reset();
+		scratch.vertex_buffer.Reserve(vertex_num);
 
-				if (x == 0) extractTransitionCell(0, d[1], d[0], d[5], d[4]); // X+
-				if (x == e) extractTransitionCell(1, d[2], d[3], d[6], d[7]); // X-
-				if (y == 0) extractTransitionCell(2, d[3], d[1], d[7], d[5]); // Y-
-				if (y == e) extractTransitionCell(3, d[0], d[2], d[4], d[6]); // Y+
-				if (z == 0) extractTransitionCell(4, d[3], d[2], d[1], d[0]); // Z-
-				if (z == e) extractTransitionCell(5, d[6], d[7], d[4], d[5]); // Z+
+		for (int32& index : section.ProcIndexBuffer) {
+			if (scratch.remap[index] < 0) {
+				scratch.remap[index] = scratch.vertex_buffer.Num();
+				scratch.vertex_buffer.Add(section.ProcVertexBuffer[index]);
 			}
+
+			index = scratch.remap[index];
 		}
 
-    }
+		Swap(section.ProcVertexBuffer, scratch.vertex_buffer);
+	}
 
-};
+	stats.acmr_after = clcVertexCacheACMR(section.ProcIndexBuffer, section.ProcVertexBuffer.Num(), scratch);
+	stats.fetch_after = clcVertexFetchRatio(section.ProcIndexBuffer, section.ProcVertexBuffer.Num(), scratch);
+}
 
-typedef std::shared_ptr<VoxelMeshExtractor> VoxelMeshExtractorPtr;
+static FORCEINLINE MeshSectionCacheStats& getHandlerCacheStats(MeshLodSection& lod_section, int handler) {
+	return (handler == 0) ? lod_section.mainCacheStats : lod_section.transitionCacheStats[handler - 1];
+}
 
-//####################################################################################################################################
+// Packs the LOD meshed in slab_num slabs to its section of mesh_data, stitching the slabs if there are more.
+// All sections are quantized in the bounds of the zone, so vertices shared by sections or by neighbour zones stay shared.
+static void finishMeshLod(const VoxelData& vd, const VoxelDataParam& vdp, MeshData* mesh_data, VoxelMeshContext** context, int slab_num, int i) {
+	MeshLodSection& lod_section = mesh_data->MeshSectionLodArray[i];
+	const FBox bounds(FVector(-vd.size() / 2), FVector(vd.size() / 2));
 
-MeshDataPtr polygonizeCellSubstanceCacheNoLOD(const VoxelData &vd, const VoxelDataParam &vdp) {
-	MeshData* mesh_data = new MeshData();
-	VoxelMeshExtractorPtr mesh_extractor_ptr = VoxelMeshExtractorPtr(new VoxelMeshExtractor(mesh_data->MeshSectionLodArray[0], vd, vdp));
+	for (auto handler = 0; handler < 7; handler++) {
+		FProcMeshSection* section = &getHandlerSection(context[0]->lod_section[i], handler);
 
-	int step = vdp.step();
-	for (auto it = vd.substanceCacheLOD[0].cellList.cbegin(); it != vd.substanceCacheLOD[0].cellList.cend(); ++it) {
-		int index = *it;
+		if (slab_num > 1) {
+			section = &context[0]->stitch_section[i];
+			resetMeshSection(*section);
+			stitchMeshSlabs(*section, context, slab_num, i, handler);
+		}
 
-		int x = index / (vd.num() * vd.num());
-		int y = (index / vd.num()) % vd.num();
-		int z = index % vd.num();
+		if (vdp.bOptimizeVertexCache) {
+			optimizeVertexCache(*section, context[0]->cache_scratch[i], getHandlerCacheStats(lod_section, handler));
+		}
 
-		mesh_extractor_ptr->generateCell(x, y, z);
+		getHandlerSection(lod_section, handler).Pack(*section, bounds);
 	}
 
-	mesh_data->CollisionMeshPtr = &mesh_data->MeshSectionLodArray[0].mainMesh;
-
-	return MeshDataPtr(mesh_data);
+	for (auto k = 0; k < slab_num; k++) {
+		lod_section.DebugPointList.Append(context[k]->lod_section[i].DebugPointList);
+	}
 }
 
+// Collision is meshed at its own lod without transition cells, so it has no gaps at zone faces and is the same
+// on both sides of them. Only positions and indices are used.
+static void meshCollision(const VoxelData& vd, const VoxelDataParam& vdp, MeshData* mesh_data, VoxelMeshContext* context) {
+	const bool use_cache = vd.isSubstanceCacheValid();
+	MeshBuildLodSection& collision_section = context->collision_section;
+	resetMeshLodSection(collision_section);
+
+	VoxelDataParam me_vdp = vdp;
+	me_vdp.lod = FMath::Clamp(vdp.collisionLOD, 0, LOD_ARRAY_SIZE - 1);
+	me_vdp.bGradientNormals = false;
+	for (auto face = 0; face < VOXEL_ZONE_FACES; face++) {
+		me_vdp.neighbour_lod[face] = LOD_ARRAY_SIZE;
+	}
 
-MeshDataPtr polygonizeCellSubstanceCacheLOD(const VoxelData &vd, const VoxelDataParam &vdp) {
-	MeshData* mesh_data = new MeshData();
-	static const int max_lod = LOD_ARRAY_SIZE;
+	const FBox bounds(FVector(-vd.size() / 2), FVector(vd.size() / 2));
 
-	// create mesh extractor for each LOD
-	for (auto lod = 0; lod < max_lod; lod++) {
-		VoxelDataParam me_vdp = vdp;
-		me_vdp.lod = lod;
+	if (vdp.bSurfaceNets) {
+		SurfaceNetsExtractor extractor(collision_section, vd, me_vdp, context->nets_collision_scratch);
+		extractor.generateMesh();
+		mesh_data->CollisionMesh.Pack(collision_section.mainMesh, bounds);
+		return;
+	}
+
+	const int step = me_vdp.step();
+	const int lod = me_vdp.lod;
+	const int x_end = vd.num() - step;
+	VoxelMeshExtractor extractor(collision_section, vd, me_vdp, context->collision_scratch, -1, -1);
 
-		VoxelMeshExtractorPtr mesh_extractor_ptr = VoxelMeshExtractorPtr(new VoxelMeshExtractor(mesh_data->MeshSectionLodArray[lod], vd, me_vdp));
+	if (use_cache) {
+		generateCachedCells(vd, extractor, lod, 0, x_end);
+	} else {
+		generateGridCells(vd, me_vdp, extractor, step, lod, 0, x_end);
+	}
 
-		int step = vdp.step();
-		for (auto it = vd.substanceCacheLOD[lod].cellList.cbegin(); it != vd.substanceCacheLOD[lod].cellList.cend(); ++it) {
-			int index = *it;
+	mesh_data->CollisionMesh.Pack(collision_section.mainMesh, bounds);
+}
 
-			int x = index / (vd.num() * vd.num());
-			int y = (index / vd.num()) % vd.num();
-			int z = index % vd.num();
+//####################################################################################################################################
 
-			mesh_extractor_ptr->generateCell(x, y, z);
+int sandboxTransitionFaceMask(const int* neighbour_lod, int lod) {
+	int mask = 0;
+	for (auto face = 0; face < VOXEL_ZONE_FACES; face++) {
+		if (neighbour_lod[face] < lod) {
+			mask |= 1 << face;
 		}
 	}
 
-	mesh_data->CollisionMeshPtr = &mesh_data->MeshSectionLodArray[0].mainMesh;
+	return mask;
+}
 
-	return MeshDataPtr(mesh_data);
+int sandboxLodBandMask(int lod) {
+	int mask = 0;
+	for (auto i = FMath::Max(lod - 1, 0); i <= FMath::Min(lod + 1, LOD_ARRAY_SIZE - 1); i++) {
+		mask |= 1 << i;
+	}
+
+	return mask;
 }
 
+// mesh data with a copy of the finished LOD i only, without collision
+static MeshDataPtr copyMeshLod(const VoxelDataParam& vdp, const MeshData* mesh_data, int i) {
+	MeshData* lod_data = new MeshData();
+	lod_data->VoxelVersion = mesh_data->VoxelVersion;
+	lod_data->LodMask = 1 << i;
+	lod_data->CollisionMeshPtr = NULL;
+	lod_data->MeshSectionLodArray[i] = mesh_data->MeshSectionLodArray[i];
+	lod_data->MeshSectionLodArray[i].TransitionFaceMask = vdp.transitionFaceMask(i);
+	return MeshDataPtr(lod_data);
+}
 
-MeshDataPtr polygonizeVoxelGridNoLOD(const VoxelData &vd, const VoxelDataParam &vdp) {
-	MeshData* mesh_data = new MeshData();
-	VoxelMeshExtractorPtr mesh_extractor_ptr = VoxelMeshExtractorPtr(new VoxelMeshExtractor(mesh_data->MeshSectionLodArray[0], vd, vdp));
+MeshDataPtr sandboxVoxelGenerateMesh(const VoxelData &vd, const VoxelDataParam &vdp, const std::function<void(MeshDataPtr)>& on_priority_lod) {
+	const bool use_cache = vd.isSubstanceCacheValid();
+	const int step = vdp.step();
 
-	int step = vdp.step();
+	// LODs nearest to the one the view needs go first, so it is done first when the task pool is busy
+	int lod_order[LOD_ARRAY_SIZE];
+	int lod_num = 0;
+	for (auto i = 0; i < (vdp.bGenerateLOD ? LOD_ARRAY_SIZE : 1); i++) {
+		if (!vdp.bGenerateLOD || (vdp.lod_mask & (1 << i))) {
+			lod_order[lod_num++] = i;
+		}
+	}
 
-	for (auto x = 0; x < vd.num() - step; x += step) {
-		for (auto y = 0; y < vd.num() - step; y += step) {
-			for (auto z = 0; z < vd.num() - step; z += step) {
-				mesh_extractor_ptr->generateCell(x, y, z);
-			}
+	std::stable_sort(lod_order, lod_order + lod_num, [&](int a, int b) {
+		return std::abs(a - vdp.priority_lod) < std::abs(b - vdp.priority_lod);
+	});
+
+	VoxelMeshSlab slab_list[LOD_ARRAY_SIZE * VOXEL_MESH_SLAB_MAX + 1];
+	int slab_list_num = 0;
+	int slab_num[LOD_ARRAY_SIZE];
+	int max_slab_num = 1;
+
+	for (auto n = 0; n < lod_num; n++) {
+		const int i = lod_order[n];
+
+		// without LOD the only section is meshed at the lod of the param
+		const int lod = vdp.bGenerateLOD ? i : vdp.lod;
+		const int stride = vdp.bGenerateLOD ? FMath::Max(step, 1 << lod) : step;
+		const int x_end = vd.num() - step;
+		const int cell_num = (x_end + stride - 1) / stride;
+
+		// slab planes must be cell faces, the position map has no edges to stitch by. Surface nets are fast enough in one pass
+		const bool split = stride == (1 << lod) && !vdp.bPositionVertexMap && !vdp.bSurfaceNets;
+		slab_num[i] = split ? FMath::Max(1, (cell_num + VOXEL_MESH_SLAB_CELLS - 1) / VOXEL_MESH_SLAB_CELLS) : 1;
+		max_slab_num = FMath::Max(max_slab_num, slab_num[i]);
+
+		for (auto k = 0; k < slab_num[i]; k++) {
+			VoxelMeshSlab& slab = slab_list[slab_list_num++];
+			slab.lod_index = i;
+			slab.slab = k;
+			slab.x_begin = k * VOXEL_MESH_SLAB_CELLS * stride;
+			slab.x_end = (k == slab_num[i] - 1) ? x_end : slab.x_begin + VOXEL_MESH_SLAB_CELLS * stride;
 		}
 	}
 
-	mesh_data->CollisionMeshPtr = &mesh_data->MeshSectionLodArray[0].mainMesh;
+	// Without LOD the collision is the only section. With LOD it is the main mesh of a built LOD, the regular cells
+	// next to transition cells are shrunk by a part of a cell only. A lod that is not built gets meshed after the LODs.
+	// Negative collisionLOD is no collision.
+	const int collision_lod = FMath::Min(vdp.collisionLOD, LOD_ARRAY_SIZE - 1);
+	const bool collision_section = vdp.bGenerateLOD && collision_lod >= 0 && (vdp.lod_mask & (1 << collision_lod));
+	const bool collision_mesh = vdp.bGenerateLOD && collision_lod >= 0 && !collision_section;
+
+	if (collision_mesh) {
+		VoxelMeshSlab& slab = slab_list[slab_list_num++];
+		slab.lod_index = VOXEL_MESH_COLLISION_SLAB;
+		slab.slab = 0;
+		slab.x_begin = 0;
+		slab.x_end = vd.num() - step;
+	}
 
-	return MeshDataPtr(mesh_data);
-}
+	// context k has slab k of every LOD
+	VoxelMeshContext* context[VOXEL_MESH_SLAB_MAX];
+	for (auto k = 0; k < max_slab_num; k++) {
+		context[k] = mesh_context_pool.take();
+	}
+
+	// the last slab of a LOD to finish stitches it, so every LOD is done on its own
+	std::atomic<int> slabs_left[LOD_ARRAY_SIZE];
+	for (auto n = 0; n < lod_num; n++) {
+		slabs_left[lod_order[n]] = slab_num[lod_order[n]];
+	}
 
-MeshDataPtr polygonizeVoxelGridWithLOD(const VoxelData &vd, const VoxelDataParam &vdp) {
 	MeshData* mesh_data = new MeshData();
-	std::vector<VoxelMeshExtractorPtr> MeshExtractorLod;
-	//VoxelMeshExtractorPtr MeshExtractorLod[LOD_ARRAY_SIZE];
+	mesh_data->VoxelVersion = vd.getChangeVersion();
+
+	// the view gets the priority LOD before the others are done
+	const int early_lod = (vdp.bGenerateLOD && lod_num > 1 && on_priority_lod && (vdp.lod_mask & (1 << vdp.priority_lod))) ? vdp.priority_lod : -1;
+
+	ParallelFor(slab_list_num, [&](int32 n) {
+		const VoxelMeshSlab& slab = slab_list[n];
+		const int i = slab.lod_index;
 
-	static const int max_lod = LOD_ARRAY_SIZE;
+		if (i == VOXEL_MESH_COLLISION_SLAB) {
+			meshCollision(vd, vdp, mesh_data, context[0]);
+			return;
+		}
+
+		MeshBuildLodSection& lod_section = context[slab.slab]->lod_section[i];
+		resetMeshLodSection(lod_section);
 
-	// create mesh extractor for each LOD
-	for (auto lod = 0; lod < max_lod; lod++) {
 		VoxelDataParam me_vdp = vdp;
+		const int lod = vdp.bGenerateLOD ? i : vdp.lod;
 		me_vdp.lod = lod;
-		VoxelMeshExtractorPtr me_ptr = VoxelMeshExtractorPtr(new VoxelMeshExtractor(mesh_data->MeshSectionLodArray[lod], vd, me_vdp));
-		MeshExtractorLod.push_back(me_ptr);
-	}
 
-	int step = vdp.step();
+		if (vdp.bSurfaceNets) {
+			SurfaceNetsExtractor extractor(lod_section, vd, me_vdp, context[0]->nets_scratch[i]);
+			extractor.generateMesh();
+			finishMeshLod(vd, vdp, mesh_data, context, 1, i);
 
-	for (auto x = 0; x < vd.num() - step; x += step) {
-		for (auto y = 0; y < vd.num() - step; y += step) {
-			for (auto z = 0; z < vd.num() - step; z += step) {
-				// generate mesh for each LOD
-				//==================================================================
-				for (auto i = 0; i < max_lod; i++) {
-					int s = 1 << i;
-					if (x % s == 0 && y % s == 0 && z % s == 0) {
-						VoxelMeshExtractorPtr me_ptr = MeshExtractorLod[i];
-						me_ptr->generateCell(x, y, z);
-					}
-				}
-				//==================================================================
+			if (i == early_lod) {
+				on_priority_lod(copyMeshLod(vdp, mesh_data, i));
 			}
+			return;
 		}
-	}
 
-	mesh_data->CollisionMeshPtr = &mesh_data->MeshSectionLodArray[0].mainMesh;
+		const int border_low = (slab.slab > 0) ? slab.x_begin : -1;
+		const int border_high = (slab.slab < slab_num[i] - 1) ? slab.x_end : -1;
+		VoxelMeshExtractor extractor(lod_section, vd, me_vdp, context[slab.slab]->handler_scratch[i], border_low, border_high);
 
-	return MeshDataPtr(mesh_data);
-}
+		if (use_cache) {
+			// without LOD the cells come from the lod 0 cache whatever the lod of the param
+			generateCachedCells(vd, extractor, vdp.bGenerateLOD ? lod : 0, slab.x_begin, slab.x_end);
 
-MeshDataPtr sandboxVoxelGenerateMesh(const VoxelData &vd, const VoxelDataParam &vdp) {
-	if (vd.isSubstanceCacheValid()) {
-		for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
-			//UE_LOG(LogTemp, Warning, TEXT("SubstanceCacheLOD -> %d ---> %f %f %f -> %d elenents"), lod, vd.getOrigin().X, vd.getOrigin().Y, vd.getOrigin().Z, vd.substanceCacheLOD[lod].cellList.size());
+			const int face_mask = vdp.bGenerateLOD ? me_vdp.transitionFaceMask(lod) : 0;
+			if (face_mask != 0) {
+				generateTransitionOnlyCells(vd, extractor, face_mask, lod, slab.x_begin, slab.x_end);
+			}
+		} else {
+			// every LOD has own extractor so cells can be visited LOD by LOD
+			generateGridCells(vd, vdp, extractor, vdp.bGenerateLOD ? FMath::Max(step, 1 << lod) : step, lod, slab.x_begin, slab.x_end);
+		}
+
+		// one allocation per buffer, the contexts keep their memory for the next zone
+		if (--slabs_left[i] == 0) {
+			finishMeshLod(vd, vdp, mesh_data, context, slab_num[i], i);
+
+			if (i == early_lod) {
+				on_priority_lod(copyMeshLod(vdp, mesh_data, i));
+			}
 		}
+	});
+
+	for (auto k = 0; k < max_slab_num; k++) {
+		mesh_context_pool.give(context[k]);
+	}
 
-		return vdp.bGenerateLOD ? polygonizeCellSubstanceCacheLOD(vd, vdp) : polygonizeCellSubstanceCacheNoLOD(vd, vdp);
+	for (auto n = 0; n < lod_num; n++) {
+		const int i = lod_order[n];
+		mesh_data->LodMask |= 1 << i;
+		mesh_data->MeshSectionLodArray[i].TransitionFaceMask = vdp.bGenerateLOD ? vdp.transitionFaceMask(i) : 0;
 	}
 
-	return vdp.bGenerateLOD ? polygonizeVoxelGridWithLOD(vd, vdp) : polygonizeVoxelGridNoLOD(vd, vdp);
+	if (!vdp.bGenerateLOD) {
+		mesh_data->CollisionMeshPtr = (vdp.collisionLOD >= 0) ? &mesh_data->MeshSectionLodArray[0].mainMesh : NULL;
+		mesh_data->CollisionLod = (vdp.collisionLOD >= 0) ? vdp.lod : -1;
+	} else if (collision_section) {
+		mesh_data->CollisionMeshPtr = &mesh_data->MeshSectionLodArray[collision_lod].mainMesh;
+		mesh_data->CollisionLod = collision_lod;
+	} else if (collision_mesh) {
+		mesh_data->CollisionMeshPtr = &mesh_data->CollisionMesh;
+		mesh_data->CollisionLod = collision_lod;
+	} else {
+		mesh_data->CollisionMeshPtr = NULL;
+	}
+
+	return MeshDataPtr(mesh_data);
 }
 
 // =================================================================
@@ -965,7 +3518,7 @@ void sandboxSaveVoxelData(const VoxelData &vd, FString &fullFileName) {
 	}
 
 	// save material
-	if (vd.material_data == NULL) {
+	if (vd.isMaterialUniform()) {
 		volume_state = 0;
 	} else {
 		volume_state = 2;
@@ -1037,10 +3590,16 @@ bool sandboxLoadVoxelData(VoxelData &vd, FString &fullFileName) {
 					unsigned char density;
 					binaryData << density;
 					vd.setVoxelPointDensity(x, y, z, density);
-					vd.performSubstanceCacheLOD(x, y, z);
 				}
 			}
 		}
+
+		// zone is MIX even if every stored voxel happened to match the fill state
+		if (vd.bricks.empty()) {
+			vd.initializeBricks();
+		}
+
+		vd.density_state = VoxelDataFillState::MIX;
 	}
 	
 	// load material
@@ -1062,6 +3621,10 @@ bool sandboxLoadVoxelData(VoxelData &vd, FString &fullFileName) {
 
 	int32 end_marker;
 	binaryData << end_marker;
+
+	vd.compactBricks();
+	vd.rebuildDensityMips();
+	vd.rebuildSubstanceCacheLOD();
 	
 	binaryData.FlushCache();
 	TheBinaryArray.Empty();
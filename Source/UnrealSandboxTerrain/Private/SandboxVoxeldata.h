@@ -4,12 +4,80 @@
 #include "EngineMinimal.h"
 #include "ProcMeshData.h"
 
-#include <list>
 #include <array>
+#include <vector>
 #include <memory>
+#include <functional>
+#include <mutex>
+#include <atomic>
 
 #define LOD_ARRAY_SIZE 7
 
+// voxel data is stored in cubic bricks of (1 << VOXEL_BRICK_SHIFT)^3 voxels
+#define VOXEL_BRICK_SHIFT 3
+#define VOXEL_BRICK_SIZE (1 << VOXEL_BRICK_SHIFT)
+#define VOXEL_BRICK_MASK (VOXEL_BRICK_SIZE - 1)
+#define VOXEL_BRICK_VOLUME (VOXEL_BRICK_SIZE * VOXEL_BRICK_SIZE * VOXEL_BRICK_SIZE)
+
+// raw density bounds are kept for blocks of 4^3, 8^3 and 16^3 voxels
+#define VOXEL_DENSITY_BOUNDS_LEVELS 3
+#define VOXEL_DENSITY_BOUNDS_SHIFT 2
+
+// raw density at and below is outside of the surface
+#define VOXEL_ISOLEVEL_RAW 127
+
+// voxel coordinates are 8 bit, so a row has at most 255 cells
+#define VOXEL_CELL_ROW_MAX 255
+
+// cell case codes of a row are classified 16 cells at a time where SSE2 is available
+#if !defined(VOXEL_CELL_CASE_SSE2)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXEL_CELL_CASE_SSE2 1
+#else
+#define VOXEL_CELL_CASE_SSE2 0
+#endif
+#endif
+
+// Voxel order inside a brick. Set VOXEL_DATA_LAYOUT_MORTON=1 (see UnrealSandboxTerrain.Build.cs)
+// to store bricks in Z-order, so the 8 corners of a cell and the strided LOD fetches stay close in memory.
+#ifndef VOXEL_DATA_LAYOUT_MORTON
+#define VOXEL_DATA_LAYOUT_MORTON 0
+#endif
+
+// x-major: x * size * size + y * size + z
+struct VoxelLayoutLinear {
+	static FORCEINLINE int index(int x, int y, int z) {
+		return (x << (VOXEL_BRICK_SHIFT * 2)) | (y << VOXEL_BRICK_SHIFT) | z;
+	}
+
+	static const TCHAR* name() {
+		return TEXT("linear");
+	}
+};
+
+// Z-curve: bits of x, y, z interleaved
+struct VoxelLayoutMorton {
+	// bit i of v moved to bit 3 * i, for bricks up to 16^3
+	static FORCEINLINE int spreadBits(int v) {
+		static const int spread[16] = { 0, 1, 8, 9, 64, 65, 72, 73, 512, 513, 520, 521, 576, 577, 584, 585 };
+		return spread[v];
+	}
+
+	static FORCEINLINE int index(int x, int y, int z) {
+		return (spreadBits(x) << 2) | (spreadBits(y) << 1) | spreadBits(z);
+	}
+
+	static const TCHAR* name() {
+		return TEXT("morton");
+	}
+};
+
+#if VOXEL_DATA_LAYOUT_MORTON
+typedef VoxelLayoutMorton VoxelDataLayout;
+#else
+typedef VoxelLayoutLinear VoxelDataLayout;
+#endif
+
 typedef struct VoxelPoint {
 	unsigned char density;
 	unsigned char material;
@@ -25,8 +93,86 @@ enum VoxelDataFillState{
 	ZERO, ALL, MIX
 };
 
+// Density and material of one brick. Buffers are allocated only if the brick is not uniform:
+// density_data for MIX bricks, material_data if the brick holds more than base_fill_mat.
+// Buffers are reference counted and shared with snapshots, they are copied before the first write.
+//
+// material_data is palette compressed: (1 << material_bits) palette entries followed by
+// material_bits wide indices, one per voxel. material_bits grows 1 -> 2 -> 4 -> 8 when an edit
+// adds a material the palette can't hold; with 8 bits the buffer holds raw material ids.
+typedef struct VoxelBrick {
+	VoxelDataFillState density_state = VoxelDataFillState::ZERO;
+	unsigned char base_fill_mat = 0;
+
+	unsigned char material_bits = 0;
+	unsigned char material_palette_size = 0;
+
+	unsigned char* density_data = NULL;
+	unsigned char* material_data = NULL;
+} VoxelBrick;
+
+typedef struct VoxelDensityBounds {
+	unsigned char min = 255;
+	unsigned char max = 0;
+} VoxelDensityBounds;
+
+// Downsampled copy of the zone for LOD meshing. Sample (i, j, k) of level L stands for
+// voxel (i, j, k) << L; num = (voxel_num - 1) / (1 << L) + 1 samples per axis.
+typedef struct VoxelDensityMip {
+	int num = 0;
+	std::vector<unsigned char> density;
+	std::vector<unsigned char> material;
+} VoxelDensityMip;
+
+// Densities of the neighbour zone one voxel behind a face, num * num values.
+// Faces are X-, X+, Y-, Y+, Z-, Z+; a slab is indexed by the two other axes in x, y, z order.
+// The slab is shared with snapshots, setApronFace replaces it as a whole.
+typedef struct VoxelApronFace {
+	bool valid = false;
+	std::shared_ptr<const std::vector<unsigned char>> density;
+} VoxelApronFace;
+
+#define VOXEL_APRON_FACES 6
+
+// Voxel index bounds of changed voxels, inclusive
+typedef struct VoxelDirtyRegion {
+	int min_x = MAX_int32;
+	int min_y = MAX_int32;
+	int min_z = MAX_int32;
+
+	int max_x = -1;
+	int max_y = -1;
+	int max_z = -1;
+
+	bool isEmpty() const {
+		return max_x < min_x;
+	}
+
+	FORCEINLINE void add(int x, int y, int z) {
+		if (x < min_x) min_x = x;
+		if (y < min_y) min_y = y;
+		if (z < min_z) min_z = z;
+		if (x > max_x) max_x = x;
+		if (y > max_y) max_y = y;
+		if (z > max_z) max_z = z;
+	}
+
+	void add(const VoxelDirtyRegion& region) {
+		if (!region.isEmpty()) {
+			add(region.min_x, region.min_y, region.min_z);
+			add(region.max_x, region.max_y, region.max_z);
+		}
+	}
+
+	void clear() {
+		*this = VoxelDirtyRegion();
+	}
+} VoxelDirtyRegion;
+
+// Linear indices (see clcLinearIndex) of the lower corner of cells crossed by the surface,
+// in ascending order when the cache is built by a x, y, z loop
 typedef struct SubstanceCache {
-	std::list<int> cellList;
+	std::vector<uint32> cellList;
 } SubstanceCache;
 
 enum VoxelDataState {
@@ -42,22 +188,99 @@ private:
 
     int voxel_num;
     float volume_size;
-	unsigned char* density_data;
-	unsigned char* material_data;
 
-	volatile double last_change;
-	volatile double last_save;
-	volatile double last_mesh_generation;
-	volatile double last_cache_check;
+	// bricks per axis
+	int brick_num;
+
+	// empty while the whole zone is uniform (see density_state and base_fill_mat)
+	std::vector<VoxelBrick> bricks;
+
+	// Min and max raw density of blocks of (1 << (VOXEL_DENSITY_BOUNDS_SHIFT + level))^3 voxels.
+	// Writes only widen them, compactBricks() makes them exact again where it compacts. Empty together with bricks.
+	int density_bounds_num[VOXEL_DENSITY_BOUNDS_LEVELS];
+	std::array<std::vector<VoxelDensityBounds>, VOXEL_DENSITY_BOUNDS_LEVELS> density_bounds;
+
+	// Levels 1 .. LOD_ARRAY_SIZE - 1 at density_mips[level - 1]. Empty unless enabled and the density is MIX.
+	// Levels are shared with snapshots like brick buffers and copied before the first write.
+	bool density_mips_enabled = false;
+	std::vector<std::shared_ptr<VoxelDensityMip>> density_mips;
+
+	// neighbour densities around the zone, see setApronFace
+	std::array<VoxelApronFace, VOXEL_APRON_FACES> apron;
+
+	void detachDensityMip(int level);
+	void buildDensityMipSample(int level, int i, int j, int k);
+	unsigned char getMipSourceDensity(int level, int x, int y, int z) const;
+	unsigned char getMipSourceMaterial(int level, int x, int y, int z) const;
+
+	// mip level holding voxel (x, y, z) for the lod, 0 if it has to be read from bricks or is outside of the zone
+	FORCEINLINE int clcDensityMipLevel(int x, int y, int z, int lod) const {
+		if (lod == 0 || density_mips.empty() || x >= voxel_num || y >= voxel_num || z >= voxel_num) {
+			return 0;
+		}
+
+		return FMath::Min(lod, (int)FMath::CountTrailingZeros((uint32)(x | y | z)));
+	}
+
+	// held by the edit thread for the whole zone edit, snapshot() waits for it
+	mutable std::mutex edit_mutex;
+
+	// Every setChanged() increments change_version. Save, mesh generation and substance cache
+	// remember the version they are up to date with.
+	std::atomic<uint64> change_version;
+	std::atomic<uint64> save_version;
+	std::atomic<uint64> mesh_version;
+	std::atomic<uint64> cache_version;
+
+	// voxels written since the last setChanged(), only touched by the thread that changes the zone
+	VoxelDirtyRegion edit_region;
+
+	// voxels changed since the last save, mesh generation and cache check
+	mutable std::mutex dirty_region_mutex;
+	VoxelDirtyRegion save_region;
+	VoxelDirtyRegion mesh_region;
+	VoxelDirtyRegion cache_region;
+
+	void setUpToDate(std::atomic<uint64>& version, VoxelDirtyRegion& region, uint64 up_to_version);
+	VoxelDirtyRegion getDirtyRegion(const VoxelDirtyRegion& region) const;
 	
 	FVector origin = FVector(0.0f, 0.0f, 0.0f);
 	FVector lower = FVector(0.0f, 0.0f, 0.0f);
 	FVector upper = FVector(0.0f, 0.0f, 0.0f);
 
-	void initializeDensity();
-	void initializeMaterial();
+	void initializeBricks();
+	void releaseBricks();
+
+	void resetDensityBounds(unsigned char d);
+	void updateDensityBounds(const VoxelDirtyRegion& region);
+	void widenDensityBounds(int x, int y, int z, unsigned char d);
 
+	void initializeBrickDensity(VoxelBrick& brick);
+	void releaseBrickDensity(VoxelBrick& brick);
+	void releaseBrickMaterial(VoxelBrick& brick);
+
+	unsigned char getBrickMaterial(const VoxelBrick& brick, int i) const;
+	void setBrickMaterial(VoxelBrick& brick, int i, unsigned char material);
+	void decodeBrickMaterial(const VoxelBrick& brick, unsigned char* materials) const;
+	void encodeBrickMaterial(VoxelBrick& brick, const unsigned char* materials, int bits);
+	void compactBrickMaterial(VoxelBrick& brick, int bx, int by, int bz);
+
+	bool isMaterialUniform() const;
+	bool isBrickDataUniform(const unsigned char* data, int bx, int by, int bz) const;
+
+	FORCEINLINE int clcBrickIndex(int x, int y, int z) const {
+		return (x >> VOXEL_BRICK_SHIFT) * brick_num * brick_num + (y >> VOXEL_BRICK_SHIFT) * brick_num + (z >> VOXEL_BRICK_SHIFT);
+	};
+
+	FORCEINLINE int clcBrickLocalIndex(int x, int y, int z) const {
+		return VoxelDataLayout::index(x & VOXEL_BRICK_MASK, y & VOXEL_BRICK_MASK, z & VOXEL_BRICK_MASK);
+	};
+
+	bool isSubstanceCell(int x, int y, int z, int step) const;
 	bool performCellSubstanceCaching(int x, int y, int z, int lod, int step);
+	void updateSubstanceCache(const VoxelDirtyRegion& region, int lod);
+
+	unsigned char* getWritableBrickDensity(VoxelBrick& brick);
 
 public: 
 	std::array<SubstanceCache, LOD_ARRAY_SIZE> substanceCacheLOD;
@@ -69,6 +292,12 @@ public:
 		return x * voxel_num * voxel_num + y * voxel_num + z;
 	};
 
+	FORCEINLINE void clcVoxelIndex(int index, int& x, int& y, int& z) const {
+		x = index / (voxel_num * voxel_num);
+		y = (index / voxel_num) % voxel_num;
+		z = index % voxel_num;
+	};
+
     void setDensity(int x, int y, int z, float density);
     float getDensity(int x, int y, int z) const;
 	unsigned char getRawDensity(int x, int y, int z) const;
@@ -95,27 +324,101 @@ public:
 	void performSubstanceCacheNoLOD(int x, int y, int z);
 	void performSubstanceCacheLOD(int x, int y, int z);
 
+	// rebuild cache of all LODs from scratch
+	void rebuildSubstanceCacheLOD();
+
+	// Re-check only cells touching the changed voxels and keep the rest of the cache.
+	// Falls back to a full rebuild if the cache is not valid.
+	void updateSubstanceCacheNoLOD(const VoxelDirtyRegion& region);
+	void updateSubstanceCacheLOD(const VoxelDirtyRegion& region);
+
+	// voxel index bounds of a cube in world space, clamped to the zone
+	VoxelDirtyRegion clcVoxelRegion(FVector center, float extent) const;
+
 	VoxelDataFillState getDensityFillState() const; 
 	//VoxelDataFillState getMaterialFillState() const; 
 
 	void deinitializeDensity(VoxelDataFillState density_state);
 	void deinitializeMaterial(unsigned char base_mat);
 
-	void setChanged() { last_change = FPlatformTime::Seconds(); }
-	bool isChanged() { return last_change > last_save; }
-	void resetLastSave() { last_save = FPlatformTime::Seconds(); }
-	bool needToRegenerateMesh() { return last_change > last_mesh_generation; }
-	void resetLastMeshRegenerationTime() { last_mesh_generation = FPlatformTime::Seconds(); }
-
-	bool isSubstanceCacheValid() const { return last_change <= last_cache_check; }
-	void setCacheToValid() { last_cache_check = FPlatformTime::Seconds(); }
+	// release buffers of bricks that turned out to be uniform
+	void compactBricks();
+
+	// same for the bricks the region touches only, so an edit costs with the brush and not with the zone
+	void compactBricks(const VoxelDirtyRegion& region);
+
+	// bytes held by the zone: bricks, buffers (shared ones too), density bounds, mips and substance cache
+	SIZE_T getMemorySize() const;
+
+	// False if all voxels of the box (inclusive) are on one side of the isolevel, checked with
+	// the density bounds of the given level. Coarse levels need fewer lookups but skip less.
+	bool isSurfacePossible(int x0, int y0, int z0, int x1, int y1, int z1, int level) const;
+
+	// Optional density mip pyramid: LOD meshing and LOD substance cache read downsampled levels
+	// instead of every (1 << lod)-th voxel. Must be rebuilt after generation or loading
+	// and updated after edits, like the substance cache.
+	void setDensityMipsEnabled(bool enabled);
+	bool hasDensityMips() const { return !density_mips.empty(); }
+	void rebuildDensityMips();
+	void updateDensityMips(const VoxelDirtyRegion& region);
+
+	// same as getDensity, getRawDensity and getMaterial but read from the mip level of the lod if there is one
+	float getDensityLOD(int x, int y, int z, int lod) const;
+	unsigned char getRawDensityLOD(int x, int y, int z, int lod) const;
+	int getMaterialLOD(int x, int y, int z, int lod) const;
+
+	// Transvoxel case codes of count cells of the lod in row (x, y) with lower corners z, z + step, ...
+	// from raw density. Corners are in VoxelMeshExtractor order, the bit is set if the corner is below
+	// the isolevel, so 0 and 255 are cells without surface.
+	void clcCellCaseCodeRow(int x, int y, int z, int count, int lod, unsigned char* case_code) const;
+
+	// Optional one voxel apron: the zone keeps a copy of the voxel plane of each neighbour behind
+	// its faces, so meshing can look across the zone border without the neighbour.
+	// copyApronSlab(face) gives the plane the neighbour across that face keeps as its apron face face ^ 1,
+	// setApronFace makes a new version that needs a new mesh only.
+	void copyApronSlab(int face, std::vector<unsigned char>& slab) const;
+	void setApronFace(int face, const std::vector<unsigned char>& slab);
+	bool hasApron() const;
+
+	// raw density with x, y, z one voxel outside of the zone read from the apron,
+	// clamped to the zone where there is no apron
+	unsigned char getRawDensityExt(int x, int y, int z) const;
+
+	// Read-only copy of the current state for mesh generation and saving. Bricks, density mips
+	// and apron faces are shared with this VoxelData and copied on write, so a snapshot costs
+	// copies of the brick table, the density bounds and, if it is valid, the substance cache.
+	std::shared_ptr<const VoxelData> snapshot() const;
+
+	void beginEdit() { edit_mutex.lock(); }
+	void endEdit() { edit_mutex.unlock(); }
+
+	// new version with the voxels written since the previous call
+	void setChanged();
+	uint64 getChangeVersion() const { return change_version; }
+
+	// version is getChangeVersion() at the time the data was saved or the mesh snapshot was taken,
+	// edits made meanwhile stay unsaved or need a new mesh
+	bool isChanged() { return change_version > save_version; }
+	void resetLastSave(uint64 version) { setUpToDate(save_version, save_region, version); }
+	bool needToRegenerateMesh() { return change_version > mesh_version; }
+	void resetLastMeshRegenerationTime(uint64 version) { setUpToDate(mesh_version, mesh_region, version); }
+
+	// cache is updated inside beginEdit/endEdit, so it is valid for the current version
+	bool isSubstanceCacheValid() const { return change_version <= cache_version; }
+	void setCacheToValid() { setUpToDate(cache_version, cache_region, change_version); }
+
+	// changed voxels since the last save, mesh generation and cache check
+	VoxelDirtyRegion getSaveDirtyRegion() const { return getDirtyRegion(save_region); }
+	VoxelDirtyRegion getMeshDirtyRegion() const { return getDirtyRegion(mesh_region); }
+	VoxelDirtyRegion getCacheDirtyRegion() const { return getDirtyRegion(cache_region); }
 
 	void clearSubstanceCache() { 
 		for (SubstanceCache& lodCache : substanceCacheLOD) {
 			lodCache.cellList.clear();
 		}
 
-		last_cache_check = -1;
+		// change_version is never 0
+		cache_version = 0;
 	};
 
 	VoxelDataState DataState = VoxelDataState::UNDEFINED;
@@ -133,14 +436,35 @@ public:
 	friend bool sandboxLoadVoxelData(VoxelData &vd, FString &fileName);
 };
 
+// entries of the FIFO post-transform cache sections are ordered for
+#define VOXEL_VERTEX_CACHE_SIZE 16
+
+// Post-transform cache and vertex fetch of a section before and after the vertex cache pass, set if it ran
+typedef struct MeshSectionCacheStats {
+	// vertices transformed per triangle with a FIFO cache of VOXEL_VERTEX_CACHE_SIZE
+	float acmr_before = 0;
+	float acmr_after = 0;
+
+	// bytes of packed vertices read in cache lines per byte of the vertex buffer, 1 - every vertex read once
+	float fetch_before = 0;
+	float fetch_after = 0;
+} MeshSectionCacheStats;
+
 typedef struct MeshLodSection {
 
-	FProcMeshSection mainMesh;
+	FProcMeshPackedSection mainMesh;
 
-	TArray<FProcMeshSection> transitionMeshArray;
+	TArray<FProcMeshPackedSection> transitionMeshArray;
 
 	TArray<FVector> DebugPointList;
 
+	// faces with transition cells, bit f for transitionMeshArray[f]
+	int TransitionFaceMask = 0;
+
+	MeshSectionCacheStats mainCacheStats;
+
+	MeshSectionCacheStats transitionCacheStats[6];
+
 	MeshLodSection() {
 		transitionMeshArray.SetNum(6); 
 	}
@@ -154,7 +478,21 @@ typedef struct MeshData {
 	}
 
 	TArray<MeshLodSection> MeshSectionLodArray;
-	FProcMeshSection* CollisionMeshPtr;
+
+	// main mesh of a LOD or CollisionMesh, NULL if there is no collision
+	FProcMeshPackedSection* CollisionMeshPtr;
+
+	// meshed at VoxelDataParam::collisionLOD if that lod is not built
+	FProcMeshPackedSection CollisionMesh;
+
+	// lod of CollisionMeshPtr, -1 if there is no collision
+	int CollisionLod = -1;
+
+	// LODs that were built, bit i for MeshSectionLodArray[i], the others are empty
+	int LodMask = 0;
+
+	// VoxelData::getChangeVersion() of the voxel data the mesh is built from
+	uint64 VoxelVersion = 0;
 
 	~MeshData() {
 		// for memory leaks checking
@@ -165,22 +503,64 @@ typedef struct MeshData {
 
 typedef std::shared_ptr<MeshData> MeshDataPtr;
 
+typedef std::shared_ptr<const VoxelData> VoxelDataSnapshotPtr;
+
+// faces of a zone, in the order of the apron faces and the transition sections: -x, +x, -y, +y, -z, +z
+#define VOXEL_ZONE_FACES 6
+
+// Bit f is set if the zone behind face f is finer than lod, so the face of the lod needs transition cells
+int sandboxTransitionFaceMask(const int* neighbour_lod, int lod);
+
 typedef struct VoxelDataParam {
 	bool bGenerateLOD = false;
 
+	// lod of the collision mesh with bGenerateLOD, negative - no collision mesh
 	int collisionLOD = 0;
 
 	int lod = 0;
 	float z_cut_level = 0;
 	bool z_cut = false;
 
+	// deduplicate vertices by position hash instead of by voxel edge, for comparison
+	bool bPositionVertexMap = false;
+
+	// LOD the view needs first, LODs are started nearest to it first
+	int priority_lod = 0;
+
+	// LODs built with bGenerateLOD, bit i for lod i
+	int lod_mask = (1 << LOD_ARRAY_SIZE) - 1;
+
+	// vertex normals from the density gradient, independent of triangle order and the same on both sides of zone faces
+	bool bGradientNormals = false;
+
+	// lod the zone behind each face is drawn with, LOD_ARRAY_SIZE if there is none. By default
+	// every face of every lod > 0 gets transition cells
+	int neighbour_lod[VOXEL_ZONE_FACES] = { 0, 0, 0, 0, 0, 0 };
+
+	// naive surface nets instead of Transvoxel: one vertex per surface cell and quads between them.
+	// Much faster and fewer vertices, but there are no transition cells, so zones of different lods have cracks
+	bool bSurfaceNets = false;
+
+	// reorder triangles of every section for the post-transform vertex cache, then vertices in the order they are fetched
+	bool bOptimizeVertexCache = false;
+
 	FORCEINLINE int step() const {
 		return 1 << lod;
 	}
 
+	FORCEINLINE int transitionFaceMask(int lod) const {
+		return bSurfaceNets ? 0 : sandboxTransitionFaceMask(neighbour_lod, lod);
+	}
+
 } VoxelDataParam;
 
-std::shared_ptr<MeshData> sandboxVoxelGenerateMesh(const VoxelData &vd, const VoxelDataParam &vdp);
+// LODs a zone drawn with lod needs, the neighbour ones so it can change lod before more are built
+int sandboxLodBandMask(int lod);
+
+// With bGenerateLOD and more than one LOD to build, on_priority_lod gets mesh data with only the priority
+// LOD as soon as it is done, from a mesh thread. The returned mesh data has all LODs, the same voxel
+// version and the collision.
+std::shared_ptr<MeshData> sandboxVoxelGenerateMesh(const VoxelData &vd, const VoxelDataParam &vdp, const std::function<void(MeshDataPtr)>& on_priority_lod = nullptr);
 
 void sandboxSaveVoxelData(const VoxelData &vd, FString &fileName);
 bool sandboxLoadVoxelData(VoxelData &vd, FString &fileName);
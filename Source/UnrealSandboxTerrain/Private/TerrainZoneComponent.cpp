@@ -20,11 +20,12 @@ void UTerrainZoneComponent::makeTerrain() {
 		return;
 	}
 
+	uint64 mesh_version = voxel_data->getChangeVersion();
 	std::shared_ptr<MeshData> md_ptr = generateMesh();
 
 	if (IsInGameThread()) {
 		applyTerrainMesh(md_ptr);
-		voxel_data->resetLastMeshRegenerationTime();
+		voxel_data->resetLastMeshRegenerationTime(mesh_version);
 	} else {
 		UE_LOG(LogTemp, Warning, TEXT("non-game thread -> invoke async task"));
 		if (GetTerrainController() != NULL) {
@@ -33,26 +34,86 @@ void UTerrainZoneComponent::makeTerrain() {
 	}
 }
 
-std::shared_ptr<MeshData> UTerrainZoneComponent::generateMesh() {
-	double start = FPlatformTime::Seconds();
-
-	if (voxel_data->getDensityFillState() == VoxelDataFillState::ZERO || voxel_data->getDensityFillState() == VoxelDataFillState::ALL) {
-		return NULL;
-	}
-
+VoxelDataParam UTerrainZoneComponent::makeMeshParam(int LodMask, bool bUpdateCollision) {
 	bool enableLOD = GetTerrainController()->bEnableLOD;
 
 	VoxelDataParam vdp;
+	vdp.bGradientNormals = GetTerrainController()->bGradientNormals;
+	vdp.bSurfaceNets = GetTerrainController()->bSurfaceNets;
+	vdp.bOptimizeVertexCache = GetTerrainController()->bOptimizeVertexCache;
 
 	if (enableLOD) {
 		vdp.bGenerateLOD = true;
-		vdp.collisionLOD = 1;
+
+		FVector ZoneIndex = GetTerrainController()->getZoneIndex(GetComponentLocation());
+
+		// until the first tick the view is taken at the terrain origin, where the initial zones are
+		FVector ViewLocation;
+		if (!GetTerrainController()->GetViewLocation(ViewLocation)) {
+			ViewLocation = FVector(0);
+		}
+
+		// LOD the zone is drawn with now is meshed first, faces next to finer zones get transition cells
+		vdp.priority_lod = GetTerrainController()->GetZoneLod(ZoneIndex, ViewLocation);
+		GetTerrainController()->GetZoneNeighbourLod(ZoneIndex, ViewLocation, vdp.neighbour_lod);
+		vdp.lod_mask = (LodMask != 0) ? LodMask : sandboxLodBandMask(vdp.priority_lod);
+
+		// LODs added later for the view don't mesh the collision again unless the zone moved to another band
+		vdp.collisionLOD = (LodMask == 0 || bUpdateCollision) ? GetTerrainController()->GetZoneCollisionLod(vdp.priority_lod) : -1;
 	} else {
 		vdp.bGenerateLOD = false;
 		vdp.collisionLOD = 0;
 	}
 
-	MeshDataPtr md_ptr = sandboxVoxelGenerateMesh(*voxel_data, vdp);
+	return vdp;
+}
+
+std::shared_ptr<MeshData> UTerrainZoneComponent::generateMesh(int LodMask, bool bUpdateCollision) {
+	double start = FPlatformTime::Seconds();
+
+	// voxel data may be changed by the edit thread meanwhile
+	VoxelDataSnapshotPtr vd_snapshot = voxel_data->snapshot();
+
+	if (vd_snapshot->getDensityFillState() == VoxelDataFillState::ZERO || vd_snapshot->getDensityFillState() == VoxelDataFillState::ALL) {
+		return NULL;
+	}
+
+	VoxelDataParam vdp = makeMeshParam(LodMask, bUpdateCollision);
+
+	// Off the game thread the LOD the zone is drawn with is applied before the other LODs are done,
+	// the mesh component merges the rest of the same voxel version into it. The worker doesn't touch
+	// the zone, it may be destroyed meanwhile, so the weak pointer is checked by the game thread task.
+	std::function<void(MeshDataPtr)> on_priority_lod;
+	if (vdp.bGenerateLOD && !IsInGameThread()) {
+		ASandboxTerrainController* Controller = GetTerrainController();
+		TWeakObjectPtr<UTerrainZoneComponent> ZonePtr(this);
+
+		on_priority_lod = [=](MeshDataPtr lod_md_ptr) {
+			TerrainControllerTask task;
+			task.f = [=]() {
+				if (ZonePtr.IsValid()) {
+					ZonePtr->applyTerrainMesh(lod_md_ptr);
+				}
+			};
+
+			Controller->AddAsyncTask(task);
+		};
+	}
+
+	MeshDataPtr md_ptr = sandboxVoxelGenerateMesh(*vd_snapshot, vdp, on_priority_lod);
+
+	if (vdp.bOptimizeVertexCache && GetTerrainController()->bLogVertexCacheStats) {
+		for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+			const MeshLodSection& section = md_ptr->MeshSectionLodArray[lod];
+			if (section.mainMesh.ProcIndexBuffer.Num() == 0) {
+				continue;
+			}
+
+			const MeshSectionCacheStats& stats = section.mainCacheStats;
+			UE_LOG(LogTemp, Warning, TEXT("vertex cache %f %f %f lod %d -> ACMR %f -> %f, fetch %f -> %f"), GetComponentLocation().X, GetComponentLocation().Y, GetComponentLocation().Z,
+				lod, stats.acmr_before, stats.acmr_after, stats.fetch_before, stats.fetch_after);
+		}
+	}
 
 	double end = FPlatformTime::Seconds();
 	double time = (end - start) * 1000;
@@ -99,8 +160,16 @@ void UTerrainZoneComponent::applyTerrainMesh(std::shared_ptr<MeshData> mesh_data
 	MainTerrainMesh->SetMaterial(0, GetTerrainController()->TerrainMaterial);
 	MainTerrainMesh->SetVisibility(true);
 
-	CollisionMesh->SetMeshData(mesh_data_ptr);
-	CollisionMesh->SetCollisionProfileName(TEXT("BlockAll"));
+	// LODs added for the view have no collision, mesh data of older voxel data may come after newer one
+	if (mesh_data->CollisionMeshPtr != NULL && mesh_data->VoxelVersion >= CollisionVoxelVersion) {
+		CollisionMesh->SetMeshData(mesh_data_ptr);
+		CollisionMesh->SetCollisionProfileName(TEXT("BlockAll"));
+
+		CollisionVoxelVersion = mesh_data->VoxelVersion;
+		CollisionLod = mesh_data->CollisionLod;
+	}
+
+	MeshDataSize = MainTerrainMesh->GetMeshDataSize();
 
 	double end = FPlatformTime::Seconds();
 	double time = (end - start) * 1000;
@@ -117,7 +186,21 @@ void UTerrainZoneComponent::applyTerrainMesh(std::shared_ptr<MeshData> mesh_data
 	}
 }
 
-void UTerrainZoneComponent::SaveInstancedMeshesToFile() {
+void UTerrainZoneComponent::DestroyZone() {
+	for (auto& Elem : InstancedMeshMap) {
+		Elem.Value->DestroyComponent();
+	}
+
+	InstancedMeshMap.Empty();
+
+	MainTerrainMesh->DestroyComponent();
+	CollisionMesh->DestroyComponent();
+
+	voxel_data = NULL;
+	DestroyComponent();
+}
+
+FString UTerrainZoneComponent::GetInstancedMeshesFileName() {
 	FString SavePath = FPaths::GameSavedDir();
 	FVector Index = GetTerrainController()->getZoneIndex(GetComponentLocation());
 
@@ -125,7 +208,11 @@ void UTerrainZoneComponent::SaveInstancedMeshesToFile() {
 	int ty = Index.Y;
 	int tz = Index.Z;
 
-	FString FileName = SavePath + TEXT("/Map/") + GetTerrainController()->MapName + TEXT("/zone_inst_mesh.") + FString::FromInt(tx) + TEXT(".") + FString::FromInt(ty) + TEXT(".") + FString::FromInt(tz) + TEXT(".dat");
+	return SavePath + TEXT("/Map/") + GetTerrainController()->MapName + TEXT("/zone_inst_mesh.") + FString::FromInt(tx) + TEXT(".") + FString::FromInt(ty) + TEXT(".") + FString::FromInt(tz) + TEXT(".dat");
+}
+
+void UTerrainZoneComponent::SaveInstancedMeshesToFile() {
+	FString FileName = GetInstancedMeshesFileName();
 
 	FBufferArchive BinaryData;
 
@@ -138,14 +225,7 @@ void UTerrainZoneComponent::SaveInstancedMeshesToFile() {
 }
 
 void UTerrainZoneComponent::LoadInstancedMeshesFromFile() {
-	FString SavePath = FPaths::GameSavedDir();
-	FVector Index = GetTerrainController()->getZoneIndex(GetComponentLocation());
-
-	int tx = Index.X;
-	int ty = Index.Y;
-	int tz = Index.Z;
-
-	FString FileName = SavePath + TEXT("/Map/") + GetTerrainController()->MapName + TEXT("/zone_inst_mesh.") + FString::FromInt(tx) + TEXT(".") + FString::FromInt(ty) + TEXT(".") + FString::FromInt(tz) + TEXT(".dat");
+	FString FileName = GetInstancedMeshesFileName();
 
 	TArray<uint8> BinaryArray;
 	if (!FFileHelper::LoadFileToArray(BinaryArray, *FileName)) {
@@ -0,0 +1,167 @@
+#include "UnrealSandboxTerrainPrivatePCH.h"
+#include "SandboxVoxeldata.h"
+
+#include <vector>
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+static unsigned char testDensity(int x, int y, int z) {
+	return (unsigned char)((x * 37 + y * 11 + z * 5) & 0xFF);
+}
+
+// up to 256 materials in the first bricks, few in the middle ones and one in the rest
+static unsigned char testMaterial(int x, int y, int z) {
+	if (x < VOXEL_BRICK_SIZE) {
+		return (unsigned char)((x * 3 + y * 5 + z * 64) & 0xFF);
+	}
+
+	if (x < VOXEL_BRICK_SIZE * 2) {
+		return (unsigned char)(1 + (y + z) % 3);
+	}
+
+	return 4;
+}
+
+template<typename Layout>
+static bool isBrickLayoutPermutation() {
+	std::vector<bool> used(VOXEL_BRICK_VOLUME, false);
+
+	for (auto x = 0; x < VOXEL_BRICK_SIZE; x++) {
+		for (auto y = 0; y < VOXEL_BRICK_SIZE; y++) {
+			for (auto z = 0; z < VOXEL_BRICK_SIZE; z++) {
+				const int i = Layout::index(x, y, z);
+				if (i < 0 || i >= VOXEL_BRICK_VOLUME || used[i]) {
+					return false;
+				}
+
+				used[i] = true;
+			}
+		}
+	}
+
+	return true;
+}
+
+// Voxels read back as written through every brick, also bricks cut by the zone border and after compaction
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSandboxVoxelBrickLayoutTest, "SandboxTerrain.VoxelData.BrickLayout", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSandboxVoxelBrickLayoutTest::RunTest(const FString& Parameters) {
+	TestTrue(TEXT("linear brick layout is a permutation"), isBrickLayoutPermutation<VoxelLayoutLinear>());
+	TestTrue(TEXT("morton brick layout is a permutation"), isBrickLayoutPermutation<VoxelLayoutMorton>());
+
+	VoxelData vd(33, 1000);
+	for (auto x = 0; x < vd.num(); x++) {
+		for (auto y = 0; y < vd.num(); y++) {
+			for (auto z = 0; z < vd.num(); z++) {
+				vd.setVoxelPoint(x, y, z, testDensity(x, y, z), testMaterial(x, y, z));
+			}
+		}
+	}
+
+	for (auto pass = 0; pass < 2; pass++) {
+		int density_errors = 0;
+		int material_errors = 0;
+
+		for (auto x = 0; x < vd.num(); x++) {
+			for (auto y = 0; y < vd.num(); y++) {
+				for (auto z = 0; z < vd.num(); z++) {
+					if (vd.getRawDensity(x, y, z) != testDensity(x, y, z)) {
+						density_errors++;
+					}
+
+					if (vd.getMaterial(x, y, z) != testMaterial(x, y, z)) {
+						material_errors++;
+					}
+				}
+			}
+		}
+
+		TestEqual(TEXT("voxel density read back"), density_errors, 0);
+		TestEqual(TEXT("voxel material read back"), material_errors, 0);
+
+		vd.compactBricks();
+	}
+
+	return true;
+}
+
+// A snapshot keeps the voxels, density mips and apron it was taken with while the zone is edited
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSandboxVoxelSnapshotTest, "SandboxTerrain.VoxelData.Snapshot", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSandboxVoxelSnapshotTest::RunTest(const FString& Parameters) {
+	VoxelData vd(33, 1000);
+	vd.setDensityMipsEnabled(true);
+
+	for (auto x = 0; x < vd.num(); x++) {
+		for (auto y = 0; y < vd.num(); y++) {
+			for (auto z = 0; z < vd.num(); z++) {
+				vd.setVoxelPoint(x, y, z, testDensity(x, y, z), testMaterial(x, y, z));
+			}
+		}
+	}
+
+	vd.compactBricks();
+	vd.rebuildDensityMips();
+
+	std::vector<unsigned char> apron_slab(vd.num() * vd.num(), 10);
+	vd.setApronFace(0, apron_slab);
+
+	VoxelDataSnapshotPtr snapshot = vd.snapshot();
+
+	std::vector<unsigned char> density_list;
+	for (auto lod = 0; lod < 3; lod++) {
+		for (auto x = 0; x < vd.num(); x += 1 << lod) {
+			density_list.push_back(snapshot->getRawDensityLOD(x, x, x, lod));
+		}
+	}
+
+	// edit like the edit thread does it
+	VoxelDirtyRegion region;
+	vd.beginEdit();
+	for (auto x = 8; x < 16; x++) {
+		for (auto y = 8; y < 16; y++) {
+			for (auto z = 8; z < 16; z++) {
+				vd.setVoxelPoint(x, y, z, 255, 7);
+				region.add(x, y, z);
+			}
+		}
+	}
+	vd.endEdit();
+
+	vd.setChanged();
+	vd.updateDensityMips(region);
+
+	apron_slab.assign(apron_slab.size(), 200);
+	vd.setApronFace(0, apron_slab);
+
+	TestEqual(TEXT("zone has the edit"), (int)vd.getRawDensity(12, 12, 12), 255);
+	TestEqual(TEXT("snapshot density"), (int)snapshot->getRawDensity(12, 12, 12), (int)testDensity(12, 12, 12));
+	TestEqual(TEXT("snapshot material"), snapshot->getMaterial(12, 12, 12), (int)testMaterial(12, 12, 12));
+	TestEqual(TEXT("zone has the new apron"), (int)vd.getRawDensityExt(-1, 5, 5), 200);
+	TestEqual(TEXT("snapshot apron"), (int)snapshot->getRawDensityExt(-1, 5, 5), 10);
+
+	int mip_changes = 0;
+	int snapshot_changes = 0;
+	int i = 0;
+	for (auto lod = 0; lod < 3; lod++) {
+		for (auto x = 0; x < vd.num(); x += 1 << lod) {
+			if (lod > 0 && vd.getRawDensityLOD(x, x, x, lod) != density_list[i]) {
+				mip_changes++;
+			}
+
+			if (snapshot->getRawDensityLOD(x, x, x, lod) != density_list[i]) {
+				snapshot_changes++;
+			}
+
+			i++;
+		}
+	}
+
+	TestTrue(TEXT("zone density mips have the edit"), mip_changes > 0);
+	TestEqual(TEXT("snapshot density mips"), snapshot_changes, 0);
+	TestTrue(TEXT("snapshot is older"), snapshot->getChangeVersion() < vd.getChangeVersion());
+
+	return true;
+}
+
+#endif
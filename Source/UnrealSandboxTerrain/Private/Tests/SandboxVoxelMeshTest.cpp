@@ -0,0 +1,272 @@
+#include "UnrealSandboxTerrainPrivatePCH.h"
+#include "SandboxVoxeldata.h"
+#include "SandboxVoxelGenerator.h"
+
+#include <vector>
+#include <map>
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+// same steps as ASandboxTerrainController::generateTerrain, without the controller
+static void generateTestZone(VoxelData& vd, FVector origin, bool bDensityMips) {
+	vd.setOrigin(origin);
+	vd.setDensityMipsEnabled(bDensityMips);
+
+	SandboxVoxelGenerator generator(vd, 0);
+	for (auto x = 0; x < vd.num(); x++) {
+		for (auto y = 0; y < vd.num(); y++) {
+			for (auto z = 0; z < vd.num(); z++) {
+				FVector local = vd.voxelIndexToVector(x, y, z);
+				FVector world = local + vd.getOrigin();
+				vd.setDensity(x, y, z, generator.density(local, world));
+				vd.setMaterial(x, y, z, generator.material(local, world));
+			}
+		}
+	}
+
+	vd.compactBricks();
+	vd.rebuildDensityMips();
+	vd.rebuildSubstanceCacheLOD();
+	vd.setCacheToValid();
+}
+
+// zone local vertex positions of the section on plane x = plane_x, moved to world
+static void collectPlaneVertices(const FProcMeshPackedSection& section, float plane_x, FVector origin, std::vector<FVector>& list) {
+	for (auto i = 0; i < section.ProcVertexBuffer.Num(); i++) {
+		FVector p = section.GetPosition(i);
+		if (FMath::Abs(p.X - plane_x) < 0.5f) {
+			list.push_back(p + origin);
+		}
+	}
+}
+
+static int countUnmatchedVertices(const std::vector<FVector>& list, const std::vector<FVector>& other) {
+	int count = 0;
+	for (const FVector& p : list) {
+		bool bFound = false;
+		for (const FVector& q : other) {
+			if ((p - q).Size() < 0.5f) {
+				bFound = true;
+				break;
+			}
+		}
+
+		if (!bFound) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+// Transition cells of a zone next to a zone of the finer lod have the same vertices on the shared face as
+// the finer zone. Checked with and without density mips, with the substance cache and the cell grid.
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSandboxTransitionSeamTest, "SandboxTerrain.Mesh.TransitionSeam", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSandboxTransitionSeamTest::RunTest(const FString& Parameters) {
+	const float zone_size = 1000;
+
+	for (auto mode = 0; mode < 4; mode++) {
+		const bool bDensityMips = (mode & 1) != 0;
+		const bool bSubstanceCache = (mode & 2) == 0;
+
+		// coarse zone with the finer one on the X+ face
+		VoxelData coarse(65, zone_size);
+		VoxelData fine(65, zone_size);
+		generateTestZone(coarse, FVector(0, 0, 0), bDensityMips);
+		generateTestZone(fine, FVector(zone_size, 0, 0), bDensityMips);
+
+		if (!bSubstanceCache) {
+			coarse.setChanged();
+			fine.setChanged();
+		}
+
+		VoxelDataParam fine_vdp;
+		fine_vdp.bGenerateLOD = true;
+		for (auto face = 0; face < VOXEL_ZONE_FACES; face++) {
+			fine_vdp.neighbour_lod[face] = LOD_ARRAY_SIZE;
+		}
+
+		MeshDataPtr fine_mesh = sandboxVoxelGenerateMesh(fine, fine_vdp);
+
+		for (auto lod = 1; lod < LOD_ARRAY_SIZE; lod++) {
+			VoxelDataParam coarse_vdp;
+			coarse_vdp.bGenerateLOD = true;
+			for (auto face = 0; face < VOXEL_ZONE_FACES; face++) {
+				coarse_vdp.neighbour_lod[face] = lod - 1;
+			}
+
+			MeshDataPtr coarse_mesh = sandboxVoxelGenerateMesh(coarse, coarse_vdp);
+
+			std::vector<FVector> coarse_list;
+			std::vector<FVector> fine_list;
+			for (auto section = 0; section < 6; section++) {
+				collectPlaneVertices(coarse_mesh->MeshSectionLodArray[lod].transitionMeshArray[section], zone_size / 2, coarse.getOrigin(), coarse_list);
+			}
+
+			collectPlaneVertices(fine_mesh->MeshSectionLodArray[lod - 1].mainMesh, -zone_size / 2, fine.getOrigin(), fine_list);
+
+			TestTrue(TEXT("seam has vertices"), fine_list.size() > 0);
+			TestEqual(TEXT("coarse seam vertices missing in the finer zone"), countUnmatchedVertices(coarse_list, fine_list), 0);
+			TestEqual(TEXT("finer seam vertices missing in the coarse zone"), countUnmatchedVertices(fine_list, coarse_list), 0);
+		}
+	}
+
+	return true;
+}
+
+// Packed vertices keep the position within half a quantization step and the normal direction
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSandboxPackedVertexTest, "SandboxTerrain.Mesh.PackedVertex", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSandboxPackedVertexTest::RunTest(const FString& Parameters) {
+	const FVector normal_list[] = {
+		FVector(1, 0, 0), FVector(-1, 0, 0), FVector(0, 1, 0), FVector(0, -1, 0), FVector(0, 0, 1), FVector(0, 0, -1),
+		FVector(1, 1, 1), FVector(-1, 1, -1), FVector(1, -2, -3), FVector(-0.3f, 0.2f, -0.9f), FVector(0.01f, -0.02f, -1)
+	};
+
+	FProcMeshPackedVertex packed;
+	for (const FVector& normal : normal_list) {
+		packed.SetNormal(normal);
+		TestTrue(TEXT("normal direction"), (packed.GetNormal() | normal.GetSafeNormal()) > 0.9999f);
+	}
+
+	packed.SetNormal(FVector(0, 0, 0));
+	TestTrue(TEXT("zero normal is up"), (packed.GetNormal() - FVector(0, 0, 1)).Size() < 0.0001f);
+
+	const FBox bounds(FVector(-500), FVector(500));
+
+	FProcMeshSection section;
+	for (auto i = 0; i < 1000; i++) {
+		FProcMeshVertex vertex;
+		vertex.Position = FVector((i * 7919) % 1000 - 500, (i * 104729) % 1000 - 500.5f, i - 500) * 0.999f;
+		vertex.Normal = FVector(0, 0, 1);
+		vertex.Color = FColor(i & 0xFF, 0, 0, 0);
+		section.ProcVertexBuffer.Add(vertex);
+		section.ProcIndexBuffer.Add(999 - i);
+	}
+
+	FProcMeshPackedSection packed_section;
+	packed_section.Pack(section, bounds);
+
+	const FVector max_error = packed_section.PositionStep * 0.5f + FVector(0.001f);
+	int position_errors = 0;
+	int weight_errors = 0;
+	for (auto i = 0; i < section.ProcVertexBuffer.Num(); i++) {
+		const FVector error = (packed_section.GetPosition(i) - section.ProcVertexBuffer[i].Position).GetAbs();
+		if (error.X > max_error.X || error.Y > max_error.Y || error.Z > max_error.Z) {
+			position_errors++;
+		}
+
+		if (packed_section.ProcVertexBuffer[i].MaterialWeight != section.ProcVertexBuffer[i].Color.R) {
+			weight_errors++;
+		}
+	}
+
+	TestEqual(TEXT("packed position"), position_errors, 0);
+	TestEqual(TEXT("packed material weight"), weight_errors, 0);
+	TestTrue(TEXT("small section has 16 bit indices"), packed_section.ProcIndexBuffer.Is16Bit());
+	TestEqual(TEXT("packed index"), packed_section.ProcIndexBuffer[10], section.ProcIndexBuffer[10]);
+
+	TArray<int32> index_list;
+	index_list.Add(0);
+	index_list.Add(70000);
+	index_list.Add(65535);
+
+	FProcMeshIndexArray index_array;
+	index_array.Set(index_list, 70001);
+	TestFalse(TEXT("large section has 32 bit indices"), index_array.Is16Bit());
+	TestEqual(TEXT("32 bit index"), index_array[1], 70000);
+
+	return true;
+}
+
+static uint64 clcPackedPositionKey(const FProcMeshPackedVertex& vertex) {
+	return (uint64)vertex.Position[0] | ((uint64)vertex.Position[1] << 16) | ((uint64)vertex.Position[2] << 32);
+}
+
+// Surface nets meshes are closed inside the zone and consistently wound: every inner edge is used as often in one
+// direction as in the other. Thin features can give edges of four triangles, so more than two are allowed.
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FSandboxSurfaceNetsTest, "SandboxTerrain.Mesh.SurfaceNets", EAutomationTestFlags::ApplicationContextMask | EAutomationTestFlags::EngineFilter)
+
+bool FSandboxSurfaceNetsTest::RunTest(const FString& Parameters) {
+	const float zone_size = 1000;
+	const FVector origin_list[] = { FVector(0, 0, 0), FVector(0, 0, -zone_size), FVector(zone_size, 0, 0) };
+
+	for (const FVector& origin : origin_list) {
+		VoxelData vd(65, zone_size);
+		generateTestZone(vd, origin, false);
+
+		VoxelDataParam vdp;
+		vdp.bGenerateLOD = true;
+		vdp.bSurfaceNets = true;
+
+		MeshDataPtr md_ptr = sandboxVoxelGenerateMesh(vd, vdp);
+		TestTrue(TEXT("surface nets mesh"), md_ptr->MeshSectionLodArray[0].mainMesh.ProcIndexBuffer.Num() > 0);
+
+		// coarse LODs of a small surface can be empty
+		for (auto lod = 0; lod < LOD_ARRAY_SIZE; lod++) {
+			const FProcMeshPackedSection& section = md_ptr->MeshSectionLodArray[lod].mainMesh;
+			const int vertex_num = section.ProcVertexBuffer.Num();
+
+			TestEqual(TEXT("whole triangles"), section.ProcIndexBuffer.Num() % 3, 0);
+
+			// quantized positions at the zone faces
+			const uint16 face_min = 0;
+			const uint16 face_max = MAX_uint16;
+
+			std::map<std::pair<uint64, uint64>, int> edge_count;
+			int index_errors = 0;
+
+			for (auto i = 0; i + 2 < section.ProcIndexBuffer.Num(); i += 3) {
+				const FProcMeshPackedVertex* vertex[3];
+				bool bValid = true;
+				for (auto j = 0; j < 3; j++) {
+					const int index = section.ProcIndexBuffer[i + j];
+					if (index < 0 || index >= vertex_num) {
+						bValid = false;
+						break;
+					}
+
+					vertex[j] = &section.ProcVertexBuffer[index];
+				}
+
+				if (!bValid) {
+					index_errors++;
+					continue;
+				}
+
+				for (auto j = 0; j < 3; j++) {
+					const FProcMeshPackedVertex& a = *vertex[j];
+					const FProcMeshPackedVertex& b = *vertex[(j + 1) % 3];
+
+					// edges on a zone face are open, the neighbour zone closes them
+					bool bFaceEdge = false;
+					for (auto axis = 0; axis < 3; axis++) {
+						if (a.Position[axis] == b.Position[axis] && (a.Position[axis] == face_min || a.Position[axis] == face_max)) {
+							bFaceEdge = true;
+						}
+					}
+
+					if (!bFaceEdge) {
+						edge_count[std::make_pair(clcPackedPositionKey(a), clcPackedPositionKey(b))]++;
+					}
+				}
+			}
+
+			int edge_errors = 0;
+			for (const auto& edge : edge_count) {
+				const auto reverse = edge_count.find(std::make_pair(edge.first.second, edge.first.first));
+				if (edge.first.first != edge.first.second && (reverse == edge_count.end() || reverse->second != edge.second)) {
+					edge_errors++;
+				}
+			}
+
+			TestEqual(TEXT("surface nets indices"), index_errors, 0);
+			TestEqual(TEXT("surface nets open or flipped inner edges"), edge_errors, 0);
+		}
+	}
+
+	return true;
+}
+
+#endif
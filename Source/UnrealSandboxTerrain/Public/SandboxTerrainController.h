@@ -4,16 +4,23 @@
 #include "SandboxVoxelGenerator.h"
 #include <memory>
 #include <queue>
+#include <list>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "SandboxTerrainController.generated.h"
 
 struct MeshData;
+struct VoxelDirtyRegion;
 class VoxelData;
 class FLoadInitialZonesThread;
 class USandboxTerrainMeshComponent;
 class UTerrainZoneComponent;
 class UTerrainRegionComponent;
 
+template<class H>
+class FTerrainEditThread;
+
 #define TH_STATE_NEW		0
 #define TH_STATE_RUNNING	1
 #define TH_STATE_STOP		2
@@ -84,6 +91,9 @@ public:
 	friend FLoadInitialZonesThread;
 	friend UTerrainZoneComponent;
 
+	template<class H>
+	friend class FTerrainEditThread;
+
 	virtual void BeginPlay() override;
 
 	virtual void Tick(float DeltaSeconds) override;
@@ -122,6 +132,46 @@ public:
 	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
 	bool bEnableLOD;
 
+	// LOD meshes are built from filtered, downsampled density instead of every n-th voxel
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bEnableDensityMips;
+
+	// zones keep a copy of the neighbour voxels behind their faces, so normals match across zone borders
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bEnableZoneApron;
+
+	// vertex normals are the density gradient at the vertex instead of the average of the triangle normals
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bGradientNormals;
+
+	// zones are meshed with naive surface nets instead of Transvoxel, faster and coarser. There are no
+	// transition cells, so with LOD there are cracks between zones of different LOD
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bSurfaceNets;
+
+	// Mesh threads reorder triangles and vertices of the zone sections for the GPU vertex cache and vertex fetch.
+	// Off by default, the extractor order already reads the vertex buffer about once.
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bOptimizeVertexCache;
+
+	// with bOptimizeVertexCache, each zone mesh logs the cache miss and vertex fetch ratios of its main sections
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	bool bLogVertexCacheStats;
+
+	// LOD the collision of the zones next to the view is meshed with when LOD is enabled, 0 - full resolution.
+	// Coarser collision is cheaper but the player can sink into or float over the drawn terrain. Farther zones
+	// take the coarsest LOD of their distance band, both are built for the view anyway.
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain", meta = (ClampMin = "0", ClampMax = "1"))
+	int32 CollisionLOD;
+
+	// Voxel data and meshes of resident zones, 0 - no limit. Least recently touched zones
+	// farther than ZoneEvictionDistance from the player are saved and released above it.
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	int32 ZoneMemoryBudgetMB = 0;
+
+	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain")
+	float ZoneEvictionDistance = 5000;
+
 	UPROPERTY(EditAnywhere, Category = "UnrealSandbox Terrain Foliage")
 	TMap<uint32, FSandboxFoliage> FoliageMap;
 
@@ -147,6 +197,9 @@ public:
 
 	virtual SandboxVoxelGenerator newTerrainGenerator(VoxelData &voxel_data);
 
+	UFUNCTION(BlueprintCallable, Category = "UnrealSandbox Debug")
+	void RunTerrainBenchmark();
+
 private:
 	TMap<FVector, UTerrainZoneComponent*> TerrainZoneMap;
 
@@ -164,8 +217,14 @@ private:
 
 	void invokeZoneMeshAsync(UTerrainZoneComponent* zone, std::shared_ptr<MeshData> mesh_data_ptr);
 
+	void invokeZoneMeshAsync(FVector index, std::shared_ptr<MeshData> mesh_data_ptr);
+
 	void invokeLazyZoneAsync(FVector index);
 
+	void SyncZoneApron(FVector index, VoxelData* vd, const VoxelDirtyRegion& region, bool bReceive, TArray<FVector>& UpdatedZoneList);
+
+	void RemeshApronZones();
+
 	void AddAsyncTask(TerrainControllerTask zone_make_task);
 
 	TerrainControllerTask GetAsyncTask();
@@ -180,7 +239,80 @@ private:
 
 	TMap<FVector, VoxelData*> VoxelDataMap;
 
+	// resident zones, least recently registered or looked up first, guarded by VoxelDataMapMutex
+	std::list<FVector> ZoneLruList;
+
+	TMap<FVector, std::list<FVector>::iterator> ZoneLruMap;
+
+	void TouchZoneLru(FVector index);
+
+	// zones released by the memory budget, loaded again on access, guarded by VoxelDataMapMutex
+	TSet<FVector> EvictedZoneSet;
+
+	// evicted zones a pool thread saves and releases, until they are added to EvictedZoneSet.
+	// Guarded by VoxelDataMapMutex, other threads looking them up wait for VoxelDataRestored.
+	TSet<FVector> SavingZoneSet;
+
+	// running eviction saves, EndPlay waits for them
+	std::atomic<int> ZoneSaveTaskCount;
+
+	// evicted zones one thread loads again, until RegisterTerrainVoxelData adds them to VoxelDataMap.
+	// Guarded by VoxelDataMapMutex, other threads looking them up wait for VoxelDataRestored.
+	TSet<FVector> RestoringZoneSet;
+
+	std::condition_variable VoxelDataRestored;
+
+	// meshed zones that got the apron of a loaded neighbour, guarded by VoxelDataMapMutex, see RemeshApronZones
+	TSet<FVector> ApronRemeshZoneSet;
+
+	// running background restores, zones are not evicted while they run and EndPlay stops and waits for them
+	std::atomic<int> ZoneRestoreTaskCount;
+
+	std::atomic<bool> bStopZoneRestore;
+
+	// running edit threads, zones are not evicted while they can hold voxel data pointers
+	std::atomic<int> ActiveTerrainEditCount;
+
+	double LastZoneResidencyCheck = 0;
+
+	// view location of the first player at the last tick, for mesh threads, guarded by ViewLocationMutex
+	FVector ViewLocation;
+
+	bool bHasViewLocation = false;
+
+	std::mutex ViewLocationMutex;
+
+	void UpdateViewLocation();
+
+	bool GetViewLocation(FVector& Location);
+
+	// zones meshed in the background for UpdateZoneLods until the mesh is applied, game thread only
+	TSet<FVector> ZoneLodPendingSet;
+
+	// running lod mesh tasks, EndPlay stops and waits for them before the voxel data is deleted
+	std::atomic<int> ZoneLodTaskCount;
+
+	std::atomic<bool> bStopZoneLod;
+
+	double LastZoneLodCheck = 0;
+
+	int GetZoneLod(FVector index, const FVector& Location);
+
+	void GetZoneNeighbourLod(FVector index, const FVector& Location, int* NeighbourLod);
+
+	int GetZoneCollisionLod(int Lod);
+
+	void UpdateZoneLods();
+
 	void RegisterTerrainVoxelData(VoxelData* vd, FVector index);
+
+	VoxelData* RestoreEvictedZone(FVector index);
+
+	void RestoreEvictedZonesAsync(const TArray<FVector>& IndexList);
+
+	void CheckZoneResidency();
+
+	void EvictZonesAsync(const TArray<FVector>& IndexList);
 
 	VoxelData* GetTerrainVoxelDataByPos(FVector point);
 
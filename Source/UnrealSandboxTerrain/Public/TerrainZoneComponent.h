@@ -48,16 +48,43 @@ public:
 
 	void applyTerrainMesh(std::shared_ptr<MeshData> mesh_data_ptr);
 
-	std::shared_ptr<MeshData> generateMesh();
+	// LodMask 0 - LODs the distance from the view needs and the collision, the others are added later by the controller.
+	// With bUpdateCollision the collision of the band is taken from the added LODs.
+	std::shared_ptr<MeshData> generateMesh(int LodMask = 0, bool bUpdateCollision = false);
+
+	// parameters generateMesh meshes the zone with, from the controller settings and the view
+	VoxelDataParam makeMeshParam(int LodMask = 0, bool bUpdateCollision = false);
 
 	void SerializeInstancedMeshes(FBufferArchive& binaryData);
 
+	FString GetInstancedMeshesFileName();
+
 	void SaveInstancedMeshesToFile();
 
 	void LoadInstancedMeshesFromFile();
 
 	void SpawnInstancedMesh(FTerrainInstancedMeshType& MeshType, FTransform& transform);
 
+	// vertex and index buffers of the applied LODs
+	SIZE_T GetMeshDataSize() const {
+		return MeshDataSize;
+	}
+
+	// lod the applied collision is meshed with, -1 if there is none
+	int GetCollisionLod() const {
+		return CollisionLod;
+	}
+
+	// destroy mesh, collision and foliage components and the zone itself
+	void DestroyZone();
+
 private:
 	VoxelData* voxel_data;
+
+	SIZE_T MeshDataSize = 0;
+
+	// VoxelData::getChangeVersion() of the collision mesh
+	uint64 CollisionVoxelVersion = 0;
+
+	int CollisionLod = -1;
 };
\ No newline at end of file
@@ -51,6 +51,9 @@ public class UnrealSandboxTerrain : ModuleRules
 			);
 		
 		
+		// 1 - store voxel bricks in Morton (Z-curve) order, 0 - plain x-major order
+		Definitions.Add("VOXEL_DATA_LAYOUT_MORTON=0");
+
 		DynamicallyLoadedModuleNames.AddRange(
 			new string[]
 			{